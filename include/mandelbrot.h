@@ -0,0 +1,169 @@
+/*
+    Fractal Image Generator
+
+    Author: Alberto Boldrini
+
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef MANDELBROT_H
+#define MANDELBROT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Marks the functions exported by the shared library
+#define MANDELBROT_API __attribute__ ((visibility ("default")))
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+// The layouts of the pixels, as the PixelFormat of the engine
+typedef enum mandelbrot_format
+{
+    MANDELBROT_RGB8    = 0,     // 3 bytes per pixel: red, green, blue
+    MANDELBROT_RGBA8   = 1,     // 4 bytes per pixel: red, green, blue, alpha (always opaque)
+    MANDELBROT_XRGB32  = 2,     // 32 bit words 0xXXRRGGBB in native byte order
+    MANDELBROT_RGB16   = 3,     // 3 unsigned shorts per pixel in native byte order
+    MANDELBROT_FLOAT32 = 4      // 3 floats per pixel with linear intensities
+} mandelbrot_format;
+
+// The parameters of an image. It must be initialized with mandelbrot_request_init,
+// which also sets its size: members added in new versions go at the end, so
+// programs compiled with an older header keep working.
+typedef struct mandelbrot_request
+{
+    // Size of this structure as known by the caller
+    uint32_t size;
+
+    // The corners of the image in the complex plane
+    double left, top;
+    double right, bottom;
+
+    // Dimensions of the image in pixels
+    int64_t width, height;
+
+    // Parameters for the rendering
+    int32_t max_iterations;
+    double stop_norm;
+
+    // Colors of the outside, palette_colors triples of red, green and blue;
+    // with a null palette the default one is used
+    const uint8_t *palette;
+    int32_t palette_colors;
+
+    // Color of the points inside the fractal
+    uint8_t interior[3];
+
+    // A mandelbrot_format value
+    int32_t format;
+
+    // Side of the square tiles computed by a thread
+    int64_t tile_size;
+
+    // Memory of the images the renderer allocates: "heap", "thp", "hugetlb" or "file:PATH";
+    // null for the heap
+    const char *storage;
+
+    // The tiles computed first: those in the region_count rectangles of regions, given as
+    // left, top, right and bottom in pixels (right and bottom excluded), then the others from
+    // the focus point outwards, given as a fraction of the width and of the height
+    double focus_x, focus_y;
+    const int64_t *regions;
+    int32_t region_count;
+} mandelbrot_request;
+
+// The predicted cost of a render, with the bounds of each value
+typedef struct mandelbrot_estimate
+{
+    // Iterations of the whole image
+    double iterations, iterations_low, iterations_high;
+
+    // Seconds of the render with the threads of the renderer
+    double seconds, seconds_low, seconds_high;
+
+    // Peak resident memory of the process in bytes, including the pixels
+    double memory, memory_low, memory_high;
+} mandelbrot_estimate;
+
+typedef struct mandelbrot_renderer mandelbrot_renderer;
+
+// An asynchronous render
+typedef struct mandelbrot_job mandelbrot_job;
+
+// Called on a thread of the renderer when a tile is ready, with the rectangle of the tile
+// (right and bottom excluded), its first pixel and the distance between the rows
+typedef void (*mandelbrot_tile_callback) (void *user, int64_t left, int64_t top, int64_t right, int64_t bottom,
+                                          unsigned char *pixels, size_t stride);
+
+// Sets the default values of a request: the whole fractal, 2200 x 1250 pixels
+MANDELBROT_API void mandelbrot_request_init (mandelbrot_request *request);
+
+// Creates a renderer with its threads (0 for one per core) and, if the directory
+// is not null, a cache of the tiles on disk. Returns null on errors.
+MANDELBROT_API mandelbrot_renderer *mandelbrot_renderer_create (unsigned threads, const char *cache_directory, 
+                                                                uint64_t cache_bytes);
+
+MANDELBROT_API void mandelbrot_renderer_destroy (mandelbrot_renderer *renderer);
+
+// Renders an image in the memory of the caller, whose rows are stride bytes apart.
+// The functions return 0 on success and -1 on errors.
+MANDELBROT_API int mandelbrot_render (mandelbrot_renderer *renderer, const mandelbrot_request *request, 
+                                      void *pixels, size_t stride);
+
+// Renders an image and the smoothed number of iterations of its pixels (infinity inside
+// the fractal), stored in rows of iteration_stride floats
+MANDELBROT_API int mandelbrot_render_iterations (mandelbrot_renderer *renderer, const mandelbrot_request *request, 
+                                                 void *pixels, size_t stride, float *iterations, size_t iteration_stride);
+
+// Starts rendering an image in the memory of the caller, which must stay valid until the
+// end of the render; on_tile can be null. Returns null on errors.
+MANDELBROT_API mandelbrot_job *mandelbrot_render_async (mandelbrot_renderer *renderer, const mandelbrot_request *request,
+                                                        void *pixels, size_t stride, 
+                                                        mandelbrot_tile_callback on_tile, void *user);
+
+// Waits the end of a render, returns its status
+MANDELBROT_API int mandelbrot_job_wait (mandelbrot_job *job);
+
+// Returns 1 when the render has ended, 0 otherwise
+MANDELBROT_API int mandelbrot_job_ready (mandelbrot_job *job);
+
+// Waits the end of a render and releases it
+MANDELBROT_API void mandelbrot_job_destroy (mandelbrot_job *job);
+
+// Renders an image and writes it to a file, the format is chosen from the extension
+MANDELBROT_API int mandelbrot_render_file (mandelbrot_renderer *renderer, const mandelbrot_request *request, 
+                                           const char *filename, int level);
+
+// Predicts the cost of a render from a sparse probe of its pixels. ns_per_iteration is the
+// cost of an iteration on one thread of this host, as measured by the benchmarks, or 0
+// to measure it with the probe.
+MANDELBROT_API int mandelbrot_estimate_render (mandelbrot_renderer *renderer, const mandelbrot_request *request,
+                                               double ns_per_iteration, mandelbrot_estimate *estimate);
+
+// Bytes used by a pixel of a format
+MANDELBROT_API size_t mandelbrot_bytes_per_pixel (int32_t format);
+
+// The message of the last error of the calling thread
+MANDELBROT_API const char *mandelbrot_last_error (void);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
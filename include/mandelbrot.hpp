@@ -0,0 +1,234 @@
+/*
+    Fractal Image Generator
+
+    Author: Alberto Boldrini
+
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef MANDELBROT_HPP
+#define MANDELBROT_HPP
+
+#include "mandelbrot.h"
+
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+
+#if defined (__cpp_impl_coroutine) && __has_include (<coroutine>)
+#include <coroutine>
+#endif
+
+
+// The public interface of the fractal engine. The errors are reported with exceptions.
+namespace mandelbrot
+{
+
+// The layouts of the pixels
+enum class Format
+{
+    RGB8    = MANDELBROT_RGB8,
+    RGBA8   = MANDELBROT_RGBA8,
+    XRGB32  = MANDELBROT_XRGB32,
+    RGB16   = MANDELBROT_RGB16,
+    Float32 = MANDELBROT_FLOAT32
+};
+
+// A 8 bit color
+struct Rgb
+{
+    uint8_t red;
+    uint8_t green;
+    uint8_t blue;
+};
+
+// A rectangle of an image in pixels, right and bottom excluded
+struct Rect
+{
+    int64_t left, top;
+    int64_t right, bottom;
+};
+
+// The parameters of an image
+struct RenderRequest
+{
+    // The corners of the image in the complex plane
+    double left   = -2.7;
+    double top    = +1.25;
+    double right  = +1.7;
+    double bottom = -1.25;
+
+    // Dimensions of the image in pixels
+    int64_t width  = 2200;
+    int64_t height = 1250;
+
+    // Parameters for the rendering
+    int maxIterations = 100;
+    double stopNorm = 400;
+
+    // Colors of the outside, when empty the default ones are used
+    std::vector<Rgb> palette;
+
+    // Color of the points inside the fractal
+    Rgb interior = {0, 0, 0};
+
+    // Layout of the pixels
+    Format format = Format::RGB8;
+
+    // Side of the square tiles computed by a thread
+    int64_t tileSize = 64;
+
+    // Memory of the images the renderer allocates: heap, thp, hugetlb or file:PATH
+    std::string storage = "heap";
+
+    // The tiles computed first: those in the regions, in the order of the list, then the others
+    // from the focus point outwards, given as a fraction of the width and of the height
+    double focusX = 0.5;
+    double focusY = 0.5;
+    std::vector<Rect> regions;
+};
+
+// Bytes used by a pixel of a format
+MANDELBROT_API size_t bytesPerPixel (Format format);
+
+// The predicted cost of a render, with the bounds of each value
+struct Estimate
+{
+    // Iterations of the whole image
+    double iterations, iterationsLow, iterationsHigh;
+
+    // Seconds of the render with the threads of the renderer
+    double seconds, secondsLow, secondsHigh;
+
+    // Peak resident memory of the process in bytes, including the pixels
+    double memory, memoryLow, memoryHigh;
+};
+
+// A tile of an image which has just been rendered
+struct TileView
+{
+    // The rectangle of the tile in the image, right and bottom excluded
+    int64_t left, top;
+    int64_t right, bottom;
+
+    // The first pixel of the tile in the buffer, and the distance between the rows
+    unsigned char *pixels;
+    size_t stride;
+};
+
+// Called on a thread of the renderer when a tile is ready
+using TileCallback = std::function<void (const TileView &tile)>;
+
+// The end of an asynchronous render
+struct MANDELBROT_API RenderHandle
+{
+    // Waits the end of the render and throws its error, if any
+    void wait () const;
+
+    // True when the render has ended
+    bool ready () const;
+
+    // Calls a function when the render ends, on a thread of the renderer,
+    // or at once when it has already ended
+    void then (std::function<void (std::exception_ptr error)> callback) const;
+
+    // The end of the render as a future
+    std::shared_future<void> future () const;
+
+    // Shared with the threads which render the image
+    struct State;
+    std::shared_ptr<State> state;
+};
+
+#if defined (__cpp_impl_coroutine) && __has_include (<coroutine>)
+// Makes a render awaitable from a coroutine, which is resumed on a thread of the renderer
+struct RenderAwaiter
+{
+    RenderHandle handle;
+
+    bool await_ready () const
+    {
+        return handle.ready ();
+    }
+
+    void await_suspend (std::coroutine_handle<> coroutine) const
+    {
+        handle.then ([coroutine] (std::exception_ptr) { coroutine.resume (); });
+    }
+
+    void await_resume () const
+    {
+        handle.wait ();
+    }
+};
+
+inline RenderAwaiter operator co_await (const RenderHandle &handle)
+{
+    return RenderAwaiter {handle};
+}
+#endif
+
+// This structure renders images with its own threads and, optionally, a cache of
+// the tiles on disk. Different threads can render with the same renderer at once.
+struct MANDELBROT_API Renderer
+{
+    // Starts the threads, 0 for one per core
+    explicit Renderer (unsigned threads = 0, const std::string &cacheDirectory = "", 
+                       uint64_t cacheBytes = uint64_t (1) << 30);
+
+    Renderer (const Renderer &) = delete;
+    Renderer &operator= (const Renderer &) = delete;
+
+    ~Renderer ();
+
+    // Renders an image in the memory of the caller, whose rows are stride bytes apart
+    void render (const RenderRequest &request, void *pixels, size_t stride);
+
+    // Renders an image and the smoothed iterations of its pixels in the memory of the caller
+    void render (const RenderRequest &request, void *pixels, size_t stride, float *iterations, size_t iterationStride);
+
+    // Starts rendering an image in the memory of the caller, which must stay valid
+    // until the end of the render. onTile is called for each tile as soon as it is ready.
+    // When iterations is not null, the smoothed number of iterations of each pixel
+    // (infinity inside the fractal) is also stored there, in rows of iterationStride floats.
+    RenderHandle submit (const RenderRequest &request, void *pixels, size_t stride, TileCallback onTile = nullptr,
+                         float *iterations = nullptr, size_t iterationStride = 0);
+
+    // Renders an image in a new buffer, without space between the rows
+    std::vector<unsigned char> render (const RenderRequest &request);
+
+    // Renders an image and writes it to a file, the format is chosen from the extension
+    void renderFile (const RenderRequest &request, const std::string &filename, int level = 6);
+
+    // Predicts the cost of a render from a sparse probe of its pixels, without rendering it.
+    // nsPerIteration is the cost of an iteration on one thread of this host, as measured
+    // by the benchmarks, or 0 to measure it with the probe.
+    Estimate estimate (const RenderRequest &request, double nsPerIteration = 0);
+
+    // Number of threads
+    unsigned threads () const;
+
+    // The pool and the cache, hidden from the users of the library
+    struct State;
+    std::unique_ptr<State> state;
+};
+
+}
+
+#endif
@@ -0,0 +1,191 @@
+/*
+    Fractal Image Generator
+
+    Author: Alberto Boldrini
+
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef ANIMATION_HPP
+#define ANIMATION_HPP
+
+#include "fractal.hpp"
+
+
+// The formats of the video streams
+enum class VideoFormat
+{
+    Y4M,        // YUV4MPEG2 with 4:2:0 chroma, read directly by ffmpeg and most encoders
+    RGB         // Raw 8 bit RGB frames without any header
+};
+
+// This structure computes a zoom animation and streams its frames to a file or a pipe.
+// Each frame is computed by the thread pool, and for Y4M also converted to YUV 4:2:0 by it.
+struct Animation
+{
+    // The first frame is the view of the fractal, the following ones zoom towards a point
+    // keeping it still on the screen. Each frame is smaller than the previous one by zoomFactor.
+    Animation (const Mandlebrot &fractal, double targetX, double targetY, int64_t nFrames,
+               double zoomFactor = 0.98, int fps = 30, VideoFormat format = VideoFormat::Y4M)
+        : fractal (fractal)
+        , targetX (targetX)
+        , targetY (targetY)
+        , nFrames (nFrames)
+        , zoomFactor (zoomFactor)
+        , fps (fps)
+        , format (format)
+    {
+    }
+
+    // Returns the fractal of a frame, without its image
+    Mandlebrot view (int64_t f) const
+    {
+        double scale = std::pow (zoomFactor, double (f));
+
+        // The corners move towards the target
+        double left   = targetX + (fractal.left   - targetX) * scale;
+        double right  = targetX + (fractal.right  - targetX) * scale;
+        double top    = targetY + (fractal.top    - targetY) * scale;
+        double bottom = targetY + (fractal.bottom - targetY) * scale;
+
+        return fractal.view (fractal.width, fractal.height, left, top, right, bottom);
+    }
+
+    // Computes a frame
+    Image frame (int64_t f, ThreadPool &pool)
+    {
+        Mandlebrot view = this->view (f);
+        view.image = Image (fractal.width, fractal.height);
+        view.computeMultiCore (TileOrder::centerOut (), pool);
+
+        return std::move (view.image);
+    }
+
+    // Converts a frame to the Y, Cb and Cr planes using the pool. The values are limited
+    // range BT.601 (Y in 16-235, Cb and Cr in 16-240), which is what the Y4M readers expect;
+    // the chroma is centered in each 2x2 block, as C420jpeg says.
+    static void toYuv420 (const Image &image, std::vector<unsigned char> &planes, ThreadPool &pool)
+    {
+        int64_t w = image.width, h = image.height;
+        int64_t cw = (w + 1) / 2, ch = (h + 1) / 2;
+
+        planes.resize (w * h + 2 * cw * ch);
+
+        unsigned char *Y  = planes.data();
+        unsigned char *Cb = Y + w * h;
+        unsigned char *Cr = Cb + cw * ch;
+
+        // Each task converts a band of pairs of rows
+        int64_t bandPairs = 16;
+        int64_t nBands = (ch + bandPairs - 1) / bandPairs;
+
+        TaskGroup tasks (pool);
+
+        for (int64_t b = 0; b < nBands; b++)
+        {
+            tasks.submit (1.0, [&, b]
+            {
+                for (int64_t cy = b * bandPairs; cy < std::min (ch, (b + 1) * bandPairs); cy++)
+                    for (int64_t cx = 0; cx < cw; cx++)
+                    {
+                        // Sums the chroma of the 2x2 block
+                        double sumCb = 0, sumCr = 0;
+                        int n = 0;
+
+                        for (int64_t y = 2 * cy; y < std::min (h, 2 * cy + 2); y++)
+                            for (int64_t x = 2 * cx; x < std::min (w, 2 * cx + 2); x++)
+                            {
+                                Color c = image.getPixel (x, y);
+
+                                Y[y * w + x] = (unsigned char) std::lround (16 + (65.481 * c.red + 128.553 * c.green + 24.966 * c.blue) / 255);
+
+                                sumCb += 128 + (-37.797 * c.red - 74.203 * c.green + 112.0 * c.blue) / 255;
+                                sumCr += 128 + (112.0 * c.red - 93.786 * c.green - 18.214 * c.blue) / 255;
+                                n++;
+                            }
+
+                        Cb[cy * cw + cx] = (unsigned char) std::min (255l, std::lround (sumCb / n));
+                        Cr[cy * cw + cx] = (unsigned char) std::min (255l, std::lround (sumCr / n));
+                    }
+            });
+        }
+
+        tasks.wait ();
+    }
+
+    // Computes all the frames and writes them: "-" is the standard output
+    void write (const std::string &filename, ThreadPool &pool = ThreadPool::global ())
+    {
+        FILE *fp = openOutput (filename);
+
+        if (format == VideoFormat::Y4M)
+            fprintf (fp, "YUV4MPEG2 W%lld H%lld F%d:1 Ip A1:1 C420jpeg\n", 
+                     (long long) fractal.width, (long long) fractal.height, fps);
+
+        else if (fractal.log)
+            *fractal.log << "Raw video: -f rawvideo -pix_fmt rgb24 -s " << fractal.width << "x" << fractal.height 
+                         << " -r " << fps << std::endl;
+
+        std::vector<unsigned char> buffer;
+
+        for (int64_t f = 0; f < nFrames; f++)
+        {
+            Image image = frame (f, pool);
+
+            if (format == VideoFormat::Y4M)
+            {
+                toYuv420 (image, buffer, pool);
+
+                fputs ("FRAME\n", fp);
+                fwrite (buffer.data(), 1, buffer.size(), fp);
+            }
+
+            else
+            {
+                buffer.resize (image.width * 3);
+
+                for (int64_t y = 0; y < image.height; y++)
+                {
+                    Encoder::rgbRow (image, y, buffer.data());
+                    fwrite (buffer.data(), 1, buffer.size(), fp);
+                }
+            }
+
+            if (fractal.log)
+                *fractal.log << "\rFrame " << f + 1 << " of " << nFrames << std::flush;
+        }
+
+        if (fractal.log)
+            *fractal.log << "\n";
+
+        fclose (fp);
+    }
+
+    // The first frame and its parameters
+    const Mandlebrot &fractal;
+
+    // The point of the complex plane where the animation zooms
+    double targetX, targetY;
+
+    // Number of frames and reduction of each frame
+    int64_t nFrames;
+    double zoomFactor;
+
+    // Frames per second and format of the stream
+    int fps;
+    VideoFormat format;
+};
+
+#endif
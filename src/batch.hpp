@@ -0,0 +1,359 @@
+/*
+    Fractal Image Generator
+
+    Author: Alberto Boldrini
+
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef BATCH_HPP
+#define BATCH_HPP
+
+#include "fractal.hpp"
+#include "json.hpp"
+
+
+// This structure renders the jobs read as JSON lines from a stream or from the files
+// of a spool directory, and writes a JSON line with the result of each job.
+// A job is an object with the members (all optional except "output"):
+//
+//   {"id": 1, "view": [left, top, right, bottom], "width": 256, "height": 256,
+//    "formula": "z^2+c", "iterations": 100, "stop_norm": 400,
+//    "palette": ["#000028", [0, 50, 100]], "interior": "#000000",
+//    "output": "thumb.png", "format": "png", "level": 6}
+//
+// Missing values are taken from the fractal given to the worker; with only one
+// of the dimensions the other keeps the proportions of the view. The jobs run
+// concurrently on the pool, each one on a single thread, since the batches are
+// made of many small images.
+struct BatchWorker
+{
+    BatchWorker (const Mandlebrot &fractal, int64_t maxJobs = 0, ThreadPool &pool = ThreadPool::global ())
+        : fractal (fractal)
+        , maxJobs (maxJobs > 0 ? maxJobs : 2 * pool.size ())
+        , pool (pool)
+        , request (pool.newRequest ())
+        , nJobs (0)
+        , running (0)
+    {
+    }
+
+    // Reads a color, as "#rrggbb" or as [red, green, blue]
+    static Color colorOf (const Json &value)
+    {
+        if (value.type == Json::Type::String && value.string.size () == 7 && value.string[0] == '#')
+        {
+            unsigned long rgb = std::stoul (value.string.substr (1), nullptr, 16);
+            return Color {(unsigned char) (rgb >> 16), (unsigned char) (rgb >> 8), (unsigned char) rgb};
+        }
+
+        if (value.type == Json::Type::Array && value.array.size () == 3)
+        {
+            unsigned char rgb[3];
+
+            for (int i = 0; i < 3; i++)
+            {
+                if (value.array[i].type != Json::Type::Number)
+                    throw std::runtime_error ("Invalid color " + value.dump ());
+
+                rgb[i] = (unsigned char) std::min (std::max (value.array[i].number, 0.0), 255.0);
+            }
+
+            return Color {rgb[0], rgb[1], rgb[2]};
+        }
+
+        throw std::runtime_error ("Invalid color " + value.dump ());
+    }
+
+    // Renders a job and returns the members of its result
+    std::string render (const Json &job)
+    {
+        if (job.type != Json::Type::Object)
+            throw std::runtime_error ("A job must be an object");
+
+        if (job.stringOr ("formula", Mandlebrot::formula) != Mandlebrot::formula)
+            throw std::runtime_error ("Unsupported formula " + job["formula"].string);
+
+        std::string output = job.stringOr ("output", "");
+
+        if (output.empty ())
+            throw std::runtime_error ("\"output\" is missing");
+
+        // The area of the complex plane
+        double left = fractal.left, top = fractal.top, right = fractal.right, bottom = fractal.bottom;
+        const Json &area = job["view"];
+
+        if (!area.isNull ())
+        {
+            if (area.type != Json::Type::Array || area.array.size () != 4)
+                throw std::runtime_error ("\"view\" must be [left, top, right, bottom]");
+
+            for (const Json &corner : area.array)
+                if (corner.type != Json::Type::Number)
+                    throw std::runtime_error ("\"view\" must be [left, top, right, bottom]");
+
+            left   = area.array[0].number;
+            top    = area.array[1].number;
+            right  = area.array[2].number;
+            bottom = area.array[3].number;
+        }
+
+        if (!(right > left) || !(top > bottom))
+            throw std::runtime_error ("Empty view");
+
+        // The dimensions of the image
+        double width  = job.numberOr ("width", 0);
+        double height = job.numberOr ("height", 0);
+
+        if (width <= 0 && height <= 0)
+        {
+            width  = fractal.width;
+            height = fractal.height;
+        }
+
+        else if (width <= 0)
+            width = height * (right - left) / (top - bottom);
+
+        else if (height <= 0)
+            height = width * (top - bottom) / (right - left);
+
+        width  = std::max (std::round (width), 1.0);
+        height = std::max (std::round (height), 1.0);
+
+        if (width * height > 1e9)
+            throw std::runtime_error ("Image too big");
+
+        Mandlebrot view = fractal.view (width, height, left, top, right, bottom);
+
+        view.maxIterations = job.numberOr ("iterations", view.maxIterations);
+
+        // The smoothing depends on the norm where the iterations stop
+        view.stopNorm = job.numberOr ("stop_norm", view.stopNorm);
+
+        if (!(view.stopNorm > 4))
+            throw std::runtime_error ("\"stop_norm\" must be greater than 4, the square of the escape radius");
+
+        view.bSmooth  = log2 (0.5 * log2 (view.stopNorm)) * view.mSmooth;
+
+        const Json &palette = job["palette"];
+
+        if (!palette.isNull ())
+        {
+            if (palette.type != Json::Type::Array || palette.array.size () < 2)
+                throw std::runtime_error ("\"palette\" must have at least two colors");
+
+            view.colorList.clear ();
+
+            for (const Json &color : palette.array)
+                view.colorList.push_back (colorOf (color));
+        }
+
+        if (!job["interior"].isNull ())
+            view.bodyColor = colorOf (job["interior"]);
+
+        std::string formatName = job.stringOr ("format", "auto");
+        FileFormat format = Encoder::formatNamed (formatName);
+
+        if (format == FileFormat::Auto)
+            format = Encoder::formatOf (output);
+
+        int level = std::min (std::max (int (job.numberOr ("level", 6)), 0), 9);
+
+        // Computes the image on this thread, the tiles can come from the cache
+        auto start = std::chrono::steady_clock::now ();
+
+        view.image = Image (view.width, view.height);
+
+        for (int64_t y = 0; y < view.height; y += view.tileSize)
+            for (int64_t x = 0; x < view.width; x += view.tileSize)
+                view.computeTile (Tile {x, y, std::min (x + view.tileSize, view.width), std::min (y + view.tileSize, view.height)},
+                                  view.image, x, y);
+
+        auto computed = std::chrono::steady_clock::now ();
+
+        // The encoder would wait for the pool from one of its threads
+        std::unique_ptr<Encoder> encoder = Encoder::create (format, level);
+        encoder->pool = nullptr;
+
+        FILE *fp = openOutput (output);
+
+        encoder->write (view.image, fp);
+        fclose (fp);
+
+        auto written = std::chrono::steady_clock::now ();
+
+        std::ostringstream result;
+        result << "\"output\":" << Json::quote (output)
+               << ",\"width\":" << view.width << ",\"height\":" << view.height
+               << ",\"compute_seconds\":" << std::chrono::duration <double> (computed - start).count()
+               << ",\"write_seconds\":" << std::chrono::duration <double> (written - computed).count();
+
+        return result.str ();
+    }
+
+    // Schedules a job read from a line, the result is written when it ends.
+    // The function returns when the number of running jobs is below the limit.
+    // The source is kept alive until the end of the job.
+    void submit (const std::string &line, const std::string &origin, std::shared_ptr<void> source = nullptr)
+    {
+        // Empty lines are ignored
+        if (line.find_first_not_of (" \t\r") == std::string::npos)
+            return;
+
+        std::unique_lock<std::mutex> lock (mutex);
+        finished.wait (lock, [this] { return running < maxJobs; });
+
+        running++;
+
+        // The jobs are started in the order they were read
+        int64_t number = nJobs++;
+        auto queued = std::chrono::steady_clock::now ();
+
+        lock.unlock ();
+
+        pool.submit (request, -double (number), [this, line, origin, source, number, queued]
+        {
+            auto start = std::chrono::steady_clock::now ();
+
+            std::string id = "null";
+            std::string result;
+
+            try
+            {
+                Json job = Json::parse (line);
+
+                if (job.type == Json::Type::Object && !job["id"].isNull ())
+                    id = job["id"].dump ();
+
+                result = "\"status\":\"ok\"," + render (job);
+            }
+            catch (const std::exception &e)
+            {
+                result = "\"status\":\"error\",\"error\":" + Json::quote (e.what ());
+            }
+
+            auto end = std::chrono::steady_clock::now ();
+
+            std::lock_guard<std::mutex> lock (mutex);
+
+            output << "{\"id\":" << id << ",\"source\":" << Json::quote (origin) << "," << result
+                   << ",\"queue_seconds\":" << std::chrono::duration <double> (start - queued).count()
+                   << ",\"total_seconds\":" << std::chrono::duration <double> (end - queued).count()
+                   << "}" << std::endl;
+
+            running--;
+            finished.notify_all ();
+        });
+    }
+
+    // Waits the end of all the jobs
+    void wait ()
+    {
+        std::unique_lock<std::mutex> lock (mutex);
+        finished.wait (lock, [this] { return running == 0; });
+    }
+
+    // Runs the jobs of a stream until its end
+    void run (std::istream &input)
+    {
+        std::string line;
+        int64_t lineNumber = 0;
+
+        while (std::getline (input, line))
+            submit (line, "line " + std::to_string (++lineNumber));
+
+        wait ();
+    }
+
+    // Runs the jobs of the files *.jsonl of a directory, forever. A file is claimed by
+    // renaming it, so more workers can share the directory, and it is renamed again
+    // when all its jobs have ended.
+    void runSpool (const std::string &directory)
+    {
+        namespace fs = std::filesystem;
+
+        // Renames the file from .working to .done when the last of its jobs ends
+        struct SpoolFile
+        {
+            ~SpoolFile ()
+            {
+                std::error_code error;
+
+                if (!path.empty ())
+                    fs::rename (path, fs::path (path).replace_extension (".done"), error);
+            }
+
+            fs::path path;
+        };
+
+        while (true)
+        {
+            std::vector<fs::path> files;
+
+            for (const fs::directory_entry &entry : fs::directory_iterator (directory))
+                if (entry.path ().extension () == ".jsonl")
+                    files.push_back (entry.path ());
+
+            // The oldest names first
+            std::sort (files.begin (), files.end ());
+
+            for (const fs::path &path : files)
+            {
+                std::shared_ptr<SpoolFile> claimed (new SpoolFile {fs::path (path).replace_extension (".working")});
+                std::error_code error;
+
+                // Another worker took it
+                fs::rename (path, claimed->path, error);
+
+                if (error)
+                {
+                    claimed->path.clear ();
+                    continue;
+                }
+
+                std::ifstream input (claimed->path);
+                std::string line;
+                int64_t lineNumber = 0;
+
+                while (std::getline (input, line))
+                    submit (line, path.filename ().string () + ":" + std::to_string (++lineNumber), claimed);
+            }
+
+            if (files.empty ())
+                std::this_thread::sleep_for (std::chrono::seconds (1));
+        }
+    }
+
+    // Default parameters and colors of the jobs
+    const Mandlebrot &fractal;
+
+    // Number of jobs which can be queued or running at the same time
+    int64_t maxJobs;
+
+    ThreadPool &pool;
+    unsigned long request;
+
+    // Where the results are written
+    std::ostream &output = std::cout;
+
+    // Jobs read and jobs not yet ended
+    int64_t nJobs;
+    int64_t running;
+
+    std::mutex mutex;
+    std::condition_variable finished;
+};
+
+#endif
@@ -0,0 +1,771 @@
+/*
+    Fractal Image Generator
+
+    Author: Alberto Boldrini
+
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// The benchmarks of the engine: a set of canonical views is rendered with each scheduler,
+// after some warmup runs, and the times of the repetitions are reported as nanoseconds
+// per pixel and iterations per second, as text, JSON or CSV. A saved JSON report can be
+// given as a baseline: the slower results are reported and the program fails.
+// With --scaling the tile schedulers run with pools of 1 to --max-threads threads
+// and the speedup, the efficiency and the time lost waiting the last thread are reported.
+// With --perf the hardware counters of the repetitions are also reported for each pixel.
+// With --verify the faster ways of computing are compared with the reference, see Verifier.
+
+#include "fractal.hpp"
+#include "json.hpp"
+#include "verify.hpp"
+
+
+// A view of the fractal used to measure the engine
+struct Scene
+{
+    const char *name;
+
+    // Center and width of the view in the complex plane
+    double centerX, centerY;
+    double width;
+
+    int maxIterations;
+};
+
+// The canonical views, from the cheapest to the most expensive per pixel
+static const Scene scenes[] = 
+{
+    {"full",      -0.5,                0.0,               4.4,    100},     // The whole set, as in the program
+    {"seahorse",  -0.745,              0.11,              0.03,   500},     // Seahorse valley, a mix of everything
+    {"interior",  -0.3,                0.0,               0.6,    1000},    // Inside the main cardioid
+    {"boundary",  -0.7436438870,       0.1318259042,      1e-4,   5000},    // Close to the border, many iterations
+    {"deep",      -0.743643887037151,  0.131825904205330, 1e-13,  2000},    // Near the limit of double precision
+};
+
+// A way to distribute the work between the threads
+struct Scheduler
+{
+    const char *name;
+
+    // Side of the tiles, 0 to compute the image on the calling thread
+    int64_t tileSize;
+
+    // The tiles closest to this point, as a fraction of the image, come first
+    double focusX, focusY;
+
+    bool tiled () const
+    {
+        return tileSize > 0;
+    }
+
+    TileOrder order () const
+    {
+        return TileOrder::focus (focusX, focusY);
+    }
+
+    void compute (Mandlebrot &fractal, ThreadPool &pool) const
+    {
+        if (!tiled ())
+            return fractal.computeSingleCore ();
+
+        fractal.tileSize = tileSize;
+        fractal.computeMultiCore (order (), pool);
+    }
+};
+
+static const Scheduler schedulers[] = 
+{
+    {"single",        0,   0.5, 0.5},
+    {"tiles-center",  64,  0.5, 0.5},
+    {"tiles-corner",  64,  0,   0},
+    {"tiles-16",      16,  0.5, 0.5},
+    {"tiles-256",     256, 0.5, 0.5},
+};
+
+// The measures of a scene with a scheduler
+struct Result
+{
+    std::string scene;
+    std::string kernel;
+    std::string precision;
+    std::string scheduler;
+
+    int64_t width, height;
+    unsigned threads;
+
+    // Iterations of the sequences made for the whole image
+    double iterations;
+
+    // Seconds taken by each repetition
+    std::vector<double> seconds;
+
+    // Hardware counters of all the repetitions, with --perf
+    PerfCounters::Values perf;
+
+    double pixels () const
+    {
+        return double (width) * height;
+    }
+
+    double median () const
+    {
+        std::vector<double> sorted = seconds;
+        std::sort (sorted.begin(), sorted.end());
+
+        size_t n = sorted.size();
+        return n % 2 ? sorted[n / 2] : 0.5 * (sorted[n / 2 - 1] + sorted[n / 2]);
+    }
+
+    double mean () const
+    {
+        double sum = 0;
+
+        for (double s : seconds)
+            sum += s;
+
+        return sum / seconds.size();
+    }
+
+    // Sample variance of the times
+    double variance () const
+    {
+        if (seconds.size() < 2)
+            return 0;
+
+        double m = mean (), sum = 0;
+
+        for (double s : seconds)
+            sum += (s - m) * (s - m);
+
+        return sum / (seconds.size() - 1);
+    }
+
+    double minimum () const
+    {
+        return *std::min_element (seconds.begin(), seconds.end());
+    }
+
+    // The key used to match the results of two reports
+    std::string key () const
+    {
+        return scene + "/" + kernel + "/" + precision + "/" + scheduler;
+    }
+
+    double nsPerPixel () const
+    {
+        return median () * 1e9 / pixels ();
+    }
+
+    double iterationsPerSecond () const
+    {
+        return iterations / median ();
+    }
+};
+
+// Returns the fractal of a scene, with an image of the given dimensions
+static Mandlebrot fractalOf (const Scene &scene, int64_t width, int64_t height)
+{
+    double w = scene.width, h = scene.width * height / width;
+
+    Mandlebrot fractal (1, scene.centerX - 0.5 * w, scene.centerY + 0.5 * h, scene.centerX + 0.5 * w, scene.centerY - 0.5 * h,
+                        PixelFormat::RGB8, Storage {StorageKind::None});
+
+    fractal.width  = width;
+    fractal.height = height;
+    fractal.image  = Image (width, height);
+    fractal.maxIterations = scene.maxIterations;
+    fractal.log = nullptr;
+
+    // The colors of the program
+    fractal.colorList = {Color {  0,   0,  40}, Color {  0,  50, 100}, Color {  0, 200,   0},
+                         Color {255, 255, 100}, Color {255, 255, 255}};
+
+    return fractal;
+}
+
+// The measures of a scheduler with a number of threads
+struct ScalingResult
+{
+    std::string scene;
+    std::string scheduler;
+    unsigned threads;
+
+    // Median of the seconds taken and of the straggler time
+    double seconds;
+    double straggler;
+
+    // Relative to a single thread
+    double speedup;
+    double efficiency;
+};
+
+// Computes an image with the tiles of a scheduler and returns the seconds taken.
+// The straggler time is the gap between the first and the last thread of the
+// pool finishing its last tile; the threads without tiles finish at the start.
+static double computeTimed (Mandlebrot &fractal, const Scheduler &scheduler, ThreadPool &pool, double &straggler)
+{
+    using Clock = std::chrono::steady_clock;
+
+    std::mutex mutex;
+    std::condition_variable finished;
+    bool ended = false;
+
+    // When each thread has finished its last tile
+    std::map<std::thread::id, Clock::time_point> lastTile;
+
+    fractal.tileSize = scheduler.tileSize;
+
+    auto start = Clock::now ();
+
+    fractal.computeAsync (scheduler.order (), pool, [&] (const Tile &)
+    {
+        auto now = Clock::now ();
+
+        std::lock_guard<std::mutex> lock (mutex);
+        lastTile[std::this_thread::get_id ()] = now;
+    },
+    [&] (std::exception_ptr)
+    {
+        std::lock_guard<std::mutex> lock (mutex);
+
+        ended = true;
+        finished.notify_one ();
+    });
+
+    std::unique_lock<std::mutex> lock (mutex);
+    finished.wait (lock, [&] { return ended; });
+
+    auto end = Clock::now ();
+
+    Clock::time_point first = end, last = start;
+
+    for (const auto &thread : lastTile)
+    {
+        first = std::min (first, thread.second);
+        last  = std::max (last, thread.second);
+    }
+
+    if (lastTile.size () < pool.size ())
+        first = start;
+
+    straggler = std::chrono::duration <double> (last - std::min (first, last)).count();
+
+    return std::chrono::duration <double> (end - start).count();
+}
+
+static double medianOf (std::vector<double> values)
+{
+    std::sort (values.begin(), values.end());
+
+    size_t n = values.size();
+    return n % 2 ? values[n / 2] : 0.5 * (values[n / 2 - 1] + values[n / 2]);
+}
+
+// Writes the results as a table
+static void writeText (std::ostream &out, const std::vector<Result> &results)
+{
+    char line[256];
+
+    snprintf (line, sizeof (line), "%-10s %-8s %-9s %-13s %10s %12s %10s %12s\n", 
+              "scene", "kernel", "precision", "scheduler", "ns/pixel", "stddev", "min", "Mit/s");
+    out << line;
+
+    for (const Result &r : results)
+    {
+        snprintf (line, sizeof (line), "%-10s %-8s %-9s %-13s %10.2f %11.1f%% %10.2f %12.1f\n", 
+                  r.scene.c_str(), r.kernel.c_str(), r.precision.c_str(), r.scheduler.c_str(), r.nsPerPixel (),
+                  100 * std::sqrt (r.variance ()) / r.mean (), r.minimum () * 1e9 / r.pixels (), r.iterationsPerSecond () / 1e6);
+        out << line;
+    }
+
+    if (!PerfCounters::on ())
+        return;
+
+    // The counters for each pixel, a column is empty when its counter is not available
+    snprintf (line, sizeof (line), "\n%-42s %8s %12s %12s %12s %12s %12s %6s\n", "counters for each pixel", "cpu ns", 
+              "cycles", "instructions", "L1D misses", "LLC misses", "br misses", "IPC");
+    out << line;
+
+    for (const Result &r : results)
+    {
+        double n = r.pixels () * r.seconds.size();
+        std::string columns;
+
+        for (int e = PerfCounters::taskClock; e < PerfCounters::vector; e++)
+        {
+            char column[32] = "";
+
+            if (r.perf.available[e])
+                snprintf (column, sizeof (column), e == PerfCounters::taskClock ? " %8.1f" : " %12.1f", r.perf.counts[e] / n);
+            else
+                snprintf (column, sizeof (column), e == PerfCounters::taskClock ? " %8s" : " %12s", "-");
+
+            columns += column;
+        }
+
+        snprintf (line, sizeof (line), "%-42s%s %6.2f\n", r.key ().c_str(), columns.c_str(), r.perf.instructionsPerCycle ());
+        out << line;
+    }
+
+    if (!PerfCounters::global ().error.empty ())
+        out << "Not all the counters are available: " << PerfCounters::global ().error << "\n";
+}
+
+static void writeJson (std::ostream &out, const std::vector<Result> &results)
+{
+    out.precision (9);
+    out << "{\"benchmarks\": [\n";
+
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const Result &r = results[i];
+
+        out << "  {\"scene\": " << Json::quote (r.scene) << ", \"kernel\": " << Json::quote (r.kernel)
+            << ", \"precision\": " << Json::quote (r.precision) << ", \"scheduler\": " << Json::quote (r.scheduler)
+            << ", \"width\": " << r.width << ", \"height\": " << r.height << ", \"threads\": " << r.threads
+            << ", \"iterations\": " << r.iterations << ", \"median_seconds\": " << r.median ()
+            << ", \"mean_seconds\": " << r.mean () << ", \"variance\": " << r.variance ()
+            << ", \"min_seconds\": " << r.minimum () << ", \"ns_per_pixel\": " << r.nsPerPixel ()
+            << ", \"iterations_per_second\": " << r.iterationsPerSecond () << ", \"seconds\": [";
+
+        for (size_t j = 0; j < r.seconds.size(); j++)
+            out << (j ? ", " : "") << r.seconds[j];
+
+        out << "]";
+
+        // The counters of a repetition, null when not available
+        if (PerfCounters::on ())
+        {
+            out << ", \"perf\": {";
+
+            for (int e = 0; e < PerfCounters::nEvents; e++)
+            {
+                out << (e ? ", " : "") << Json::quote (PerfCounters::name (e)) << ": ";
+
+                if (r.perf.available[e])
+                    out << r.perf.counts[e] / r.seconds.size();
+                else
+                    out << "null";
+            }
+
+            out << "}";
+        }
+
+        out << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+
+    out << "]}\n";
+}
+
+static void writeCsv (std::ostream &out, const std::vector<Result> &results)
+{
+    out.precision (9);
+    out << "scene,kernel,precision,scheduler,width,height,threads,iterations,median_seconds,mean_seconds,"
+           "variance,min_seconds,ns_per_pixel,iterations_per_second\n";
+
+    for (const Result &r : results)
+        out << r.scene << "," << r.kernel << "," << r.precision << "," << r.scheduler << "," << r.width << ","
+            << r.height << "," << r.threads << "," << r.iterations << "," << r.median () << "," << r.mean () << ","
+            << r.variance () << "," << r.minimum () << "," << r.nsPerPixel () << "," << r.iterationsPerSecond () << "\n";
+}
+
+static void writeScaling (std::ostream &out, const std::vector<ScalingResult> &results, const std::string &format)
+{
+    char line[256];
+
+    if (format == "json")
+    {
+        out.precision (9);
+        out << "{\"scaling\": [\n";
+
+        for (size_t i = 0; i < results.size(); i++)
+        {
+            const ScalingResult &r = results[i];
+
+            out << "  {\"scene\": " << Json::quote (r.scene) << ", \"scheduler\": " << Json::quote (r.scheduler)
+                << ", \"threads\": " << r.threads << ", \"median_seconds\": " << r.seconds 
+                << ", \"straggler_seconds\": " << r.straggler << ", \"speedup\": " << r.speedup 
+                << ", \"efficiency\": " << r.efficiency << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+        }
+
+        out << "]}\n";
+    }
+
+    else if (format == "csv")
+    {
+        out.precision (9);
+        out << "scene,scheduler,threads,median_seconds,straggler_seconds,speedup,efficiency\n";
+
+        for (const ScalingResult &r : results)
+            out << r.scene << "," << r.scheduler << "," << r.threads << "," << r.seconds << "," 
+                << r.straggler << "," << r.speedup << "," << r.efficiency << "\n";
+    }
+
+    else
+    {
+        snprintf (line, sizeof (line), "%-10s %-13s %7s %12s %9s %11s %14s\n", 
+                  "scene", "scheduler", "threads", "median ms", "speedup", "efficiency", "straggler ms");
+        out << line;
+
+        for (const ScalingResult &r : results)
+        {
+            snprintf (line, sizeof (line), "%-10s %-13s %7u %12.3f %9.2f %10.1f%% %14.3f\n", r.scene.c_str(), 
+                      r.scheduler.c_str(), r.threads, r.seconds * 1e3, r.speedup, r.efficiency * 100, r.straggler * 1e3);
+            out << line;
+        }
+    }
+}
+
+// Compares the results with a JSON report, returns the number of regressions.
+// A result is slower when its median exceeds the one of the baseline by more than threshold.
+static int compare (std::ostream &out, const std::vector<Result> &results, const std::string &filename, double threshold)
+{
+    std::ifstream input (filename);
+
+    if (!input)
+        throw std::runtime_error ("Cannot open " + filename);
+
+    std::stringstream text;
+    text << input.rdbuf ();
+
+    Json baseline = Json::parse (text.str ());
+    std::map<std::string, double> medians;
+
+    for (const Json &b : baseline["benchmarks"].array)
+        medians[b.stringOr ("scene", "") + "/" + b.stringOr ("kernel", "") + "/" + b.stringOr ("precision", "") + "/" +
+                b.stringOr ("scheduler", "")] = b.numberOr ("ns_per_pixel", 0);
+
+    int regressions = 0;
+    char line[256];
+
+    out << "\nCompared with " << filename << " (threshold " << threshold * 100 << "%)\n";
+
+    for (const Result &r : results)
+    {
+        auto found = medians.find (r.key ());
+
+        if (found == medians.end () || found->second <= 0)
+        {
+            out << r.key () << ": not in the baseline\n";
+            continue;
+        }
+
+        double change = r.nsPerPixel () / found->second - 1;
+        bool slower = change > threshold;
+
+        regressions += slower;
+
+        snprintf (line, sizeof (line), "%-40s %10.2f -> %10.2f ns/pixel %+7.1f%%%s\n", r.key ().c_str(), 
+                  found->second, r.nsPerPixel (), change * 100, slower ? "  REGRESSION" : "");
+        out << line;
+    }
+
+    return regressions;
+}
+
+int main (int argc, char **argv)
+{
+    // Options of the command line
+    int64_t width = 256, height = 256;
+    int warmup = 1;
+    int repetitions = 5;
+    std::string format = "text";
+    std::string output;
+    std::string baseline;
+    double threshold = 0.05;
+    std::string onlyScene, onlyScheduler;
+    bool scaling = false;
+    bool verify = false;
+    bool sized = false;
+    std::string golden;
+    unsigned maxThreads = std::max (std::thread::hardware_concurrency (), 1u);
+
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+
+        // Options which take a value
+        bool hasValue = i + 1 < argc;
+
+        if (arg == "--size" && i + 2 < argc)
+        {
+            width  = std::max (atoll (argv[++i]), 1ll);
+            height = std::max (atoll (argv[++i]), 1ll);
+            sized  = true;
+        }
+
+        else if (arg == "--warmup" && hasValue)
+            warmup = std::max (atoi (argv[++i]), 0);
+
+        else if (arg == "--repetitions" && hasValue)
+            repetitions = std::max (atoi (argv[++i]), 1);
+
+        else if (arg == "--format" && hasValue)
+            format = argv[++i];
+
+        else if (arg == "--output" && hasValue)
+            output = argv[++i];
+
+        else if (arg == "--compare" && hasValue)
+            baseline = argv[++i];
+
+        else if (arg == "--threshold" && hasValue)
+            threshold = atof (argv[++i]) / 100;
+
+        else if (arg == "--scene" && hasValue)
+            onlyScene = argv[++i];
+
+        else if (arg == "--scheduler" && hasValue)
+            onlyScheduler = argv[++i];
+
+        else if (arg == "--scaling")
+            scaling = true;
+
+        else if (arg == "--verify")
+            verify = true;
+
+        else if (arg == "--golden" && hasValue)
+        {
+            verify = true;
+            golden = argv[++i];
+        }
+
+        else if (arg == "--perf")
+            PerfCounters::global ().start ();
+
+        else if (arg == "--perf-vector" && hasValue)
+            PerfCounters::global ().start (strtoull (argv[++i], nullptr, 0));
+
+        else if (arg == "--max-threads" && hasValue)
+            maxThreads = std::max (atoi (argv[++i]), 1);
+
+        else
+        {
+            std::cerr << "Unknown option " << arg << std::endl;
+            return 1;
+        }
+    }
+
+    if (format != "text" && format != "json" && format != "csv")
+    {
+        std::cerr << "Unknown format " << format << std::endl;
+        return 1;
+    }
+
+    // Writes the report
+    std::ofstream file;
+
+    if (!output.empty ())
+    {
+        file.open (output);
+
+        if (!file)
+        {
+            std::cerr << "Cannot open " << output << std::endl;
+            return 1;
+        }
+    }
+
+    std::ostream &out = output.empty () ? std::cout : file;
+
+    // Shows the progress on a single line
+    auto progress = [] (const std::string &text)
+    {
+        char line[64];
+        snprintf (line, sizeof (line), "\r%-60s", text.c_str());
+        std::cerr << line << std::flush;
+    };
+
+    if (verify)
+    {
+        // Every way of computing runs for each scene, so the images are smaller by default
+        if (!sized)
+            width = height = 96;
+
+        // A single thread, a pair, and all of them
+        Verifier verifier ({1, 2, std::max (maxThreads, 3u)});
+        verifier.goldenDirectory = golden;
+
+        char line[256];
+        int failures = 0;
+
+        snprintf (line, sizeof (line), "%-10s %-18s %12s %12s %10s %10s %9s %s\n", "scene", "variant", 
+                  "max error", "mean error", "interior", "differing", "max diff", "result");
+        out << line;
+
+        for (const Scene &scene : scenes)
+        {
+            if (!onlyScene.empty () && onlyScene != scene.name)
+                continue;
+
+            Mandlebrot fractal = fractalOf (scene, width, height);
+
+            auto comparisons = verifier.run (scene.name, fractal, [&] (const std::string &variant) 
+            { 
+                progress (std::string (scene.name) + "/" + variant); 
+            });
+
+            std::cerr << "\r" << std::string (61, ' ') << "\r" << std::flush;
+
+            for (const Verifier::Comparison &c : comparisons)
+            {
+                if (c.hasField)
+                    snprintf (line, sizeof (line), "%-10s %-18s %12.3g %12.3g %10lld %10lld %9d %s\n", scene.name, c.variant.c_str(), 
+                              c.maxError, c.meanError, (long long) c.interiorMismatches, (long long) c.differingPixels, 
+                              c.maxChannelError, c.passed ? "pass" : "FAIL");
+                else
+                    snprintf (line, sizeof (line), "%-10s %-18s %12s %12s %10s %10lld %9d %s\n", scene.name, c.variant.c_str(), 
+                              "-", "-", "-", (long long) c.differingPixels, c.maxChannelError, c.passed ? "pass" : "FAIL");
+                out << line;
+
+                failures += !c.passed;
+            }
+        }
+
+        out << (failures ? std::to_string (failures) + " checks failed" : "All the checks passed") << std::endl;
+        return failures ? 1 : 0;
+    }
+
+    if (scaling)
+    {
+        // Doubles the threads up to the maximum, which is always measured
+        std::vector<unsigned> counts;
+
+        for (unsigned n = 1; n < maxThreads; n *= 2)
+            counts.push_back (n);
+
+        counts.push_back (maxThreads);
+
+        std::vector<ScalingResult> results;
+
+        for (unsigned n : counts)
+        {
+            ThreadPool pool (n);
+
+            for (const Scene &scene : scenes)
+            {
+                if (!onlyScene.empty () && onlyScene != scene.name)
+                    continue;
+
+                Mandlebrot fractal = fractalOf (scene, width, height);
+
+                for (const Scheduler &scheduler : schedulers)
+                {
+                    if (!scheduler.tiled () || (!onlyScheduler.empty () && onlyScheduler != scheduler.name))
+                        continue;
+
+                    progress (std::string (scene.name) + "/" + scheduler.name + " with " + std::to_string (n) + " threads");
+
+                    std::vector<double> seconds, stragglers;
+
+                    for (int r = 0; r < warmup + repetitions; r++)
+                    {
+                        double straggler;
+                        double s = computeTimed (fractal, scheduler, pool, straggler);
+
+                        if (r >= warmup)
+                        {
+                            seconds.push_back (s);
+                            stragglers.push_back (straggler);
+                        }
+                    }
+
+                    results.push_back (ScalingResult {scene.name, scheduler.name, n, medianOf (seconds), medianOf (stragglers), 1, 1});
+                }
+            }
+        }
+
+        // The speedups are relative to the single thread of the same scene and scheduler
+        for (ScalingResult &r : results)
+            for (const ScalingResult &base : results)
+                if (base.threads == 1 && base.scene == r.scene && base.scheduler == r.scheduler)
+                {
+                    r.speedup = base.seconds / r.seconds;
+                    r.efficiency = r.speedup / r.threads;
+                }
+
+        std::cerr << "\r" << std::string (61, ' ') << "\r" << std::flush;
+
+        writeScaling (out, results, format);
+        return 0;
+    }
+
+    ThreadPool &pool = ThreadPool::global ();
+    std::vector<Result> results;
+
+    for (const Scene &scene : scenes)
+    {
+        if (!onlyScene.empty () && onlyScene != scene.name)
+            continue;
+
+        Mandlebrot fractal = fractalOf (scene, width, height);
+
+        for (const Scheduler &scheduler : schedulers)
+        {
+            if (!onlyScheduler.empty () && onlyScheduler != scheduler.name)
+                continue;
+
+            Result result {scene.name, "scalar", Mandlebrot::precision, scheduler.name, width, height, 
+                           std::string (scheduler.name) == "single" ? 1u : pool.size (), 0, {}};
+
+            for (int r = 0; r < warmup + repetitions; r++)
+            {
+                Counters::Values before = Counters::total ();
+                PerfCounters::Values perfBefore = PerfCounters::global ().total ();
+                auto start = std::chrono::steady_clock::now ();
+
+                scheduler.compute (fractal, pool);
+
+                auto end = std::chrono::steady_clock::now ();
+
+                // Every run executes the same iterations
+                result.iterations = (Counters::total () - before).iterations;
+
+                if (r >= warmup)
+                {
+                    result.seconds.push_back (std::chrono::duration <double> (end - start).count());
+
+                    PerfCounters::Values perf = PerfCounters::global ().total () - perfBefore;
+
+                    for (int e = 0; e < PerfCounters::nEvents; e++)
+                    {
+                        result.perf.counts[e] += perf.counts[e];
+                        result.perf.available[e] = perf.available[e];
+                    }
+                }
+            }
+
+            progress (result.key ());
+            results.push_back (std::move (result));
+        }
+    }
+
+    std::cerr << "\r" << std::string (61, ' ') << "\r" << std::flush;
+
+    if (format == "json")
+        writeJson (out, results);
+
+    else if (format == "csv")
+        writeCsv (out, results);
+
+    else
+        writeText (out, results);
+
+    // The comparison always goes to the standard output
+    if (!baseline.empty () && compare (std::cout, results, baseline, threshold) > 0)
+        return 2;
+
+    return 0;
+}
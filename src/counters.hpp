@@ -0,0 +1,165 @@
+/*
+    Fractal Image Generator
+
+    Author: Alberto Boldrini
+
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef COUNTERS_HPP
+#define COUNTERS_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <sys/resource.h>
+
+#if defined (__x86_64__) || defined (__i386__)
+#include <x86intrin.h>
+#endif
+
+
+// This structure counts the work done in the hot paths of the renders. Each thread
+// adds to its own counters, which are summed only when the totals are requested:
+// the difference of the totals before and after a render is the work of the render
+struct Counters
+{
+    // Counts of work
+    struct Values
+    {
+        // Steps of the formula executed
+        uint64_t iterations = 0;
+
+        // Pixels outside and inside the fractal
+        uint64_t escaped = 0;
+        uint64_t interior = 0;
+
+        // Pixels read from the cache instead of computed
+        uint64_t cached = 0;
+
+        Values operator- (const Values &other) const
+        {
+            return Values {iterations - other.iterations, escaped - other.escaped,
+                           interior - other.interior, cached - other.cached};
+        }
+
+        uint64_t pixels () const
+        {
+            return escaped + interior + cached;
+        }
+    };
+
+    // The counters of a thread, only written by it
+    struct Thread
+    {
+        std::atomic<uint64_t> iterations {0};
+        std::atomic<uint64_t> escaped {0};
+        std::atomic<uint64_t> interior {0};
+        std::atomic<uint64_t> cached {0};
+
+        static void add (std::atomic<uint64_t> &counter, uint64_t n)
+        {
+            // A single writer doesn't need an atomic addition
+            counter.store (counter.load (std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        }
+    };
+
+    // Counts a computed pixel and its steps
+    static void pixel (uint64_t iterations, bool inside)
+    {
+        Thread &thread = local ();
+
+        Thread::add (thread.iterations, iterations);
+        Thread::add (inside ? thread.interior : thread.escaped, 1);
+    }
+
+    // Counts pixels read from the cache
+    static void cached (uint64_t pixels)
+    {
+        Thread::add (local ().cached, pixels);
+    }
+
+    // The sum of the counters of all the threads, also of the ended ones
+    static Values total ()
+    {
+        Counters &counters = global ();
+        std::lock_guard<std::mutex> lock (counters.mutex);
+
+        Values values;
+
+        for (const auto &thread : counters.threads)
+        {
+            values.iterations += thread->iterations.load (std::memory_order_relaxed);
+            values.escaped    += thread->escaped.load (std::memory_order_relaxed);
+            values.interior   += thread->interior.load (std::memory_order_relaxed);
+            values.cached     += thread->cached.load (std::memory_order_relaxed);
+        }
+
+        return values;
+    }
+
+    // A cheap clock for short measures: the time stamp counter of the processor
+    // where available, otherwise the nanoseconds of the steady clock
+    static uint64_t cycles ()
+    {
+#if defined (__x86_64__) || defined (__i386__)
+        return __rdtsc ();
+#else
+        return std::chrono::duration_cast<std::chrono::nanoseconds> (std::chrono::steady_clock::now ().time_since_epoch ()).count();
+#endif
+    }
+
+    // The largest resident memory of the process so far, in bytes
+    static uint64_t peakMemory ()
+    {
+        struct rusage usage;
+        getrusage (RUSAGE_SELF, &usage);
+
+        // Linux reports kilobytes
+        return uint64_t (usage.ru_maxrss) * 1024;
+    }
+
+    static Counters &global ()
+    {
+        static Counters counters;
+        return counters;
+    }
+
+    // The counters of the calling thread, created with its first use
+    static Thread &local ()
+    {
+        static thread_local Thread *thread = nullptr;
+
+        if (!thread)
+        {
+            Counters &counters = global ();
+            std::lock_guard<std::mutex> lock (counters.mutex);
+
+            counters.threads.emplace_back (new Thread);
+            thread = counters.threads.back ().get ();
+        }
+
+        return *thread;
+    }
+
+    // The counters of all the threads, kept after their end
+    std::mutex mutex;
+    std::vector<std::unique_ptr<Thread>> threads;
+};
+
+#endif
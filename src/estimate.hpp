@@ -0,0 +1,159 @@
+/*
+    Fractal Image Generator
+
+    Author: Alberto Boldrini
+
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef ESTIMATE_HPP
+#define ESTIMATE_HPP
+
+#include "fractal.hpp"
+#include "json.hpp"
+
+
+// The cost of a computation on a host, in nanoseconds of one thread for each iteration,
+// with the range seen in the measures
+struct IterationCost
+{
+    double nanoseconds = 0;
+    double low = 0;
+    double high = 0;
+
+    // Reads the cost from a JSON report of the benchmarks, using the renders with tiles
+    static IterationCost fromReport (const std::string &filename)
+    {
+        std::ifstream file (filename);
+        std::stringstream text;
+        text << file.rdbuf ();
+
+        if (!file)
+            throw std::runtime_error ("Cannot read " + filename);
+
+        const Json report = Json::parse (text.str ());
+        std::vector<double> costs;
+
+        for (const Json &result : report["benchmarks"].array)
+        {
+            double iterations = result.numberOr ("iterations", 0);
+
+            if (iterations > 0 && result.stringOr ("scheduler", "").compare (0, 5, "tiles") == 0)
+                costs.push_back (result.numberOr ("median_seconds", 0) * result.numberOr ("threads", 1) * 1e9 / iterations);
+        }
+
+        if (costs.empty ())
+            throw std::runtime_error (filename + " has no results of renders with tiles");
+
+        std::sort (costs.begin(), costs.end());
+        return IterationCost {costs[costs.size() / 2], costs.front (), costs.back ()};
+    }
+};
+
+// This structure predicts the cost of a render before doing it: a sparse grid of pixels
+// is computed, and their iterations are extrapolated to the whole image. The time is the
+// iterations by the cost of an iteration on this host, from the benchmarks or from the
+// probe itself, shared by the threads. The bounds cover two standard errors of the
+// sampling and the range of the costs.
+struct RenderEstimate
+{
+    // Iterations of the whole image
+    double iterations, iterationsLow, iterationsHigh;
+
+    // Seconds of the render with the threads
+    double seconds, secondsLow, secondsHigh;
+
+    // Peak resident memory of the process, in bytes
+    double memory, memoryLow, memoryHigh;
+
+    // Pixels computed by the probe, and the seconds it took
+    int64_t samples;
+    double probeSeconds;
+
+    // Estimates a render of the fractal in an image of a format with a number of threads. With a
+    // null cost, the cost of an iteration is measured by the probe, which runs on the calling thread.
+    static RenderEstimate of (Mandlebrot &fractal, PixelFormat format, unsigned threads, 
+                              IterationCost cost = IterationCost (), int64_t maxSamples = 2048)
+    {
+        RenderEstimate e;
+
+        double pixels = double (fractal.width) * fractal.height;
+
+        // The samples are at the centers of the cells of a regular grid, with square cells
+        // when possible, but at least a sample in each row and column of cells
+        int64_t side = std::max<int64_t> (1, int64_t (std::sqrt (pixels / maxSamples)));
+        int64_t stepX = std::min (side, std::max<int64_t> (fractal.width, 1));
+        int64_t stepY = std::min (side, std::max<int64_t> (fractal.height, 1));
+
+        double sum = 0, sumSquares = 0;
+        e.samples = 0;
+
+        Counters::Thread &counters = Counters::local ();
+        auto start = std::chrono::steady_clock::now ();
+
+        for (int64_t y = stepY / 2; y < fractal.height; y += stepY)
+            for (int64_t x = stepX / 2; x < fractal.width; x += stepX)
+            {
+                uint64_t before = counters.iterations.load (std::memory_order_relaxed);
+
+                // The color is part of the cost of a pixel
+                fractal.colorOf (fractal.computeSmooth (x, y));
+
+                double n = counters.iterations.load (std::memory_order_relaxed) - before;
+                sum += n;
+                sumSquares += n * n;
+                e.samples++;
+            }
+
+        e.probeSeconds = std::chrono::duration <double> (std::chrono::steady_clock::now () - start).count();
+
+        // The iterations for each pixel and the standard error of their mean,
+        // only an empty image has no samples and costs nothing
+        double mean = e.samples ? sum / e.samples : 0;
+        double variance = e.samples > 1 ? std::max (0.0, (sumSquares - e.samples * mean * mean) / (e.samples - 1)) : 0;
+        double error = e.samples ? 2 * std::sqrt (variance / e.samples) : 0;
+
+        e.iterations     = mean * pixels;
+        e.iterationsLow  = std::max (0.0, mean - error) * pixels;
+        e.iterationsHigh = std::min (double (fractal.maxIterations), mean + error) * pixels;
+
+        // Without measures, the probe gives the cost
+        if (cost.nanoseconds <= 0)
+        {
+            double nanoseconds = sum > 0 ? e.probeSeconds * 1e9 / sum : 0;
+            cost = IterationCost {nanoseconds, nanoseconds, nanoseconds};
+        }
+
+        threads = std::max (threads, 1u);
+
+        e.seconds     = e.iterations     * cost.nanoseconds / threads * 1e-9;
+        e.secondsLow  = e.iterationsLow  * cost.low         / threads * 1e-9;
+        e.secondsHigh = e.iterationsHigh * cost.high        / threads * 1e-9;
+
+        // The image, and in the worst case a copy of the same size while it is encoded,
+        // over the memory already used
+        double image = pixels * bytesPerPixel (format);
+        double tiles = double (threads) * fractal.tileSize * fractal.tileSize * (sizeof (float) + 3);
+        double current = Counters::peakMemory ();
+
+        e.memoryLow  = current + image;
+        e.memory     = current + image + tiles;
+        e.memoryHigh = current + 2 * image + tiles;
+
+        return e;
+    }
+};
+
+#endif
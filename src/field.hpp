@@ -0,0 +1,398 @@
+/*
+    Fractal Image Generator
+
+    Author: Alberto Boldrini
+
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef FIELD_HPP
+#define FIELD_HPP
+
+#include "fractal.hpp"
+
+
+// This structure describes a file holding the escape data of every pixel of a fractal,
+// so it can be colored again without computing it. The file starts with this header,
+// followed by the index of the tiles and by the tiles, each aligned to 64 bytes.
+// A tile holds tileSize x tileSize pixels, also on the borders, in three planes:
+// the smoothed iterations (float32 or float16), optionally the distance estimate
+// in pixels (same type), and a bit mask of the pixels inside the fractal.
+// Uncompressed tiles can be used directly from a memory mapping of the file,
+// compressed ones are deflated independently and can still be read in any order.
+struct FieldHeader
+{
+    // Identifies the file
+    char magic[8];
+
+    // FieldHeader::half, FieldHeader::distance and FieldHeader::compressed
+    uint32_t flags;
+    uint32_t tileSize;
+
+    // Dimensions of the image
+    uint64_t width;
+    uint64_t height;
+
+    // Number of tiles on each side
+    uint64_t tilesX;
+    uint64_t tilesY;
+
+    // The corners of the image in the complex plane
+    double left, top;
+    double right, bottom;
+
+    // Parameters of the computation
+    double stopNorm;
+    int64_t maxIterations;
+
+    char formula[32];
+    char precision[16];
+
+    // Values of the flags
+    static constexpr uint32_t half       = 1;
+    static constexpr uint32_t distance   = 2;
+    static constexpr uint32_t compressed = 4;
+};
+
+// Position of a tile in the file
+struct FieldTileEntry
+{
+    uint64_t offset;
+    uint64_t size;
+};
+
+// This structure writes and reads the iteration field files described by FieldHeader
+struct IterationField
+{
+    // Size in bytes of the planes of an uncompressed tile
+    static uint64_t planeBytes (const FieldHeader &header)
+    {
+        return uint64_t (header.tileSize) * header.tileSize * (header.flags & FieldHeader::half ? 2 : 4);
+    }
+
+    static uint64_t maskBytes (const FieldHeader &header)
+    {
+        return (uint64_t (header.tileSize) * header.tileSize + 7) / 8;
+    }
+
+    static uint64_t tileBytes (const FieldHeader &header)
+    {
+        return planeBytes (header) * (header.flags & FieldHeader::distance ? 2 : 1) + maskBytes (header);
+    }
+
+    // Computes the field of a fractal with the thread pool and writes it to a file
+    static void write (Mandlebrot &fractal, const std::string &filename, int64_t tileSize = 64,
+                       bool half = false, bool distance = false, bool compress = true,
+                       ThreadPool &pool = ThreadPool::global ())
+    {
+        FieldHeader header = {};
+
+        memcpy (header.magic, "MFIELD1", 8);
+        header.flags = (half ? FieldHeader::half : 0) | (distance ? FieldHeader::distance : 0) |
+                       (compress ? FieldHeader::compressed : 0);
+        header.tileSize = tileSize;
+        header.width  = fractal.width;
+        header.height = fractal.height;
+        header.tilesX = (fractal.width  + tileSize - 1) / tileSize;
+        header.tilesY = (fractal.height + tileSize - 1) / tileSize;
+        header.left   = fractal.left;
+        header.top    = fractal.top;
+        header.right  = fractal.right;
+        header.bottom = fractal.bottom;
+        header.stopNorm = fractal.stopNorm;
+        header.maxIterations = fractal.maxIterations;
+        strncpy (header.formula, Mandlebrot::formula, sizeof (header.formula) - 1);
+        strncpy (header.precision, Mandlebrot::precision, sizeof (header.precision) - 1);
+
+        int64_t nTiles = header.tilesX * header.tilesY;
+
+        FILE *fp = fopen (filename.c_str(), "wb");
+
+        if (!fp)
+            throw std::runtime_error ("Cannot open " + filename);
+
+        // The index is written at the end, when the sizes are known
+        std::vector<FieldTileEntry> index (nTiles);
+        uint64_t offset = (sizeof (header) + sizeof (FieldTileEntry) * nTiles + 63) / 64 * 64;
+
+        fwrite (&header, sizeof (header), 1, fp);
+        fseek (fp, offset, SEEK_SET);
+
+        // The tiles computed and not yet written
+        std::vector<std::unique_ptr<Buffer>> tiles (nTiles);
+
+        TaskGroup tasks (pool);
+
+        for (int64_t t = 0; t < nTiles; t++)
+        {
+            tasks.submit (1.0 - double (t) / nTiles, [&, t]
+            {
+                Trace::Span span ("field tile", "tile", t);
+                std::unique_ptr<Buffer> tile (new Buffer (tileBytes (header), fractal.storage.scratch ()));
+                tile->clear ();
+
+                unsigned char *iterations = tile->data;
+                unsigned char *distances  = iterations + planeBytes (header);
+                unsigned char *mask       = distances + (distance ? planeBytes (header) : 0);
+
+                int64_t left = (t % header.tilesX) * tileSize;
+                int64_t top  = (t / header.tilesX) * tileSize;
+
+                for (int64_t j = 0; j < tileSize; j++)
+                    for (int64_t i = 0; i < tileSize; i++)
+                    {
+                        // Pixels outside the image are left empty
+                        if (left + i >= fractal.width || top + j >= fractal.height)
+                            continue;
+
+                        int64_t p = j * tileSize + i;
+                        double d = 0;
+                        double fN = distance ? fractal.computeSmooth (left + i, top + j, d) : 
+                                               fractal.computeSmooth (left + i, top + j);
+
+                        // The points inside have the maximum number of iterations
+                        if (std::isinf (fN))
+                        {
+                            mask[p / 8] |= 1 << (p % 8);
+                            fN = fractal.maxIterations;
+                        }
+
+                        if (half)
+                        {
+                            ((uint16_t *) iterations)[p] = floatToHalf (fN);
+
+                            if (distance)
+                                ((uint16_t *) distances)[p] = floatToHalf (d);
+                        }
+
+                        else
+                        {
+                            ((float *) iterations)[p] = fN;
+
+                            if (distance)
+                                ((float *) distances)[p] = d;
+                        }
+                    }
+
+                if (compress)
+                {
+                    uLongf size = compressBound (tile->size);
+                    std::unique_ptr<Buffer> packed (new Buffer (size, fractal.storage.scratch ()));
+
+                    if (compress2 (packed->data, &size, tile->data, tile->size, 6) != Z_OK)
+                        throw std::runtime_error ("Cannot compress a tile of " + filename);
+
+                    packed->shrink (size);
+                    tile = std::move (packed);
+                }
+
+                std::lock_guard<std::mutex> lock (tasks.mutex);
+                tiles[t] = std::move (tile);
+            });
+        }
+
+        // Writes the tiles in order
+        for (int64_t t = 0; t < nTiles; t++)
+        {
+            try
+            {
+                tasks.waitUntil ([&] { return tiles[t] != nullptr; });
+            }
+            catch (...)
+            {
+                fclose (fp);
+                throw;
+            }
+
+            std::unique_ptr<Buffer> tile = std::move (tiles[t]);
+
+            index[t] = FieldTileEntry {offset, tile->size};
+            fwrite (tile->data, 1, tile->size, fp);
+
+            // The next tile starts aligned
+            uint64_t padding = (64 - tile->size % 64) % 64;
+            static const unsigned char zeros[64] = {};
+
+            fwrite (zeros, 1, padding, fp);
+            offset += tile->size + padding;
+
+            if (fractal.log && (t + 1) * 100 / nTiles != t * 100 / nTiles)
+                *fractal.log << "\rProcessing... " << (t + 1) * 100 / nTiles << "%" << std::flush;
+        }
+
+        fseek (fp, sizeof (header), SEEK_SET);
+        fwrite (index.data(), sizeof (FieldTileEntry), nTiles, fp);
+        fclose (fp);
+
+        if (fractal.log)
+            *fractal.log << "\n";
+    }
+
+    // Maps a field file in memory
+    IterationField (const std::string &filename)
+    {
+        int fd = open (filename.c_str(), O_RDONLY);
+
+        if (fd < 0)
+            throw std::runtime_error ("Cannot open " + filename);
+
+        size = lseek (fd, 0, SEEK_END);
+
+        void *p = size >= sizeof (FieldHeader) ? mmap (nullptr, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+        close (fd);
+
+        if (p == MAP_FAILED)
+            throw std::runtime_error ("Cannot map " + filename);
+
+        data = (const unsigned char *) p;
+        header = (const FieldHeader *) data;
+        index = (const FieldTileEntry *) (data + sizeof (FieldHeader));
+
+        if (!valid (*header, size))
+        {
+            munmap ((void *) data, size);
+            throw std::runtime_error (filename + " is not an iteration field");
+        }
+    }
+
+    // Checks that the geometry of a header is consistent and that its index fits in the file
+    static bool valid (const FieldHeader &header, uint64_t size)
+    {
+        uint64_t side = header.tileSize;
+
+        if (memcmp (header.magic, "MFIELD1", 8) != 0 || side == 0 || side > 65536)
+            return false;
+
+        if (header.tilesX != (header.width + side - 1) / side || header.tilesY != (header.height + side - 1) / side)
+            return false;
+
+        // The number of entries can't overflow
+        uint64_t room = (size - sizeof (FieldHeader)) / sizeof (FieldTileEntry);
+
+        return header.tilesY == 0 || header.tilesX <= room / header.tilesY;
+    }
+
+    IterationField (const IterationField &) = delete;
+    IterationField &operator= (const IterationField &) = delete;
+
+    ~IterationField ()
+    {
+        munmap ((void *) data, size);
+    }
+
+    // True when a tile is inside the file
+    bool contains (const FieldTileEntry &entry) const
+    {
+        return entry.offset <= size && entry.size <= size - entry.offset;
+    }
+
+    // Returns the data of an uncompressed tile directly from the mapping
+    const unsigned char *mappedTile (uint64_t tx, uint64_t ty) const
+    {
+        const FieldTileEntry &entry = index[ty * header->tilesX + tx];
+
+        if (header->flags & FieldHeader::compressed || !contains (entry) || entry.size < tileBytes (*header))
+            return nullptr;
+
+        return data + entry.offset;
+    }
+
+    // Returns the planes of a tile, decompressing it if needed
+    void readTile (uint64_t tx, uint64_t ty, std::vector<unsigned char> &tile) const
+    {
+        const FieldTileEntry &entry = index[ty * header->tilesX + tx];
+
+        if (!contains (entry))
+            throw std::runtime_error ("Truncated iteration field");
+
+        tile.resize (tileBytes (*header));
+
+        if (header->flags & FieldHeader::compressed)
+        {
+            uLongf length = tile.size();
+
+            if (uncompress (tile.data(), &length, data + entry.offset, entry.size) != Z_OK || length != tile.size())
+                throw std::runtime_error ("Corrupted iteration field");
+        }
+
+        else if (entry.size < tile.size())
+            throw std::runtime_error ("Truncated iteration field");
+
+        else
+            std::copy (data + entry.offset, data + entry.offset + tile.size(), tile.data());
+    }
+
+    // Reads a value of a plane of a tile
+    float value (const unsigned char *plane, uint64_t p) const
+    {
+        return header->flags & FieldHeader::half ? halfToFloat (((const uint16_t *) plane)[p]) : ((const float *) plane)[p];
+    }
+
+    // Colors an image with the stored iterations and the colors of a fractal, using the pool
+    Image color (Mandlebrot &colors, ThreadPool &pool = ThreadPool::global ()) const
+    {
+        Image image (header->width, header->height, PixelFormat::RGB8, colors.storage.scratch ());
+
+        uint64_t nTiles = header->tilesX * header->tilesY;
+        TaskGroup tasks (pool);
+
+        for (uint64_t t = 0; t < nTiles; t++)
+        {
+            tasks.submit (1.0, [&, t]
+            {
+                Trace::Span span ("color", "tile", t);
+                std::vector<unsigned char> tile;
+                uint64_t tx = t % header->tilesX, ty = t / header->tilesX;
+
+                // Uncompressed tiles are read in place
+                const unsigned char *planes = mappedTile (tx, ty);
+
+                if (!planes)
+                {
+                    readTile (tx, ty, tile);
+                    planes = tile.data();
+                }
+
+                const unsigned char *mask = planes + planeBytes (*header) * (header->flags & FieldHeader::distance ? 2 : 1);
+                uint64_t side = header->tileSize;
+
+                for (uint64_t j = 0; j < side && ty * side + j < header->height; j++)
+                    for (uint64_t i = 0; i < side && tx * side + i < header->width; i++)
+                    {
+                        uint64_t p = j * side + i;
+                        bool inside = mask[p / 8] >> (p % 8) & 1;
+
+                        double fN = inside ? std::numeric_limits<double>::infinity () : value (planes, p);
+
+                        image.setPixel (tx * side + i, ty * side + j, colors.colorOf (fN));
+                    }
+            });
+        }
+
+        tasks.wait ();
+
+        return image;
+    }
+
+    // The mapping of the file
+    const unsigned char *data;
+    uint64_t size;
+
+    // Parts of the file
+    const FieldHeader *header;
+    const FieldTileEntry *index;
+};
+
+#endif
@@ -0,0 +1,1082 @@
+/*
+    Fractal Image Generator
+
+    Author: Alberto Boldrini
+
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef FRACTAL_HPP
+#define FRACTAL_HPP
+
+#include "image.hpp"
+#include "counters.hpp"
+#include <complex>
+#include <iostream>
+#include <chrono>
+#include <map>
+#include <list>
+#include <tuple>
+#include <fstream>
+#include <filesystem>
+#include <sstream>
+#include <exception>
+
+
+// This structure represents a rectangular area of an image
+struct Tile
+{
+    int64_t left, top;
+    int64_t right, bottom;
+};
+
+// This structure decides in which order the tiles of an image are computed.
+// Each tile receives a priority: tiles with an higher priority are computed first.
+struct TileOrder
+{
+    // Tiles closest to the center of the image come first
+    static TileOrder centerOut ()
+    {
+        return focus (0.5, 0.5);
+    }
+
+    // Tiles closest to a point come first, the point is given
+    // as a fraction of the width and of the height of the image
+    static TileOrder focus (double x, double y)
+    {
+        TileOrder order;
+        order.focusX = x;
+        order.focusY = y;
+        return order;
+    }
+
+    // Tiles inside the regions come first, in the order of the list.
+    // The remaining tiles follow from the focus point outwards.
+    static TileOrder regions (std::vector<Tile> regions, double x = 0.5, double y = 0.5)
+    {
+        TileOrder order = focus (x, y);
+        order.regionList = std::move (regions);
+        return order;
+    }
+
+    // Computes the priority of a tile of an image with the specified dimensions.
+    // Priorities of tiles outside the regions are in [0, 1], so the tiles of
+    // different images can be compared together.
+    double priority (const Tile &tile, int64_t width, int64_t height) const
+    {
+        // Tiles inside a region have precedence over all the others
+        for (size_t i = 0; i < regionList.size(); i++)
+        {
+            const Tile &region = regionList[i];
+
+            if (tile.left < region.right && region.left < tile.right &&
+                tile.top < region.bottom && region.top < tile.bottom)
+                return 1.0 + double (regionList.size() - i);
+        }
+
+        // Normalized distance between the center of the tile and the focus point
+        double dx = (0.5 * (tile.left + tile.right)) / width  - focusX;
+        double dy = (0.5 * (tile.top + tile.bottom)) / height - focusY;
+
+        // The farthest point of the image from the focus
+        double mx = std::max (focusX, 1 - focusX);
+        double my = std::max (focusY, 1 - focusY);
+
+        return 1.0 - std::sqrt ((dx*dx + dy*dy) / (mx*mx + my*my));
+    }
+
+    // The point of interest, as a fraction of the image dimensions
+    double focusX, focusY;
+
+    // Areas of the image which must be computed first
+    std::vector<Tile> regionList;
+};
+
+// This structure publishes, in order, the bands of an image completed by the threads.
+// The bands can finish in any order: each thread marks its band and then moves forward
+// the count of consecutive completed bands, without locks. The readers wait for that count.
+struct OrderedCompletion
+{
+    OrderedCompletion (int64_t nBands)
+        : done (new std::atomic<bool> [nBands])
+        , nBands (nBands)
+        , nReady (0)
+    {
+        for (int64_t b = 0; b < nBands; b++)
+            done[b] = false;
+    }
+
+    // Marks a band as completed
+    void complete (int64_t band)
+    {
+        done[band] = true;
+
+        // Moves the count forward while the following bands are completed. The thread which
+        // completes the band after the count does the work, possibly for the other threads too.
+        int64_t ready = nReady;
+
+        while (ready < nBands && done[ready])
+        {
+            if (nReady.compare_exchange_weak (ready, ready + 1))
+                ready++;
+        }
+    }
+
+    // Waits until the first bands are completed
+    void wait (int64_t bands) const
+    {
+        for (int spins = 0; nReady < bands; spins++)
+        {
+            // Sleeps only when the wait is long
+            if (spins < 64)
+                std::this_thread::yield ();
+            else
+                std::this_thread::sleep_for (std::chrono::microseconds (100));
+        }
+    }
+
+    // A flag for each band
+    std::unique_ptr<std::atomic<bool>[]> done;
+    int64_t nBands;
+
+    // Number of consecutive bands completed from the first one
+    std::atomic<int64_t> nReady;
+};
+
+// This structure keeps computed tiles in a directory, each file is named after
+// the hash of a key describing exactly how the tile was computed. The key is also
+// stored in the file and checked when it is read, so collisions are harmless.
+// Files are written atomically and the least recently used ones are removed
+// when the total size exceeds the limit.
+struct TileCache
+{
+    // A file of the cache
+    struct Entry
+    {
+        std::string path;
+        uint64_t size;
+    };
+
+    // Opens the cache directory, and finds the files already there
+    TileCache (const std::string &directory, uint64_t maxBytes = uint64_t (1) << 30)
+        : directory (directory)
+        , maxBytes (maxBytes)
+        , totalBytes (0)
+        , hits (0)
+        , misses (0)
+    {
+        std::filesystem::create_directories (directory);
+
+        // The files are sorted from the least recently used
+        std::vector<std::pair<std::filesystem::file_time_type, Entry>> files;
+
+        for (const auto &file : std::filesystem::recursive_directory_iterator (directory))
+            if (file.is_regular_file () && file.path().extension () == ".tile")
+                files.push_back ({file.last_write_time (), Entry {file.path().string (), file.file_size ()}});
+
+        std::sort (files.begin(), files.end(), [] (const auto &a, const auto &b) { return a.first < b.first; });
+
+        for (auto &file : files)
+            insert (file.second);
+
+        evict ();
+    }
+
+    // Hashes a key with two different 64 bit FNV-1a functions
+    static std::string hash (const std::string &key)
+    {
+        uint64_t h1 = 0xcbf29ce484222325ull;
+        uint64_t h2 = 0x84222325cbf29ce4ull;
+
+        for (unsigned char c : key)
+        {
+            h1 = (h1 ^ c) * 0x100000001b3ull;
+            h2 = (h2 ^ c) * 0x100000001b3ull;
+            h2 ^= h2 >> 29;
+        }
+
+        char text[33];
+        snprintf (text, sizeof (text), "%016llx%016llx", (unsigned long long) h1, (unsigned long long) h2);
+        return text;
+    }
+
+    // The file of a key, spread in 256 subdirectories
+    std::string pathOf (const std::string &key) const
+    {
+        std::string name = hash (key);
+        return directory + "/" + name.substr (0, 2) + "/" + name + ".tile";
+    }
+
+    // Reads the data stored with a key, returns false when it is missing
+    bool load (const std::string &key, std::vector<unsigned char> &data)
+    {
+        std::string path = pathOf (key);
+        std::ifstream file (path, std::ios::binary);
+
+        // The header holds the key and the size of the data
+        char magic[4] = {};
+        uint32_t keySize = 0;
+        uint64_t dataSize = 0;
+
+        file.read (magic, 4);
+        file.read ((char *) &keySize, 4);
+
+        std::string stored (file ? keySize : 0, '\0');
+        file.read (&stored[0], stored.size());
+        file.read ((char *) &dataSize, 8);
+
+        if (!file || std::string (magic, 4) != "MTC1" || stored != key)
+            return false;
+
+        data.resize (dataSize);
+        file.read ((char *) data.data(), dataSize);
+
+        if (!file)
+            return false;
+
+        // Marks the file as recently used, also for the other processes
+        std::error_code error;
+        std::filesystem::last_write_time (path, std::filesystem::file_time_type::clock::now (), error);
+
+        std::lock_guard<std::mutex> lock (mutex);
+        auto found = index.find (path);
+
+        if (found != index.end ())
+            lru.splice (lru.end(), lru, found->second);
+
+        return true;
+    }
+
+    // Stores data with a key
+    void store (const std::string &key, const void *data, uint64_t size)
+    {
+        std::string path = pathOf (key);
+        std::filesystem::create_directories (std::filesystem::path (path).parent_path ());
+
+        // Writes a temporary file and renames it, so a file is never seen incomplete
+        std::ostringstream temporary;
+        temporary << path << ".tmp." << getpid () << "." << std::this_thread::get_id ();
+
+        {
+            std::ofstream file (temporary.str(), std::ios::binary);
+            uint32_t keySize = key.size();
+
+            file.write ("MTC1", 4);
+            file.write ((const char *) &keySize, 4);
+            file.write (key.data(), key.size());
+            file.write ((const char *) &size, 8);
+            file.write ((const char *) data, size);
+
+            if (!file)
+                return;
+        }
+
+        std::filesystem::rename (temporary.str(), path);
+
+        std::lock_guard<std::mutex> lock (mutex);
+        insert (Entry {path, 16 + key.size() + size});
+        evict ();
+    }
+
+    // Adds a file as the most recently used, the mutex must be locked
+    void insert (const Entry &entry)
+    {
+        auto found = index.find (entry.path);
+
+        if (found != index.end ())
+        {
+            totalBytes -= found->second->size;
+            lru.erase (found->second);
+        }
+
+        index[entry.path] = lru.insert (lru.end(), entry);
+        totalBytes += entry.size;
+    }
+
+    // Removes the least recently used files until the size is below the limit
+    void evict ()
+    {
+        while (totalBytes > maxBytes && !lru.empty ())
+        {
+            Entry &oldest = lru.front ();
+
+            std::error_code error;
+            std::filesystem::remove (oldest.path, error);
+
+            totalBytes -= oldest.size;
+            index.erase (oldest.path);
+            lru.pop_front ();
+        }
+    }
+
+    // Where the files are
+    std::string directory;
+
+    // Size limit and current size of the files
+    uint64_t maxBytes;
+    uint64_t totalBytes;
+
+    // The files from the least recently used, and their position in the list
+    std::list<Entry> lru;
+    std::map<std::string, std::list<Entry>::iterator> index;
+    std::mutex mutex;
+
+    // Statistics, counted by tile
+    std::atomic<uint64_t> hits;
+    std::atomic<uint64_t> misses;
+};
+
+// This structure represents an image of a fractal which
+// must be computed and written to a file.
+struct Mandlebrot
+{
+    // Specifices the resolution and the corners of the image in the complex plane
+    Mandlebrot (double resolution, double left, double top, double right, double bottom,
+                PixelFormat format = PixelFormat::RGB8, const Storage &storage = Storage ())
+
+        // Dimensions of the image
+        : width  (int64_t (resolution * (right - left)))
+        , height (int64_t (resolution * (top - bottom)))
+
+        // Allocates the image data
+        , image (width, height, format, storage)
+        , storage (storage)
+        
+        // Default color of the body of the fractal
+        , bodyColor {0,0,0}
+
+        // Corners of the image in the complex plane
+        , left (left)
+        , right (right)
+        , top (top)
+        , bottom (bottom)
+
+        // Parameters for the rendering
+        , maxIterations (100)
+        , stopNorm (400)
+
+        // Side of the square tiles computed by a thread
+        , tileSize (64)
+
+        // Progress messages
+        , log (&std::cout)
+
+        // Tiles are computed every time
+        , cache (nullptr)
+
+        // Only the colors are kept
+        , iterations (nullptr)
+        , iterationStride (0)
+        , iterationCounts (nullptr)
+        , tileCycles (nullptr)
+    {
+        // Compute slope and intercept
+        mSmooth = 1 / log2 (0.5 * log2 (std::norm(step(1e5, 0))) / log2(1e5));
+        bSmooth = log2 (0.5 * log2 (stopNorm)) * mSmooth;
+    }
+
+    // The name of the formula and of the numeric type, part of the keys of the cache
+    static constexpr const char *formula   = "z^2+c";
+    static constexpr const char *precision = "double";
+
+    // The step function of the fractal
+    static std::complex<double> step (std::complex<double> z, std::complex<double> c)
+    {
+        return z*z + c;
+    }
+
+    // Computes the number of iterations of a pixel, smoothed using the last value
+    // of the sequence. Returns infinity for the points inside the fractal.
+    double computeSmooth (int64_t x, int64_t y)
+    {
+        // Computes the current position in the complex plane
+        std::complex<double> c (left + (right - left) * x / width, 
+                                top  + (bottom - top) * y / height); 
+
+        // The initial point of the sequence
+        std::complex<double> z = c;
+
+        // The number of iterations made
+        int iN = 0;
+
+        // Iterate until the complex number exits or when many iterations have been made
+        while (std::norm(z) < stopNorm && iN++ < maxIterations)
+            z = step (z,c);
+
+        Counters::pixel (std::min (iN, maxIterations), iN >= maxIterations);
+
+        if (iN >= maxIterations)
+            return std::numeric_limits<double>::infinity ();
+
+        // Computes the number of iterations smoothed using 
+        // the last value computed of the sequences 
+        return iN + bSmooth - mSmooth * log2 (0.5 * log2 (std::norm (z)));
+    }
+
+    // Like computeSmooth, also estimates the distance of the point from the border
+    // of the fractal, in pixels, using the derivative of the sequence. Points inside
+    // the fractal have distance zero.
+    double computeSmooth (int64_t x, int64_t y, double &distance)
+    {
+        // Computes the current position in the complex plane
+        std::complex<double> c (left + (right - left) * x / width, 
+                                top  + (bottom - top) * y / height); 
+
+        // The initial point of the sequence and its derivative with respect to c
+        std::complex<double> z = c;
+        std::complex<double> dz = 1;
+
+        // The number of iterations made
+        int iN = 0;
+
+        // Iterate until the complex number exits or when many iterations have been made
+        while (std::norm(z) < stopNorm && iN++ < maxIterations)
+        {
+            dz = 2.0 * z * dz + 1.0;
+            z = step (z,c);
+        }
+
+        Counters::pixel (std::min (iN, maxIterations), iN >= maxIterations);
+
+        if (iN >= maxIterations)
+        {
+            distance = 0;
+            return std::numeric_limits<double>::infinity ();
+        }
+
+        // Distance in the complex plane, divided by the size of a pixel
+        double r = std::abs (z);
+        distance = r * std::log (r) / std::abs (dz) * width / (right - left);
+
+        // Computes the number of iterations smoothed using 
+        // the last value computed of the sequences 
+        return iN + bSmooth - mSmooth * log2 (0.5 * log2 (std::norm (z)));
+    }
+
+    // Computes the color of a smoothed number of iterations
+    Color colorOf (double fN)
+    {
+        // The output color
+        Color color;
+
+        if (std::isinf (fN))
+            color = bodyColor;
+
+        else
+        {
+            // Selects the color used to paint the pixel 
+            double nC = (1 - exp (-0.05 * fN)) * (colorList.size() - 1);
+
+            // Selects the index of the first color to use from the list
+            unsigned iC = unsigned (nC);
+
+            // Computes fractional part of the color to mix the first with the second
+            double fC = nC - iC;
+
+            // Selects the two colors to interpolate
+            Color& color1 = colorList[iC];
+            Color& color2 = colorList[iC+1];
+
+            // Converts the (linear) fractional part with a smooth function
+            double mix = 0.5 * (1 + cos (M_PI * fC));  
+
+            // Writes the color
+            color.red   = (unsigned char) (color1.red   * mix + color2.red   * (1-mix));
+            color.green = (unsigned char) (color1.green * mix + color2.green * (1-mix));
+            color.blue  = (unsigned char) (color1.blue  * mix + color2.blue  * (1-mix));
+        }
+
+        return color;
+    }
+
+    // Compute the color of a pixel of the image
+    Color computeColor (int64_t x, int64_t y)
+    {
+        return colorOf (computeSmooth (x, y));
+    }
+
+    // Compute a pixel of the image
+    void computePixel (int64_t x, int64_t y)
+    {
+        image.setPixel (x, y, computeColor (x, y));
+    }
+
+    // Computes an area of the image
+    void computeArea (int64_t leftArea, int64_t topArea, int64_t rightArea, int64_t bottomArea)
+    {
+        for (int64_t y = topArea; y < bottomArea; y++)
+            for (int64_t x = leftArea; x < rightArea; x++)
+                computePixel (x, y);                
+    }
+
+    // Returns a fractal with the same parameters and colors which covers another area
+    // of the complex plane with the given dimensions. Its image is not allocated.
+    Mandlebrot view (int64_t width, int64_t height, double left, double top, double right, double bottom) const
+    {
+        Mandlebrot other (1, left, top, right, bottom, image.format, Storage {StorageKind::None});
+
+        other.width  = width;
+        other.height = height;
+        other.image  = Image ();
+
+        other.colorList     = colorList;
+        other.bodyColor     = bodyColor;
+        other.maxIterations = maxIterations;
+        other.stopNorm      = stopNorm;
+        other.mSmooth       = mSmooth;
+        other.bSmooth       = bSmooth;
+        other.tileSize      = tileSize;
+        other.cache         = cache;
+        other.storage       = storage;
+        other.log           = nullptr;
+
+        return other;
+    }
+
+    // Describes exactly how an area is computed, as a key for the cache.
+    // The colors are part of the key only when requested.
+    std::string tileKey (const Tile &tile, bool colors)
+    {
+        std::ostringstream key;
+
+        // Coordinates are written in hexadecimal to be exact
+        key << std::hexfloat
+            << "formula=" << formula << ";precision=" << precision
+            << ";left=" << left << ";top=" << top << ";right=" << right << ";bottom=" << bottom
+            << ";width=" << std::dec << width << ";height=" << height
+            << ";maxIterations=" << maxIterations << ";stopNorm=" << std::hexfloat << stopNorm
+            << ";tile=" << std::dec << tile.left << "," << tile.top << "," << tile.right << "," << tile.bottom;
+
+        if (colors)
+        {
+            key << ";body=" << int (bodyColor.red) << "," << int (bodyColor.green) << "," << int (bodyColor.blue)
+                << ";colors=";
+
+            for (const Color &color : colorList)
+                key << int (color.red) << "," << int (color.green) << "," << int (color.blue) << ";";
+        }
+
+        else
+            key << ";iterations";
+
+        return key.str();
+    }
+
+    // Computes an area of the image and stores it in a target image at the given position.
+    // With a cache, the colors are read from it, or recomputed from the iterations
+    // stored when only the colors have changed.
+    void computeTile (const Tile &tile, Image &target, int64_t targetX, int64_t targetY)
+    {
+        if (!cache && (iterations || iterationCounts))
+        {
+            for (int64_t y = tile.top; y < tile.bottom; y++)
+                for (int64_t x = tile.left; x < tile.right; x++)
+                {
+                    double fN = computeRecorded (x, y);
+                    target.setPixel (targetX + x - tile.left, targetY + y - tile.top, colorOf (fN));
+                }
+
+            return;
+        }
+
+        if (!cache)
+        {
+            for (int64_t y = tile.top; y < tile.bottom; y++)
+                for (int64_t x = tile.left; x < tile.right; x++)
+                    target.setPixel (targetX + x - tile.left, targetY + y - tile.top, computeColor (x, y));
+
+            return;
+        }
+
+        int64_t w = tile.right - tile.left;
+        int64_t h = tile.bottom - tile.top;
+
+        std::string colorKey = tileKey (tile, true);
+        std::vector<unsigned char> colors;
+
+        // The colors are in the cache, unless also the iterations are needed
+        if (!iterations && cache->load (colorKey, colors) && colors.size() == size_t (w * h * 3))
+        {
+            cache->hits++;
+            Counters::cached (w * h);
+
+            for (int64_t y = 0; y < h; y++)
+                for (int64_t x = 0; x < w; x++)
+                    target.setPixel (targetX + x, targetY + y, ((const Color *) colors.data()) [y * w + x]);
+
+            return;
+        }
+
+        std::string iterationKey = tileKey (tile, false);
+        std::vector<unsigned char> stored;
+
+        // Otherwise the iterations may be there
+        bool haveIterations = cache->load (iterationKey, stored) && stored.size() == size_t (w * h) * sizeof (float);
+
+        // A tile is a single lookup, missed only when neither key is there
+        if (haveIterations)
+            cache->hits++;
+        else
+            cache->misses++;
+
+        std::vector<float> tileIterations (w * h);
+        colors.resize (w * h * 3);
+
+        if (haveIterations)
+        {
+            Counters::cached (w * h);
+            std::copy (stored.begin(), stored.end(), (unsigned char *) tileIterations.data());
+        }
+
+        for (int64_t y = 0; y < h; y++)
+            for (int64_t x = 0; x < w; x++)
+            {
+                // Colors of new tiles come from the exact iterations
+                double fN;
+
+                // No iteration is made for the cached pixels
+                if (haveIterations)
+                {
+                    fN = tileIterations[y * w + x];
+                    record (tile.left + x, tile.top + y, fN, 0);
+                }
+                else
+                {
+                    fN = computeRecorded (tile.left + x, tile.top + y);
+                    tileIterations[y * w + x] = fN;
+                }
+
+                Color color = colorOf (fN);
+
+                ((Color *) colors.data()) [y * w + x] = color;
+                target.setPixel (targetX + x, targetY + y, color);
+            }
+
+        if (!haveIterations)
+            cache->store (iterationKey, tileIterations.data(), tileIterations.size() * sizeof (float));
+
+        cache->store (colorKey, colors.data(), colors.size());
+    }
+
+    // Stores the smoothed iterations of a pixel and the iterations made for it
+    // in the buffers which are set
+    void record (int64_t x, int64_t y, double fN, uint64_t count)
+    {
+        if (iterations)
+            iterations[y * iterationStride + x] = fN;
+
+        if (iterationCounts)
+            iterationCounts[y * iterationStride + x] = uint32_t (count);
+    }
+
+    // Like computeSmooth, also records the pixel, its count comes from the counters of the thread
+    double computeRecorded (int64_t x, int64_t y)
+    {
+        Counters::Thread &counters = Counters::local ();
+        uint64_t before = counters.iterations.load (std::memory_order_relaxed);
+
+        double fN = computeSmooth (x, y);
+        record (x, y, fN, counters.iterations.load (std::memory_order_relaxed) - before);
+
+        return fN;
+    }
+
+    // Computes the image using a single core
+    void computeSingleCore ()
+    {
+        // Computes the whole image
+        computeArea (0, 0, image.width, image.height);
+    }
+
+    // Called on a thread of the pool when a tile of the image is ready
+    using TileCallback = std::function<void (const Tile &tile)>;
+
+    // Called on a thread of the pool after the last tile, with the first error if any
+    using DoneCallback = std::function<void (std::exception_ptr error)>;
+
+    // Starts the computation of the tiles of the image with the pool, in the given order,
+    // and returns the number of tiles without waiting them. The fractal and its image
+    // must live until onDone is called.
+    size_t computeAsync (const TileOrder &order, ThreadPool &pool, TileCallback onTile, DoneCallback onDone)
+    {
+        // Splits the image in tiles
+        std::vector<Tile> tiles;
+
+        for (int64_t top = 0; top < image.height; top += tileSize)
+            for (int64_t left = 0; left < image.width; left += tileSize)
+                tiles.push_back (Tile {left, top, std::min<int64_t> (left + tileSize, image.width),
+                                                  std::min<int64_t> (top + tileSize, image.height)});
+
+        if (tiles.empty ())
+        {
+            onDone (nullptr);
+            return 0;
+        }
+
+        // Shared by the tasks, the last one calls onDone
+        struct Progress
+        {
+            std::atomic<size_t> remaining;
+            TileCallback onTile;
+            DoneCallback onDone;
+
+            std::mutex mutex;
+            std::exception_ptr error;
+        };
+
+        std::shared_ptr<Progress> progress (new Progress);
+
+        progress->remaining = tiles.size ();
+        progress->onTile = std::move (onTile);
+        progress->onDone = std::move (onDone);
+
+        // All the tiles of this image belong to the same request
+        unsigned long request = pool.newRequest ();
+
+        for (const Tile &tile : tiles)
+        {
+            pool.submit (request, order.priority (tile, image.width, image.height), [this, tile, progress]
+            {
+                try
+                {
+                    // Computes the tile of the image
+                    {
+                        Trace::Span span ("tile", "left,top,right,bottom", tile.left, tile.top, tile.right, tile.bottom);
+                        uint64_t start = tileCycles ? Counters::cycles () : 0;
+
+                        computeTile (tile, image, tile.left, tile.top);
+
+                        if (tileCycles)
+                            tileCycles[tile.top / tileSize * ((width + tileSize - 1) / tileSize) + tile.left / tileSize] = Counters::cycles () - start;
+                    }
+
+                    if (progress->onTile)
+                        progress->onTile (tile);
+                }
+                catch (...)
+                {
+                    std::lock_guard<std::mutex> lock (progress->mutex);
+
+                    if (!progress->error)
+                        progress->error = std::current_exception ();
+                }
+
+                if (--progress->remaining == 0)
+                    progress->onDone (progress->error);
+            });
+        }
+
+        return tiles.size ();
+    }
+
+    // Computes the image using all the threads of the pool.
+    // The tiles are computed in the order given, by default from the center outwards.
+    void computeMultiCore (const TileOrder &order = TileOrder::centerOut (), ThreadPool &pool = ThreadPool::global ())
+    {
+        // The number of tiles of the image and of the ones processed
+        size_t nTiles = ((image.width + tileSize - 1) / tileSize) * ((image.height + tileSize - 1) / tileSize);
+        size_t doneTiles = 0;
+
+        // Used to wait the end of the computation
+        std::mutex mutex;
+        std::condition_variable finished;
+        bool ended = false;
+        std::exception_ptr error;
+
+        computeAsync (order, pool, [&] (const Tile &)
+        {
+            std::lock_guard<std::mutex> lock (mutex);
+
+            // Prints the current progress when the percentage changes
+            size_t percentage = ++doneTiles * 100 / nTiles;
+
+            if (log && percentage != (doneTiles - 1) * 100 / nTiles)
+                *log << "\rProcessing... " << percentage << "%" << std::flush;
+        },
+        [&] (std::exception_ptr e)
+        {
+            std::lock_guard<std::mutex> lock (mutex);
+
+            error = e;
+            ended = true;
+            finished.notify_one ();
+        });
+
+        // Waits all the tiles
+        std::unique_lock<std::mutex> lock (mutex);
+        finished.wait (lock, [&] { return ended; });
+
+        if (log)
+            *log << "\n";
+
+        if (error)
+            std::rethrow_exception (error);
+    }
+
+    // Computes the image in bands of rows and writes them to a PNG file in order,
+    // as soon as they are ready. The image doesn't need to be allocated (StorageKind::None):
+    // at most maxBands bands are kept in memory, and when compressBands is set
+    // the bands waiting for their turn are deflated.
+    void computeStream (const char *filename, int64_t bandHeight = 64, int64_t maxBands = 0,
+                        bool compressBands = false, int level = 6, ThreadPool &pool = ThreadPool::global ())
+    {
+        // A band of rows computed by a thread
+        struct Band
+        {
+            // The pixels, empty when the band is compressed
+            Image pixels;
+
+            // The deflated pixels
+            std::vector<unsigned char> packed;
+        };
+
+        // By default each thread can be two bands ahead
+        if (maxBands <= 0)
+            maxBands = 2 * pool.size ();
+
+        int64_t nBands = (height + bandHeight - 1) / bandHeight;
+
+        // Writes the header of the file
+        PngWriter writer (filename, width, height, image.format, level);
+
+        // The bands computed and not yet written, indexed by band number modulo maxBands
+        std::vector<std::unique_ptr<Band>> window (maxBands);
+
+        // The next band to write
+        int64_t nextBand = 0;
+
+        // The bands are computed by the threads and written in order by this one
+        TaskGroup tasks (pool);
+
+        auto submit = [&] (int64_t b)
+        {
+            // Bands at the top are needed first
+            tasks.submit (1.0 - double (b) / nBands, [&, b]
+            {
+                int64_t top    = b * bandHeight;
+                int64_t bottom = std::min (top + bandHeight, height);
+
+                Trace::Span span ("band", "top,bottom", top, bottom);
+
+                std::unique_ptr<Band> band (new Band);
+                band->pixels = Image (width, bottom - top, image.format, storage.scratch ());
+
+                for (int64_t y = top; y < bottom; y++)
+                    for (int64_t x = 0; x < width; x++)
+                        band->pixels.setPixel (x, y - top, computeColor (x, y));
+
+                bool waiting;
+                {
+                    std::lock_guard<std::mutex> lock (tasks.mutex);
+                    waiting = b != nextBand;
+                }
+
+                // Bands which must wait their turn take less space compressed
+                if (compressBands && waiting)
+                {
+                    uLong size = band->pixels.buffer.size;
+                    uLongf packedSize = compressBound (size);
+
+                    band->packed.resize (packedSize);
+
+                    if (compress2 (band->packed.data(), &packedSize, band->pixels.data, size, 1) != Z_OK)
+                        throw std::runtime_error ("Cannot compress a band");
+
+                    band->packed.resize (packedSize);
+
+                    // Keeps only the geometry of the band
+                    band->pixels.buffer = Buffer ();
+                    band->pixels.data = nullptr;
+                }
+
+                std::lock_guard<std::mutex> lock (tasks.mutex);
+                window[b % maxBands] = std::move (band);
+            });
+        };
+
+        // Fills the window
+        int64_t nSubmitted = 0;
+
+        for (; nSubmitted < std::min (nBands, maxBands); nSubmitted++)
+            submit (nSubmitted);
+
+        for (int64_t b = 0; b < nBands; b++)
+        {
+            std::unique_ptr<Band> band;
+
+            // Waits the band
+            tasks.waitUntil ([&] { return window[b % maxBands] != nullptr; });
+            {
+                std::lock_guard<std::mutex> lock (tasks.mutex);
+
+                band = std::move (window[b % maxBands]);
+                nextBand = b + 1;
+            }
+
+            // The slot is free, another band can be computed
+            if (nSubmitted < nBands)
+                submit (nSubmitted++);
+
+            // Restores a compressed band
+            if (!band->packed.empty ())
+            {
+                Image pixels (band->pixels.width, band->pixels.height, band->pixels.format, storage.scratch ());
+                uLongf size = pixels.buffer.size;
+
+                if (uncompress (pixels.data, &size, band->packed.data(), band->packed.size()) != Z_OK || size != pixels.buffer.size)
+                    throw std::runtime_error ("Corrupted compressed band");
+
+                band->pixels = std::move (pixels);
+            }
+
+            writer.writeRows (band->pixels.data, band->pixels.stride, band->pixels.height);
+
+            // Prints the current progress when the percentage changes
+            if (log && (b + 1) * 100 / nBands != b * 100 / nBands)
+                *log << "\rProcessing... " << (b + 1) * 100 / nBands << "%" << std::flush;
+        }
+
+        writer.finish ();
+
+        if (log)
+            *log << "\n";
+    }
+
+    // Computes the image and writes it at the same time: bands of rows are computed from the top
+    // by the threads of the pool and passed in order to the encoder, which works with its own threads
+    // while the following bands are still being computed.
+    void computePipelined (const std::string &filename, FileFormat fileFormat = FileFormat::Auto, int level = 6,
+                           unsigned encodeThreads = 0, ThreadPool &pool = ThreadPool::global ())
+    {
+        // By default the encoder has a quarter of the cores
+        if (encodeThreads == 0)
+            encodeThreads = std::max (1u, std::thread::hardware_concurrency () / 4);
+
+        ThreadPool encodePool (encodeThreads);
+
+        // Bands as high as the tiles
+        int64_t bandHeight = tileSize;
+        int64_t nBands = (height + bandHeight - 1) / bandHeight;
+
+        OrderedCompletion completion (nBands);
+
+        // Progress of the computation, the function returns only when all the tasks have ended
+        int64_t doneBands = 0;
+        TaskGroup tasks (pool);
+
+        for (int64_t b = 0; b < nBands; b++)
+        {
+            // Bands at the top are needed first
+            tasks.submit (1.0 - double (b) / nBands, [&, b]
+            {
+                try
+                {
+                    Trace::Span span ("band", "top,bottom", b * bandHeight, std::min (height, (b + 1) * bandHeight));
+                    computeArea (0, b * bandHeight, width, std::min (height, (b + 1) * bandHeight));
+                }
+                catch (...)
+                {
+                    // The encoder must not wait a failed band, the error is thrown at the end
+                    completion.complete (b);
+                    throw;
+                }
+
+                completion.complete (b);
+
+                std::lock_guard<std::mutex> lock (tasks.mutex);
+
+                // Prints the current progress when the percentage changes
+                doneBands++;
+
+                if (log && doneBands * 100 / nBands != (doneBands - 1) * 100 / nBands)
+                    *log << "\rProcessing... " << doneBands * 100 / nBands << "%" << std::flush;
+            });
+        }
+
+        if (fileFormat == FileFormat::Auto)
+            fileFormat = Encoder::formatOf (filename);
+
+        // The encoder reads the rows only when they are ready
+        std::unique_ptr<Encoder> encoder = Encoder::create (fileFormat, level);
+        encoder->pool = &encodePool;
+        encoder->waitRows = [&] (int64_t rows) { completion.wait ((rows + bandHeight - 1) / bandHeight); };
+
+        FILE *fp = openOutput (filename);
+        {
+            Trace::Span span ("encode");
+            encoder->write (image, fp);
+        }
+        fclose (fp);
+
+        // Waits the end of the tasks, which use the local variables, and throws their errors
+        tasks.wait ();
+
+        if (log)
+            *log << "\n";
+    }
+
+    // Dimensions of the image in pixels
+    int64_t width;
+    int64_t height;
+
+    // Image data and informations, empty when the storage is StorageKind::None
+    Image image;
+
+    // Where the image was allocated, also used for the big intermediate buffers
+    Storage storage;
+
+    // List of colors in the outside of the fractal
+    std::vector<Color> colorList;
+
+    // Color in the inside of the fractal
+    Color bodyColor;
+
+    // The corners of the image in the complex plane
+    double left, right;
+    double top, bottom;
+
+    // Max iterations to consider the point inside the fractal
+    int maxIterations;
+
+    // Radius to consider the point definitly outside the fractal
+    double stopNorm;
+
+    // Side in pixels of the tiles computed by the threads
+    int tileSize;
+
+    // Where the progress is printed, nullptr to be quiet
+    std::ostream *log;
+
+    // Where the computed tiles are kept, nullptr to disable
+    TileCache *cache;
+
+    // When set, the smoothed iterations of the pixels of the image (infinity inside
+    // the fractal) are also stored here, in rows of iterationStride floats
+    float *iterations;
+    size_t iterationStride;
+
+    // When set, the iterations actually made for each pixel, zero for the pixels
+    // read from the cache, in rows of iterationStride counts
+    uint32_t *iterationCounts;
+
+    // When set, the cycles taken by each tile computed with the pool are stored here,
+    // in rows of tiles from the top left corner
+    uint64_t *tileCycles;
+    
+    // Precomputed coefficients
+    double mSmooth, bSmooth;
+};
+
+#endif
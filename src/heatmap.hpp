@@ -0,0 +1,151 @@
+/*
+    Fractal Image Generator
+
+    Author: Alberto Boldrini
+
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef HEATMAP_HPP
+#define HEATMAP_HPP
+
+#include "fractal.hpp"
+
+
+// This structure records where the time of a render goes: the iterations made for every pixel
+// and the cycles taken by every tile. They are written as false color images, where the
+// expensive areas are bright, and as raw data: the iterations as a PFM float image and
+// the tiles as CSV, with the cycles for each iteration.
+struct Heatmap
+{
+    // Attaches the buffers to the fractal, which records the costs of its next render
+    Heatmap (Mandlebrot &fractal)
+        : fractal (fractal)
+        , tilesX ((fractal.width  + fractal.tileSize - 1) / fractal.tileSize)
+        , tilesY ((fractal.height + fractal.tileSize - 1) / fractal.tileSize)
+        , countBuffer (fractal.width * fractal.height * sizeof (uint32_t), fractal.storage.scratch ())
+        , cycleBuffer (tilesX * tilesY * sizeof (uint64_t), fractal.storage.scratch ())
+        , counts ((uint32_t *) countBuffer.data)
+        , cycles ((uint64_t *) cycleBuffer.data)
+    {
+        countBuffer.clear ();
+        cycleBuffer.clear ();
+
+        fractal.iterationStride = fractal.width;
+        fractal.iterationCounts = counts;
+        fractal.tileCycles = cycles;
+    }
+
+    ~Heatmap ()
+    {
+        fractal.iterationCounts = nullptr;
+        fractal.tileCycles = nullptr;
+    }
+
+    // Colors from cheap (black) to expensive (white)
+    static Color colorOf (double cost)
+    {
+        static const Color stops[] = {{0, 0, 4}, {80, 18, 123}, {182, 54, 121}, {251, 136, 97}, {252, 253, 191}, {255, 255, 255}};
+        static const int nStops = sizeof (stops) / sizeof (stops[0]);
+
+        double position = std::min (std::max (cost, 0.0), 1.0) * (nStops - 1);
+        int i = std::min (int (position), nStops - 2);
+        double mix = position - i;
+
+        return Color {(unsigned char) (stops[i].red   * (1 - mix) + stops[i + 1].red   * mix),
+                      (unsigned char) (stops[i].green * (1 - mix) + stops[i + 1].green * mix),
+                      (unsigned char) (stops[i].blue  * (1 - mix) + stops[i + 1].blue  * mix)};
+    }
+
+    // The iterations made for a pixel
+    double iterationsOf (int64_t x, int64_t y) const
+    {
+        return counts[y * fractal.width + x];
+    }
+
+    // Writes name-iterations.png, name-iterations.pfm, name-tiles.png and name-tiles.csv
+    void write (const std::string &name, int level = 6) const
+    {
+        int64_t width = fractal.width, height = fractal.height, side = fractal.tileSize;
+
+        // The iterations on a logarithmic scale, the interior is the brightest
+        double scale = 1 / std::log1p (double (fractal.maxIterations));
+        Image pixels (width, height, PixelFormat::RGB8, fractal.storage.scratch ());
+
+        for (int64_t y = 0; y < height; y++)
+            for (int64_t x = 0; x < width; x++)
+                pixels.setPixel (x, y, colorOf (std::log1p (iterationsOf (x, y)) * scale));
+
+        pixels.write (name + "-iterations.png", level, FileFormat::PNG);
+
+        // The raw iterations, the rows of PFM files go from the bottom
+        FILE *fp = openOutput (name + "-iterations.pfm");
+        fprintf (fp, "Pf\n%lld %lld\n-1.0\n", (long long) width, (long long) height);
+
+        std::vector<float> row (width);
+
+        for (int64_t y = height - 1; y >= 0; y--)
+        {
+            for (int64_t x = 0; x < width; x++)
+                row[x] = iterationsOf (x, y);
+
+            fwrite (row.data(), sizeof (float), width, fp);
+        }
+
+        fclose (fp);
+
+        // The tiles relative to the slowest one, with their raw measures
+        uint64_t maxCycles = std::max<uint64_t> (*std::max_element (cycles, cycles + tilesX * tilesY), 1);
+        Image tiles (width, height, PixelFormat::RGB8, fractal.storage.scratch ());
+
+        std::ofstream csv (name + "-tiles.csv");
+        csv << "left,top,right,bottom,cycles,iterations,cycles_per_iteration\n";
+
+        for (int64_t ty = 0; ty < tilesY; ty++)
+            for (int64_t tx = 0; tx < tilesX; tx++)
+            {
+                int64_t left = tx * side, right  = std::min (left + side, width);
+                int64_t top  = ty * side, bottom = std::min (top + side, height);
+
+                uint64_t tileCycles = cycles[ty * tilesX + tx];
+                double tileIterations = 0;
+                Color color = colorOf (double (tileCycles) / maxCycles);
+
+                for (int64_t y = top; y < bottom; y++)
+                    for (int64_t x = left; x < right; x++)
+                    {
+                        tileIterations += iterationsOf (x, y);
+                        tiles.setPixel (x, y, color);
+                    }
+
+                csv << left << "," << top << "," << right << "," << bottom << "," << tileCycles << "," 
+                    << tileIterations << "," << (tileIterations > 0 ? tileCycles / tileIterations : 0) << "\n";
+            }
+
+        tiles.write (name + "-tiles.png", level, FileFormat::PNG);
+    }
+
+    Mandlebrot &fractal;
+
+    // Number of tiles on each side
+    int64_t tilesX, tilesY;
+
+    // The iterations made for the pixels and the cycles of the tiles
+    Buffer countBuffer, cycleBuffer;
+    uint32_t *counts;
+    uint64_t *cycles;
+};
+
+#endif
@@ -0,0 +1,1737 @@
+/*
+    Fractal Image Generator
+
+    Author: Alberto Boldrini
+
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef IMAGE_HPP
+#define IMAGE_HPP
+
+#include "threadpool.hpp"
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+#include <limits>
+#include <new>
+#include <string>
+#include <stdexcept>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <cstdlib>
+#include <functional>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <png.h>
+#include <zlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+
+// Changes the maximum alignment of members of structures.
+// No padding space are added to reach words sizes.
+#pragma pack(push, 1)
+
+// This structure represents a RGB color 8 bit depth
+struct Color
+{
+    unsigned char red;
+    unsigned char green;
+    unsigned char blue;
+};
+
+// Returns to default packing settings
+#pragma pack(pop)
+
+// The layouts in which the pixels of an image can be stored
+enum class PixelFormat
+{
+    RGB8,       // 3 bytes per pixel: red, green, blue
+    RGBA8,      // 4 bytes per pixel: red, green, blue, alpha (always opaque)
+    XRGB32,     // 32 bit words 0xXXRRGGBB in native byte order
+    RGB16,      // 3 unsigned shorts per pixel in native byte order
+    Float32     // 3 floats per pixel with linear (not gamma corrected) intensities
+};
+
+// Returns the number of bytes used by a pixel
+inline int bytesPerPixel (PixelFormat format)
+{
+    switch (format)
+    {
+        case PixelFormat::RGB8:    return 3;
+        case PixelFormat::RGBA8:   return 4;
+        case PixelFormat::XRGB32:  return 4;
+        case PixelFormat::RGB16:   return 6;
+        case PixelFormat::Float32: return 12;
+    }
+
+    return 0;
+}
+
+// Converts an 8 bit sRGB intensity to a linear one
+inline float srgbToLinear (unsigned char value)
+{
+    double v = value / 255.0;
+    return float (v <= 0.04045 ? v / 12.92 : pow ((v + 0.055) / 1.055, 2.4));
+}
+
+// Converts a linear intensity to a 16 bit sRGB one
+inline unsigned short linearToSrgb16 (float value)
+{
+    double v = std::min (std::max (double (value), 0.0), 1.0);
+    v = v <= 0.0031308 ? v * 12.92 : 1.055 * pow (v, 1 / 2.4) - 0.055;
+    return (unsigned short) (v * 65535 + 0.5);
+}
+
+// Converts a float to a IEEE 754 half precision number, rounding to the nearest
+inline uint16_t floatToHalf (float value)
+{
+    uint32_t bits;
+    memcpy (&bits, &value, 4);
+
+    uint16_t sign = (bits >> 16) & 0x8000;
+    int32_t exponent = int32_t ((bits >> 23) & 0xff) - 127 + 15;
+    uint32_t mantissa = bits & 0x7fffff;
+
+    // Infinities and NaN
+    if (((bits >> 23) & 0xff) == 0xff)
+        return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+
+    // Too big, becomes infinity
+    if (exponent >= 31)
+        return sign | 0x7c00;
+
+    // Too small for a normal number
+    if (exponent <= 0)
+    {
+        if (exponent < -10)
+            return sign;
+
+        mantissa |= 0x800000;
+        int shift = 14 - exponent;
+        uint32_t half = mantissa >> shift;
+
+        // Rounds to the nearest, ties to even
+        uint32_t rest = mantissa & ((1u << shift) - 1);
+        uint32_t middle = 1u << (shift - 1);
+
+        if (rest > middle || (rest == middle && (half & 1)))
+            half++;
+
+        return sign | half;
+    }
+
+    uint32_t half = (exponent << 10) | (mantissa >> 13);
+    uint32_t rest = mantissa & 0x1fff;
+
+    // A carry in the mantissa correctly increments the exponent
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+        half++;
+
+    return sign | half;
+}
+
+// Converts a IEEE 754 half precision number to a float
+inline float halfToFloat (uint16_t half)
+{
+    uint32_t sign = uint32_t (half & 0x8000) << 16;
+    uint32_t exponent = (half >> 10) & 0x1f;
+    uint32_t mantissa = half & 0x3ff;
+    uint32_t bits;
+
+    if (exponent == 0x1f)
+        bits = sign | 0x7f800000 | (mantissa << 13);
+
+    else if (exponent == 0)
+    {
+        // Zero or subnormal numbers
+        float value = std::ldexp (float (mantissa), -24);
+        return sign ? -value : value;
+    }
+
+    else
+        bits = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+
+    float value;
+    memcpy (&value, &bits, 4);
+    return value;
+}
+
+// The formats in which an image can be written
+enum class FileFormat
+{
+    Auto,       // Chosen from the extension of the file, PNG by default
+    PNG,        // Compressed in parallel, see PngEncoder
+    QOI,        // Quite OK Image format, fast lossless compression
+    PPM,        // Binary portable pixmap, no compression at all
+    PAM,        // Portable arbitrary map, like PPM but with alpha
+    BMP,        // Windows bitmap, 24 or 32 bits
+    TIFF        // Uncompressed or PackBits TIFF
+};
+
+// The places where the big buffers of the program can be allocated
+enum class StorageKind
+{
+    Heap,       // Ordinary memory aligned to the cache lines
+    Mmap,       // Anonymous mapping, transparent huge pages are requested to the kernel
+    HugePages,  // Anonymous mapping of explicit huge pages, falls back to Mmap when not available
+    File,       // Mapping of a file, the kernel can move pages to disk when memory is low
+    None        // No memory at all, used by images which are only streamed to a file
+};
+
+// Describes where a buffer must be allocated
+struct Storage
+{
+    // The kind of memory
+    StorageKind kind = StorageKind::Heap;
+
+    // The file used by the StorageKind::File storage
+    std::string path;
+
+    // Each buffer has its own file next to the path, removed as soon as it is mapped
+    bool temporary = false;
+
+    // Reads a storage from its name: heap, thp, hugetlb or file:PATH
+    static Storage parse (const std::string &name)
+    {
+        if (name == "heap")
+            return Storage {StorageKind::Heap};
+
+        if (name == "thp")
+            return Storage {StorageKind::Mmap};
+
+        if (name == "hugetlb")
+            return Storage {StorageKind::HugePages};
+
+        if (name.compare (0, 5, "file:") == 0 && name.size() > 5)
+            return Storage {StorageKind::File, name.substr (5)};
+
+        throw std::runtime_error ("Unknown storage " + name + ", use heap, thp, hugetlb or file:PATH");
+    }
+
+    // The storage of the intermediate buffers, which always have memory and their own files
+    Storage scratch () const
+    {
+        Storage other = *this;
+
+        if (other.kind == StorageKind::None)
+            other.kind = StorageKind::Heap;
+
+        other.temporary = true;
+        return other;
+    }
+};
+
+// This structure represents a block of memory allocated with one of the storages.
+// The block is released when the buffer is destroyed.
+struct Buffer
+{
+    // Alignment of the heap buffers, mapped buffers are aligned to the pages
+    static constexpr size_t alignment = 64;
+
+    // Size of the huge pages used to round the mappings
+    static constexpr size_t hugePageSize = 2 << 20;
+
+    // An empty buffer
+    Buffer ()
+        : data (nullptr)
+        , size (0)
+        , mapped (0)
+        , kind (StorageKind::Heap)
+    {
+    }
+
+    // Allocates a buffer of the given size
+    Buffer (size_t size, const Storage &storage = Storage ())
+        : data (nullptr)
+        , size (size)
+        , mapped (0)
+        , kind (storage.kind)
+    {
+        switch (kind)
+        {
+            case StorageKind::Heap:
+                data = (unsigned char *) operator new[] (std::max (size, size_t (1)), std::align_val_t (alignment));
+                break;
+
+            case StorageKind::HugePages:
+#ifdef MAP_HUGETLB
+                // Explicit huge pages must be reserved by the administrator, so this can fail
+                mapped = roundUp (size, hugePageSize);
+                data   = map (mapped, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1);
+
+                if (data)
+                    break;
+#endif
+                kind = StorageKind::Mmap;
+                [[fallthrough]];
+
+            case StorageKind::Mmap:
+                mapped = roundUp (size, hugePageSize);
+                data   = map (mapped, MAP_PRIVATE | MAP_ANONYMOUS, -1);
+
+                if (!data)
+                    throw std::bad_alloc ();
+
+#ifdef MADV_HUGEPAGE
+                // Asks the kernel to back the mapping with transparent huge pages
+                madvise (data, mapped, MADV_HUGEPAGE);
+#endif
+                break;
+
+            case StorageKind::None:
+                break;
+
+            case StorageKind::File:
+            {
+                // Creates the file with the size of the buffer
+                std::string name = storage.temporary ? storage.path + ".XXXXXX" : storage.path;
+                int fd = storage.temporary ? mkstemp (&name[0]) : open (name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+                if (fd < 0)
+                    throw std::runtime_error ("Cannot open " + name);
+
+                if (storage.temporary)
+                    unlink (name.c_str());
+
+                mapped = std::max (size, size_t (1));
+
+                if (ftruncate (fd, mapped) != 0)
+                {
+                    close (fd);
+                    throw std::runtime_error ("Cannot resize " + name);
+                }
+
+                // The mapping keeps the file alive after the descriptor is closed
+                data = map (mapped, MAP_SHARED, fd);
+                close (fd);
+
+                if (!data)
+                    throw std::runtime_error ("Cannot map " + name);
+
+                break;
+            }
+        }
+    }
+
+    // Buffers can't be copied, only moved
+    Buffer (const Buffer &) = delete;
+    Buffer &operator= (const Buffer &) = delete;
+
+    Buffer (Buffer &&other)
+        : data (other.data)
+        , size (other.size)
+        , mapped (other.mapped)
+        , kind (other.kind)
+    {
+        other.data = nullptr;
+        other.size = other.mapped = 0;
+    }
+
+    Buffer &operator= (Buffer &&other)
+    {
+        if (this != &other)
+        {
+            release ();
+
+            data   = other.data;
+            size   = other.size;
+            mapped = other.mapped;
+            kind   = other.kind;
+
+            other.data = nullptr;
+            other.size = other.mapped = 0;
+        }
+
+        return *this;
+    }
+
+    ~Buffer ()
+    {
+        release ();
+    }
+
+    // Gives the memory back to the system
+    void release ()
+    {
+        if (data)
+        {
+            if (kind == StorageKind::Heap)
+                operator delete[] (data, std::align_val_t (alignment));
+
+            else
+                munmap (data, mapped);
+        }
+
+        data = nullptr;
+    }
+
+    // Sets all the bytes to zero, mapped memory is already cleared by the system
+    void clear ()
+    {
+        if (data && kind == StorageKind::Heap)
+            memset (data, 0, size);
+    }
+
+    // Keeps only the first bytes, the whole block is released with the buffer
+    void shrink (size_t used)
+    {
+        size = std::min (size, used);
+    }
+
+    // Rounds a size to the next multiple
+    static size_t roundUp (size_t size, size_t multiple)
+    {
+        return std::max ((size + multiple - 1) / multiple * multiple, multiple);
+    }
+
+    // Maps memory, returns nullptr on failure
+    static unsigned char *map (size_t size, int flags, int fd)
+    {
+        void *p = mmap (nullptr, size, PROT_READ | PROT_WRITE, flags, fd, 0);
+        return p == MAP_FAILED ? nullptr : (unsigned char *) p;
+    }
+
+    // The memory
+    unsigned char *data;
+
+    // Size requested and size actually mapped
+    size_t size;
+    size_t mapped;
+
+    // Where the memory comes from
+    StorageKind kind;
+};
+
+// Opens an output: "-" is the standard output, "fd:N" an open file descriptor
+inline FILE *openOutput (const std::string &filename)
+{
+    FILE *fp;
+
+    if (filename == "-")
+        fp = fdopen (dup (STDOUT_FILENO), "wb");
+
+    else if (filename.compare (0, 3, "fd:") == 0)
+        fp = fdopen (dup (atoi (filename.c_str() + 3)), "wb");
+
+    else
+        fp = fopen (filename.c_str(), "wb");
+
+    if (!fp)
+        throw std::runtime_error ("Cannot open " + filename);
+
+    return fp;
+}
+
+// This structure writes a PNG file one row at time,
+// so the whole picture doesn't need to be in memory
+struct PngWriter
+{
+    // Opens the file and writes the header
+    PngWriter (const char *filename, int64_t width, int64_t height, PixelFormat format, int level = 6)
+        : PngWriter (openOutput (filename), width, height, format, level)
+    {
+    }
+
+    // Writes the header to an open stream, which is closed at the end
+    PngWriter (FILE *fp, int64_t width, int64_t height, PixelFormat format, int level = 6)
+        : fp (fp)
+        , width (width)
+        , format (format)
+    {
+        // PNG stores the dimensions in 31 bits
+        if (width <= 0 || height <= 0 || width > 0x7fffffff || height > 0x7fffffff)
+        {
+            fclose (fp);
+            throw std::runtime_error ("PNG images can't have these dimensions");
+        }
+ 
+        // Creates PNG data structure
+        png_ptr  = png_create_write_struct (PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+        info_ptr = png_create_info_struct (png_ptr);
+
+        // The output stream for the PNG data
+        png_init_io (png_ptr, fp);
+        png_set_compression_level (png_ptr, level);
+
+        // Formats with more than 8 bits are saved with 16 bits per channel
+        bool deep = format == PixelFormat::RGB16 || format == PixelFormat::Float32;
+
+        // Sets information about the image
+        png_set_IHDR (png_ptr, info_ptr, width, height,
+                      deep ? 16 : 8, format == PixelFormat::RGBA8 ? PNG_COLOR_TYPE_RGBA : PNG_COLOR_TYPE_RGB, 
+                      PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+
+        // Writes the png header
+        png_write_info(png_ptr, info_ptr);
+
+        // Words 0xXXRRGGBB are stored as B, G, R, X on little endian machines
+        if (format == PixelFormat::XRGB32)
+        {
+            png_set_filler (png_ptr, 0, PNG_FILLER_AFTER);
+            png_set_bgr (png_ptr);
+        }
+
+        // PNG wants big endian samples
+        if (format == PixelFormat::RGB16 || format == PixelFormat::Float32)
+        {
+            png_set_swap (png_ptr);
+
+            // Linear floats are converted to 16 bits one row at time
+            if (format == PixelFormat::Float32)
+                buffer.resize (size_t (width) * 3);
+        }
+    }
+
+    ~PngWriter ()
+    {
+        finish ();
+    }
+
+    // Writes a row of pixels
+    void writeRow (const unsigned char *row)
+    {
+        if (format == PixelFormat::Float32)
+        {
+            const float *f = (const float *) row;
+
+            for (size_t i = 0; i < buffer.size(); i++)
+                buffer[i] = linearToSrgb16 (f[i]);
+
+            row = (const unsigned char *) buffer.data();
+        }
+
+        png_write_row (png_ptr, (png_const_bytep) row);
+    }
+
+    // Writes consecutive rows separated by stride bytes
+    void writeRows (const unsigned char *data, size_t stride, int64_t nRows)
+    {
+        for (int64_t y = 0; y < nRows; y++)
+            writeRow (data + stride * y);
+    }
+
+    // Completes the file and closes it
+    void finish ()
+    {
+        if (!fp)
+            return;
+
+        png_write_end(png_ptr, NULL);
+
+        // Removes structures
+        png_destroy_write_struct (&png_ptr, &info_ptr);
+
+        // Closes the output file
+        if (closeFile)
+            fclose(fp);
+
+        fp = nullptr;
+    }
+
+    // The output file
+    FILE *fp;
+
+    // When false the stream is left open for the caller
+    bool closeFile = true;
+
+    // libpng structures
+    png_struct *png_ptr;
+    png_info   *info_ptr;
+
+    // Width of the image and layout of the rows
+    int64_t width;
+    PixelFormat format;
+
+    // Space for the conversion of the rows
+    std::vector<unsigned short> buffer;
+};
+
+// This structure writes a PNG file compressing horizontal strips of rows in parallel.
+// Each strip is filtered and deflated independently by a thread of the pool,
+// ending on a byte boundary, so the strips can be concatenated in a single zlib stream.
+// Every strip is stored in its own IDAT chunk whose CRC is computed by the same thread,
+// while the Adler checksums of the strips are combined at the end.
+struct PngEncoder
+{
+    // Provides a row of the image already in the PNG layout
+    using RowFunction = std::function<void (int64_t y, unsigned char *row)>;
+
+    // The result of the compression of a strip
+    struct Strip
+    {
+        // The deflated data
+        std::vector<unsigned char> data;
+
+        // Checksum of the uncompressed data and its length
+        uLong adler;
+        uLong length;
+
+        // Checksum of the IDAT chunk
+        uLong crc;
+    };
+
+    // Specifies the geometry of the image and the compression level (0 = fastest, 9 = smallest).
+    // When stripRows is 0 the strips are about 1 MB of pixels each.
+    PngEncoder (int64_t width, int64_t height, int bitDepth, int colorType, int level = 6, int64_t stripRows = 0)
+        : width (width)
+        , height (height)
+        , bitDepth (bitDepth)
+        , colorType (colorType)
+        , level (level)
+        , stripRows (stripRows)
+    {
+        // PNG stores the dimensions in 31 bits
+        if (width <= 0 || height <= 0 || width > 0x7fffffff || height > 0x7fffffff)
+            throw std::runtime_error ("PNG images can't have these dimensions");
+
+        // Bytes of each pixel and of each row
+        int channels = colorType == PNG_COLOR_TYPE_RGBA ? 4 : 3;
+        pixelBytes = channels * bitDepth / 8;
+        rowBytes = width * pixelBytes;
+
+        if (this->stripRows <= 0)
+            this->stripRows = std::max<int64_t> (1, (1 << 20) / rowBytes);
+    }
+
+    // Filters a row with the filter which produces the smallest sum of absolute values
+    void filterRow (const unsigned char *row, const unsigned char *previous, unsigned char *out) const
+    {
+        // Without compression the filters are useless
+        if (level == 0)
+        {
+            out[0] = 0;
+            std::copy (row, row + rowBytes, out + 1);
+            return;
+        }
+
+        // The filtered row for each filter type
+        std::vector<unsigned char> candidate (rowBytes + 1);
+        uint64_t bestSum = UINT64_MAX;
+
+        for (int type = 0; type < 5; type++)
+        {
+            uint64_t sum = 0;
+            candidate[0] = type;
+
+            for (int64_t i = 0; i < rowBytes; i++)
+            {
+                int a = i >= pixelBytes ? row[i - pixelBytes] : 0;
+                int b = previous ? previous[i] : 0;
+                int c = i >= pixelBytes && previous ? previous[i - pixelBytes] : 0;
+
+                int predictor = 0;
+
+                switch (type)
+                {
+                    case 1: predictor = a; break;
+                    case 2: predictor = b; break;
+                    case 3: predictor = (a + b) / 2; break;
+                    case 4:
+                    {
+                        int pa = std::abs (b - c);
+                        int pb = std::abs (a - c);
+                        int pc = std::abs (a + b - 2 * c);
+                        predictor = pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+                        break;
+                    }
+                }
+
+                unsigned char value = row[i] - predictor;
+                candidate[i + 1] = value;
+
+                // Bytes are considered signed as libpng does
+                sum += value < 128 ? value : 256 - value;
+            }
+
+            if (sum < bestSum)
+            {
+                bestSum = sum;
+                std::copy (candidate.begin(), candidate.end(), out);
+            }
+        }
+    }
+
+    // Filters and deflates a strip of rows
+    Strip compressStrip (int64_t top, int64_t bottom, const RowFunction &getRow) const
+    {
+        Strip strip;
+
+        // The raw rows, including the one before the strip needed by the filters
+        std::vector<unsigned char> previous (top > 0 ? rowBytes : 0);
+        std::vector<unsigned char> current (rowBytes);
+
+        if (top > 0)
+            getRow (top - 1, previous.data());
+
+        // The filtered strip
+        std::vector<unsigned char> filtered ((bottom - top) * (rowBytes + 1));
+
+        for (int64_t y = top; y < bottom; y++)
+        {
+            getRow (y, current.data());
+            filterRow (current.data(), previous.empty() ? nullptr : previous.data(),
+                       filtered.data() + (y - top) * (rowBytes + 1));
+
+            previous.swap (current);
+            current.resize (rowBytes);
+        }
+
+        strip.length = filtered.size();
+        strip.adler  = adler32 (adler32 (0, nullptr, 0), filtered.data(), filtered.size());
+
+        // Deflates the strip without zlib header, the last strip terminates the stream
+        z_stream stream = {};
+
+        if (deflateInit2 (&stream, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            throw std::runtime_error ("Cannot initialize the compression of a PNG strip");
+
+        // The first strip starts with the zlib header
+        std::vector<unsigned char> &data = strip.data;
+
+        if (top == 0)
+        {
+            data.push_back (0x78);
+            data.push_back (level < 2 ? 0x01 : level < 6 ? 0x5e : level == 6 ? 0x9c : 0xda);
+        }
+
+        size_t offset = data.size();
+        data.resize (offset + deflateBound (&stream, filtered.size()) + 16);
+
+        stream.next_in   = filtered.data();
+        stream.avail_in  = filtered.size();
+        stream.next_out  = data.data() + offset;
+        stream.avail_out = data.size() - offset;
+
+        // The other strips end on a byte boundary thanks to the sync flush
+        bool last = bottom == height;
+        int result = deflate (&stream, last ? Z_FINISH : Z_SYNC_FLUSH);
+
+        data.resize (data.size() - stream.avail_out);
+        deflateEnd (&stream);
+
+        // The output buffer is large enough for the whole strip
+        if (result != (last ? Z_STREAM_END : Z_OK))
+            throw std::runtime_error ("Cannot compress a PNG strip");
+
+        // Checksum of the chunk, type included
+        strip.crc = crc32 (crc32 (0, (const Bytef *) "IDAT", 4), data.data(), data.size());
+
+        return strip;
+    }
+
+    // Writes a chunk of the PNG file
+    static void writeChunk (FILE *fp, const char *type, const unsigned char *data, uint32_t length, uLong crc)
+    {
+        unsigned char header[8] = {(unsigned char) (length >> 24), (unsigned char) (length >> 16),
+                                   (unsigned char) (length >> 8),  (unsigned char) length,
+                                   (unsigned char) type[0], (unsigned char) type[1],
+                                   (unsigned char) type[2], (unsigned char) type[3]};
+
+        unsigned char trailer[4] = {(unsigned char) (crc >> 24), (unsigned char) (crc >> 16),
+                                    (unsigned char) (crc >> 8),  (unsigned char) crc};
+
+        fwrite (header, 1, 8, fp);
+
+        // Empty chunks have no data, possibly a null pointer
+        if (length > 0)
+            fwrite (data, 1, length, fp);
+
+        fwrite (trailer, 1, 4, fp);
+    }
+
+    // Writes a chunk computing its CRC
+    static void writeChunk (FILE *fp, const char *type, const unsigned char *data, uint32_t length)
+    {
+        uLong crc = crc32 (0, (const Bytef *) type, 4);
+
+        // A null buffer would reset the CRC
+        if (length > 0)
+            crc = crc32 (crc, data, length);
+
+        writeChunk (fp, type, data, length, crc);
+    }
+
+    // Compresses the image and writes it to a file, the rows are requested to getRow
+    // concurrently by the threads of the pool
+    void write (const char *filename, const RowFunction &getRow, ThreadPool &pool = ThreadPool::global ())
+    {
+        FILE *fp = fopen (filename, "wb");
+
+        if (!fp)
+            throw std::runtime_error (std::string ("Cannot open ") + filename);
+
+        write (fp, getRow, pool);
+        fclose (fp);
+    }
+
+    // Compresses the image and writes it to an open stream
+    void write (FILE *fp, const RowFunction &getRow, ThreadPool &pool = ThreadPool::global ())
+    {
+        // Signature of the PNG files
+        static const unsigned char signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+        fwrite (signature, 1, 8, fp);
+
+        // The header of the image
+        unsigned char header[13] = {(unsigned char) (width >> 24),  (unsigned char) (width >> 16),
+                                    (unsigned char) (width >> 8),   (unsigned char) width,
+                                    (unsigned char) (height >> 24), (unsigned char) (height >> 16),
+                                    (unsigned char) (height >> 8),  (unsigned char) height,
+                                    (unsigned char) bitDepth, (unsigned char) colorType, 0, 0, 0};
+        writeChunk (fp, "IHDR", header, 13);
+
+        int64_t nStrips = (height + stripRows - 1) / stripRows;
+
+        // The compressed strips not yet written
+        std::vector<std::unique_ptr<Strip>> strips (nStrips);
+
+        // The strips are compressed by the threads, the first ones are needed first
+        TaskGroup tasks (pool);
+
+        for (int64_t s = 0; s < nStrips; s++)
+        {
+            tasks.submit (1.0 - double (s) / nStrips, [&, s]
+            {
+                Trace::Span span ("deflate", "strip", s);
+                std::unique_ptr<Strip> strip (new Strip (compressStrip (s * stripRows, std::min (height, (s + 1) * stripRows), getRow)));
+
+                std::lock_guard<std::mutex> lock (tasks.mutex);
+                strips[s] = std::move (strip);
+            });
+        }
+
+        // Checksum of the whole uncompressed stream
+        uLong adler = adler32 (0, nullptr, 0);
+
+        for (int64_t s = 0; s < nStrips; s++)
+        {
+            tasks.waitUntil ([&] { return strips[s] != nullptr; });
+            std::unique_ptr<Strip> strip = std::move (strips[s]);
+
+            adler = adler32_combine (adler, strip->adler, strip->length);
+
+            // The last strip ends with the Adler checksum of the zlib stream
+            if (s == nStrips - 1)
+            {
+                unsigned char trailer[4] = {(unsigned char) (adler >> 24), (unsigned char) (adler >> 16),
+                                            (unsigned char) (adler >> 8),  (unsigned char) adler};
+
+                strip->crc = crc32_combine (strip->crc, crc32 (0, trailer, 4), 4);
+                strip->data.insert (strip->data.end(), trailer, trailer + 4);
+            }
+
+            writeChunk (fp, "IDAT", strip->data.data(), strip->data.size(), strip->crc);
+        }
+
+        writeChunk (fp, "IEND", nullptr, 0);
+    }
+
+    // Geometry of the image
+    int64_t width, height;
+
+    // Bits per channel and PNG color type
+    int bitDepth, colorType;
+
+    // Bytes of each pixel and of each row
+    int64_t pixelBytes, rowBytes;
+
+    // Compression level of zlib
+    int level;
+
+    // Number of rows compressed by each thread
+    int64_t stripRows;
+};
+
+// This structure represents a raster Image
+// which can be written to a png file.
+// The pixels are kept in a single block of memory aligned to the cache lines,
+// each row starts at a multiple of the stride which is padded to the cache lines too.
+struct Image
+{
+    // Alignment of the beginning of each row
+    static constexpr size_t alignment = Buffer::alignment;
+
+    // Create an empty image
+    Image ()
+        : data   (nullptr)
+        , stride (0)
+        , width  (0)
+        , height (0)
+        , format (PixelFormat::RGB8)
+    {
+    }
+
+    // Create an image with specified dimensions
+    Image (int64_t width, int64_t height, PixelFormat format = PixelFormat::RGB8, const Storage &storage = Storage ())
+        : width  (width)
+        , height (height)
+        , format (format)
+    {
+        // Rounds the size of a row to the next cache line
+        stride = (size_t (width) * bytesPerPixel (format) + alignment - 1) / alignment * alignment;
+
+        // Allocates all the rows at once
+        buffer = Buffer (stride * height, storage);
+        data   = buffer.data;
+    }
+
+    // Create an image on memory of the caller, which must outlive the image.
+    // The rows are stride bytes apart.
+    Image (unsigned char *data, size_t stride, int64_t width, int64_t height, PixelFormat format)
+        : data   (data)
+        , stride (stride)
+        , width  (width)
+        , height (height)
+        , format (format)
+    {
+    }
+
+    // Images can't be copied, only moved from one owner to another
+    Image (const Image &) = delete;
+    Image &operator= (const Image &) = delete;
+
+    // Takes the pixels of another image
+    Image (Image &&other)
+        : buffer (std::move (other.buffer))
+        , data   (other.data)
+        , stride (other.stride)
+        , width  (other.width)
+        , height (other.height)
+        , format (other.format)
+    {
+        other.data = nullptr;
+        other.width = other.height = 0;
+    }
+
+    // Releases the current pixels and takes the ones of another image
+    Image &operator= (Image &&other)
+    {
+        if (this != &other)
+        {
+            buffer = std::move (other.buffer);
+            data   = other.data;
+            stride = other.stride;
+            width  = other.width;
+            height = other.height;
+            format = other.format;
+
+            other.data = nullptr;
+            other.width = other.height = 0;
+        }
+
+        return *this;
+    }
+
+    // Returns the beginning of a row
+    unsigned char *row (int64_t y) const
+    {
+        return data + stride * y;
+    }
+
+    // Returns a list of pointers to the rows, as needed by libpng
+    std::vector<png_byte *> rows () const
+    {
+        std::vector<png_byte *> list (height);
+
+        for (int64_t y = 0; y < height; y++)
+            list[y] = row (y);
+
+        return list;
+    }
+
+    // Stores a pixel converting it to the format of the image
+    void setPixel (int64_t x, int64_t y, Color color)
+    {
+        unsigned char *p = row (y) + size_t (x) * bytesPerPixel (format);
+
+        switch (format)
+        {
+            case PixelFormat::RGB8:
+                *(Color *) p = color;
+                break;
+
+            case PixelFormat::RGBA8:
+                p[0] = color.red;
+                p[1] = color.green;
+                p[2] = color.blue;
+                p[3] = 255;
+                break;
+
+            case PixelFormat::XRGB32:
+                *(uint32_t *) p = 0xff000000u | (uint32_t (color.red) << 16) | 
+                                                (uint32_t (color.green) << 8) | color.blue;
+                break;
+
+            case PixelFormat::RGB16:
+                ((unsigned short *) p)[0] = color.red   * 257;
+                ((unsigned short *) p)[1] = color.green * 257;
+                ((unsigned short *) p)[2] = color.blue  * 257;
+                break;
+
+            case PixelFormat::Float32:
+                ((float *) p)[0] = srgbToLinear (color.red);
+                ((float *) p)[1] = srgbToLinear (color.green);
+                ((float *) p)[2] = srgbToLinear (color.blue);
+                break;
+        }
+    }
+
+    // Reads a pixel converting it to a 8 bit color
+    Color getPixel (int64_t x, int64_t y) const
+    {
+        const unsigned char *p = row (y) + size_t (x) * bytesPerPixel (format);
+
+        switch (format)
+        {
+            case PixelFormat::RGB8:
+            case PixelFormat::RGBA8:
+                return Color {p[0], p[1], p[2]};
+
+            case PixelFormat::XRGB32:
+            {
+                uint32_t v = *(const uint32_t *) p;
+                return Color {(unsigned char) (v >> 16), (unsigned char) (v >> 8), (unsigned char) v};
+            }
+
+            case PixelFormat::RGB16:
+            {
+                const unsigned short *s = (const unsigned short *) p;
+                return Color {(unsigned char) (s[0] >> 8), (unsigned char) (s[1] >> 8), (unsigned char) (s[2] >> 8)};
+            }
+
+            case PixelFormat::Float32:
+            {
+                const float *f = (const float *) p;
+                return Color {(unsigned char) (linearToSrgb16 (f[0]) >> 8), 
+                              (unsigned char) (linearToSrgb16 (f[1]) >> 8),
+                              (unsigned char) (linearToSrgb16 (f[2]) >> 8)};
+            }
+        }
+
+        return Color {0, 0, 0};
+    }
+
+    // Converts a row to the layout of the PNG files: 8 or 16 big endian bits per channel
+    void pngRow (int64_t y, unsigned char *out) const
+    {
+        const unsigned char *p = row (y);
+
+        switch (format)
+        {
+            case PixelFormat::RGB8:
+            case PixelFormat::RGBA8:
+                std::copy (p, p + width * bytesPerPixel (format), out);
+                break;
+
+            case PixelFormat::XRGB32:
+                for (int64_t x = 0; x < width; x++, out += 3)
+                {
+                    Color color = getPixel (x, y);
+                    out[0] = color.red;
+                    out[1] = color.green;
+                    out[2] = color.blue;
+                }
+                break;
+
+            case PixelFormat::RGB16:
+            case PixelFormat::Float32:
+                for (int64_t i = 0; i < width * 3; i++, out += 2)
+                {
+                    unsigned short v = format == PixelFormat::RGB16 ? ((const unsigned short *) p)[i] :
+                                                                      linearToSrgb16 (((const float *) p)[i]);
+                    out[0] = v >> 8;
+                    out[1] = v;
+                }
+                break;
+        }
+    }
+
+    // Returns a PNG encoder for this image
+    PngEncoder pngEncoder (int level = 6) const
+    {
+        bool deep = format == PixelFormat::RGB16 || format == PixelFormat::Float32;
+
+        return PngEncoder (width, height, deep ? 16 : 8, 
+                           format == PixelFormat::RGBA8 ? PNG_COLOR_TYPE_RGBA : PNG_COLOR_TYPE_RGB, level);
+    }
+
+    // Writes the image to a file, "-" for the standard output or "fd:N" for a descriptor.
+    // The format is chosen from the extension of the file when not specified.
+    void write (const std::string &filename, int level = 6, FileFormat fileFormat = FileFormat::Auto) const;
+
+    // Memory holding the pixels
+    Buffer buffer;
+
+    // Image data
+    unsigned char *data;
+
+    // Distance in bytes between the beginning of two rows
+    size_t stride;
+
+    // Dimensions
+    int64_t width;
+    int64_t height;
+
+    // Layout of the pixels
+    PixelFormat format;
+};
+
+// The interface of the objects which write images to files
+struct Encoder
+{
+    virtual ~Encoder () {}
+
+    // The threads used by the encoders which work in parallel,
+    // when null they work on the calling thread
+    ThreadPool *pool = &ThreadPool::global ();
+
+    // When set, it is called before reading the rows of the image and must return
+    // only when the given number of rows, from the top, is ready. This allows
+    // the encoding of images which are still being computed.
+    std::function<void (int64_t rows)> waitRows;
+
+    // Waits the rows of the image
+    void waitFor (int64_t rows) const
+    {
+        if (waitRows)
+            waitRows (rows);
+    }
+
+    // Writes the image to an open stream
+    virtual void write (const Image &image, FILE *fp) = 0;
+
+    // Creates the encoder of a format, the level is used by the formats with compression
+    static std::unique_ptr<Encoder> create (FileFormat format, int level = 6);
+
+    // Guesses the format from the extension of the file name
+    static FileFormat formatOf (const std::string &filename)
+    {
+        std::string extension = filename.substr (std::min (filename.size(), filename.rfind ('.') + 1));
+        std::transform (extension.begin(), extension.end(), extension.begin(), ::tolower);
+
+        if (extension == "qoi")                         return FileFormat::QOI;
+        if (extension == "ppm")                         return FileFormat::PPM;
+        if (extension == "pam")                         return FileFormat::PAM;
+        if (extension == "bmp")                         return FileFormat::BMP;
+        if (extension == "tif" || extension == "tiff")  return FileFormat::TIFF;
+
+        return FileFormat::PNG;
+    }
+
+    // Parses the name of a format
+    static FileFormat formatNamed (std::string name)
+    {
+        std::transform (name.begin(), name.end(), name.begin(), ::tolower);
+
+        if (name == "auto")
+            return FileFormat::Auto;
+
+        if (name == "png")
+            return FileFormat::PNG;
+
+        FileFormat format = formatOf ("." + name);
+
+        if (format == FileFormat::PNG)
+            throw std::runtime_error ("Unknown image format " + name);
+
+        return format;
+    }
+
+    // Writes a value as little endian
+    static void put16 (std::vector<unsigned char> &out, uint32_t value)
+    {
+        out.push_back (value);
+        out.push_back (value >> 8);
+    }
+
+    static void put32 (std::vector<unsigned char> &out, uint32_t value)
+    {
+        put16 (out, value);
+        put16 (out, value >> 16);
+    }
+
+    // Converts a row to 8 bit RGB
+    static void rgbRow (const Image &image, int64_t y, unsigned char *out)
+    {
+        if (image.format == PixelFormat::RGB8)
+        {
+            std::copy (image.row (y), image.row (y) + image.width * 3, out);
+            return;
+        }
+
+        for (int64_t x = 0; x < image.width; x++, out += 3)
+        {
+            Color color = image.getPixel (x, y);
+            out[0] = color.red;
+            out[1] = color.green;
+            out[2] = color.blue;
+        }
+    }
+};
+
+// Writes PNG files compressing them with the thread pool
+struct PngFileEncoder : Encoder
+{
+    PngFileEncoder (int level) : level (level) {}
+
+    void write (const Image &image, FILE *fp) override
+    {
+        if (!pool)
+        {
+            PngWriter writer (fp, image.width, image.height, image.format, level);
+            writer.closeFile = false;
+
+            for (int64_t y = 0; y < image.height; y++)
+            {
+                waitFor (y + 1);
+                writer.writeRow (image.row (y));
+            }
+
+            writer.finish ();
+            return;
+        }
+
+        image.pngEncoder (level).write (fp, [this, &image] (int64_t y, unsigned char *out)
+        {
+            waitFor (y + 1);
+            image.pngRow (y, out);
+        }, *pool);
+    }
+
+    // Compression level of zlib
+    int level;
+};
+
+// Writes QOI files, see https://qoiformat.org
+struct QoiEncoder : Encoder
+{
+    void write (const Image &image, FILE *fp) override
+    {
+        if (image.width > 0xffffffffll || image.height > 0xffffffffll)
+            throw std::runtime_error ("QOI images can't have these dimensions");
+
+        // Only the RGBA8 images have an alpha channel
+        unsigned char channels = image.format == PixelFormat::RGBA8 ? 4 : 3;
+
+        // The header, big endian
+        unsigned char header[14] = {'q', 'o', 'i', 'f',
+                                    (unsigned char) (image.width >> 24),  (unsigned char) (image.width >> 16),
+                                    (unsigned char) (image.width >> 8),   (unsigned char) image.width,
+                                    (unsigned char) (image.height >> 24), (unsigned char) (image.height >> 16),
+                                    (unsigned char) (image.height >> 8),  (unsigned char) image.height,
+                                    channels, 0};
+        fwrite (header, 1, 14, fp);
+
+        // Recently seen pixels, indexed by their hash
+        uint32_t seen[64] = {};
+
+        // The previous pixel as 0xAABBGGRR and the length of the current run
+        uint32_t previous = 0xff000000u;
+        int run = 0;
+
+        std::vector<unsigned char> rgb (image.width * 3);
+        std::vector<unsigned char> out;
+
+        for (int64_t y = 0; y < image.height; y++)
+        {
+            waitFor (y + 1);
+            rgbRow (image, y, rgb.data());
+            out.clear ();
+
+            for (int64_t x = 0; x < image.width; x++)
+            {
+                unsigned char r = rgb[3*x], g = rgb[3*x+1], b = rgb[3*x+2], a = 255;
+
+                if (channels == 4)
+                    a = image.row (y)[4*x+3];
+
+                uint32_t pixel = r | (g << 8) | (b << 16) | (uint32_t (a) << 24);
+
+                if (pixel == previous)
+                {
+                    // Runs are at most 62 pixels long
+                    if (++run == 62)
+                    {
+                        out.push_back (0xc0 | (run - 1));
+                        run = 0;
+                    }
+
+                    continue;
+                }
+
+                if (run > 0)
+                {
+                    out.push_back (0xc0 | (run - 1));
+                    run = 0;
+                }
+
+                int hash = (r * 3 + g * 5 + b * 7 + a * 11) % 64;
+
+                if (seen[hash] == pixel)
+                    out.push_back (hash);
+
+                else
+                {
+                    seen[hash] = pixel;
+
+                    // Differences from the previous pixel
+                    signed char dr = r - (unsigned char) previous;
+                    signed char dg = g - (unsigned char) (previous >> 8);
+                    signed char db = b - (unsigned char) (previous >> 16);
+
+                    signed char drg = dr - dg;
+                    signed char dbg = db - dg;
+
+                    if (a != previous >> 24)
+                        out.insert (out.end(), {0xff, r, g, b, a});
+
+                    else if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1)
+                        out.push_back (0x40 | ((dr + 2) << 4) | ((dg + 2) << 2) | (db + 2));
+
+                    else if (dg >= -32 && dg <= 31 && drg >= -8 && drg <= 7 && dbg >= -8 && dbg <= 7)
+                    {
+                        out.push_back (0x80 | (dg + 32));
+                        out.push_back (((drg + 8) << 4) | (dbg + 8));
+                    }
+
+                    else
+                        out.insert (out.end(), {0xfe, r, g, b});
+                }
+
+                previous = pixel;
+            }
+
+            fwrite (out.data(), 1, out.size(), fp);
+        }
+
+        // The last run and the end marker
+        if (run > 0)
+            fputc (0xc0 | (run - 1), fp);
+
+        static const unsigned char end[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+        fwrite (end, 1, 8, fp);
+    }
+};
+
+// Writes binary PPM files, or PAM files which can also store the alpha channel.
+// Formats with more than 8 bits are written with 16 bits per channel.
+struct NetpbmEncoder : Encoder
+{
+    NetpbmEncoder (bool pam) : pam (pam) {}
+
+    void write (const Image &image, FILE *fp) override
+    {
+        bool deep  = image.format == PixelFormat::RGB16 || image.format == PixelFormat::Float32;
+        bool alpha = pam && image.format == PixelFormat::RGBA8;
+        int maxValue = deep ? 65535 : 255;
+
+        if (pam)
+            fprintf (fp, "P7\nWIDTH %lld\nHEIGHT %lld\nDEPTH %d\nMAXVAL %d\nTUPLTYPE %s\nENDHDR\n",
+                     (long long) image.width, (long long) image.height, alpha ? 4 : 3, maxValue, alpha ? "RGB_ALPHA" : "RGB");
+        else
+            fprintf (fp, "P6\n%lld %lld\n%d\n", (long long) image.width, (long long) image.height, maxValue);
+
+        // Samples are big endian as in the PNG files
+        std::vector<unsigned char> row (image.width * (alpha ? 4 : 3) * (deep ? 2 : 1));
+
+        for (int64_t y = 0; y < image.height; y++)
+        {
+            waitFor (y + 1);
+
+            if (alpha || deep)
+                image.pngRow (y, row.data());
+            else
+                rgbRow (image, y, row.data());
+
+            fwrite (row.data(), 1, row.size(), fp);
+        }
+    }
+
+    // True to write PAM files
+    bool pam;
+};
+
+// Writes top-down BMP files. XRGB32 images are written with 32 bits per pixel
+// copying the rows as they are, the others are converted to 24 bits.
+struct BmpEncoder : Encoder
+{
+    void write (const Image &image, FILE *fp) override
+    {
+        bool direct = image.format == PixelFormat::XRGB32;
+        int bits = direct ? 32 : 24;
+
+        // Rows are padded to 4 bytes
+        uint64_t rowBytes = (image.width * bits / 8 + 3) / 4 * 4;
+        uint64_t size = 54 + rowBytes * image.height;
+
+        if (size > 0xffffffffull || image.width > 0x7fffffff || image.height > 0x7fffffff)
+            throw std::runtime_error ("BMP images can't have these dimensions");
+
+        std::vector<unsigned char> header;
+
+        // File header
+        header.push_back ('B');
+        header.push_back ('M');
+        put32 (header, size);
+        put32 (header, 0);
+        put32 (header, 54);
+
+        // Info header, a negative height means that the rows are stored from the top
+        put32 (header, 40);
+        put32 (header, image.width);
+        put32 (header, -int32_t (image.height));
+        put16 (header, 1);
+        put16 (header, bits);
+        put32 (header, 0);
+        put32 (header, rowBytes * image.height);
+        put32 (header, 2835);
+        put32 (header, 2835);
+        put32 (header, 0);
+        put32 (header, 0);
+
+        fwrite (header.data(), 1, header.size(), fp);
+
+        std::vector<unsigned char> row (rowBytes + 3, 0);
+
+        for (int64_t y = 0; y < image.height; y++)
+        {
+            waitFor (y + 1);
+
+            // Words 0xXXRRGGBB are already B, G, R, X in memory
+            if (direct)
+            {
+                fwrite (image.row (y), 1, rowBytes, fp);
+                continue;
+            }
+
+            rgbRow (image, y, row.data());
+
+            // BMP wants B, G, R
+            for (int64_t x = 0; x < image.width; x++)
+                std::swap (row[3*x], row[3*x+2]);
+
+            fwrite (row.data(), 1, rowBytes, fp);
+        }
+    }
+};
+
+// Writes little endian TIFF files, uncompressed or with PackBits compression.
+// Images are stored in strips of rows; the PackBits strips are compressed in parallel.
+// RGB16 and Float32 images are stored with their own samples (16 bit integers or 32 bit floats).
+struct TiffEncoder : Encoder
+{
+    TiffEncoder (bool packBits) : packBits (packBits) {}
+
+    // Compresses a row with the PackBits algorithm
+    static void packRow (const unsigned char *row, int64_t size, std::vector<unsigned char> &out)
+    {
+        int64_t i = 0;
+
+        while (i < size)
+        {
+            // Length of the run starting here
+            int64_t run = 1;
+
+            while (i + run < size && run < 128 && row[i + run] == row[i])
+                run++;
+
+            if (run >= 3)
+            {
+                out.push_back ((unsigned char) (1 - run));
+                out.push_back (row[i]);
+                i += run;
+                continue;
+            }
+
+            // Copies literally until the next run of three bytes
+            int64_t literal = 0;
+
+            while (i + literal < size && literal < 128 &&
+                   !(i + literal + 2 < size && row[i + literal] == row[i + literal + 1] && row[i + literal] == row[i + literal + 2]))
+                literal++;
+
+            out.push_back ((unsigned char) (literal - 1));
+            out.insert (out.end(), row + i, row + i + literal);
+            i += literal;
+        }
+    }
+
+    void write (const Image &image, FILE *fp) override
+    {
+        // The samples written
+        bool native = image.format != PixelFormat::XRGB32;
+        int channels = image.format == PixelFormat::RGBA8 ? 4 : 3;
+        int sampleBytes = image.format == PixelFormat::RGB16 ? 2 : image.format == PixelFormat::Float32 ? 4 : 1;
+
+        uint64_t rowBytes = image.width * channels * sampleBytes;
+
+        // Strips of about 64 KB
+        int64_t stripRows = std::max<int64_t> (1, (1 << 16) / rowBytes);
+        int64_t nStrips = (image.height + stripRows - 1) / stripRows;
+
+        // Fetches a row in the layout of the file
+        auto getRow = [&] (int64_t y, unsigned char *out)
+        {
+            waitFor (y + 1);
+
+            if (native)
+                std::copy (image.row (y), image.row (y) + rowBytes, out);
+            else
+                rgbRow (image, y, out);
+        };
+
+        // The compressed strips, the uncompressed ones are written directly
+        std::vector<std::vector<unsigned char>> strips (packBits ? nStrips : 0);
+
+        if (packBits && !pool)
+        {
+            std::vector<unsigned char> row (rowBytes);
+
+            for (int64_t y = 0; y < image.height; y++)
+            {
+                getRow (y, row.data());
+                packRow (row.data(), rowBytes, strips[y / stripRows]);
+            }
+        }
+
+        else if (packBits)
+        {
+            TaskGroup tasks (*pool);
+
+            for (int64_t s = 0; s < nStrips; s++)
+            {
+                tasks.submit (1.0 - double (s) / nStrips, [&, s]
+                {
+                    Trace::Span span ("pack", "strip", s);
+                    std::vector<unsigned char> row (rowBytes);
+
+                    for (int64_t y = s * stripRows; y < std::min (image.height, (s + 1) * stripRows); y++)
+                    {
+                        getRow (y, row.data());
+                        packRow (row.data(), rowBytes, strips[s]);
+                    }
+                });
+            }
+
+            tasks.wait ();
+        }
+
+        // Size of each strip
+        std::vector<uint64_t> counts (nStrips);
+
+        for (int64_t s = 0; s < nStrips; s++)
+            counts[s] = packBits ? strips[s].size() : rowBytes * (std::min (image.height, (s + 1) * stripRows) - s * stripRows);
+
+        // The pixels follow the header, then the directory and its arrays
+        uint64_t dataSize = 0;
+
+        for (uint64_t count : counts)
+            dataSize += count;
+
+        // Offsets are stored in 32 bits
+        if (dataSize + 12 * nStrips + 1024 > 0xffffffffull)
+            throw std::runtime_error ("TIFF images can't have these dimensions");
+
+        uint32_t directory = 8 + dataSize + (dataSize & 1);
+
+        std::vector<unsigned char> header = {'I', 'I', 42, 0};
+        put32 (header, directory);
+        fwrite (header.data(), 1, header.size(), fp);
+
+        // Writes the pixels
+        if (packBits)
+        {
+            for (const std::vector<unsigned char> &strip : strips)
+                fwrite (strip.data(), 1, strip.size(), fp);
+        }
+
+        else
+        {
+            std::vector<unsigned char> row (rowBytes);
+
+            for (int64_t y = 0; y < image.height; y++)
+            {
+                getRow (y, row.data());
+                fwrite (row.data(), 1, rowBytes, fp);
+            }
+        }
+
+        // The directory must start on a word boundary
+        if (dataSize & 1)
+            fputc (0, fp);
+
+        // The directory entries, in increasing order of tag
+        struct Entry
+        {
+            uint16_t tag, type;
+            uint32_t count, value;
+        };
+
+        std::vector<Entry> entries;
+
+        // Arrays which don't fit in an entry are stored after the directory
+        std::vector<unsigned char> extra;
+
+        int nEntries = channels == 4 ? 12 : 11;
+        uint32_t extraOffset = directory + 2 + 12 * nEntries + 4;
+
+        // Stores an array of values and returns its offset, or the value itself if it fits
+        auto array = [&] (const std::vector<uint32_t> &values, int bytes) -> uint32_t
+        {
+            if (values.size() * bytes <= 4)
+            {
+                uint32_t value = 0;
+
+                for (size_t i = 0; i < values.size(); i++)
+                    value |= values[i] << (8 * bytes * i);
+
+                return value;
+            }
+
+            uint32_t offset = extraOffset + extra.size();
+
+            for (uint32_t value : values)
+                bytes == 2 ? put16 (extra, value) : put32 (extra, value);
+
+            return offset;
+        };
+
+        std::vector<uint32_t> offsets (nStrips), byteCounts (nStrips);
+
+        for (int64_t s = 0, offset = 8; s < nStrips; offset += counts[s], s++)
+        {
+            offsets[s] = offset;
+            byteCounts[s] = counts[s];
+        }
+
+        const uint16_t SHORT = 3, LONG = 4;
+
+        entries.push_back ({256, LONG,  1, uint32_t (image.width)});
+        entries.push_back ({257, LONG,  1, uint32_t (image.height)});
+        entries.push_back ({258, SHORT, uint32_t (channels), array (std::vector<uint32_t> (channels, 8 * sampleBytes), 2)});
+        entries.push_back ({259, SHORT, 1, packBits ? 32773u : 1u});
+        entries.push_back ({262, SHORT, 1, 2});
+        entries.push_back ({273, LONG,  uint32_t (nStrips), array (offsets, 4)});
+        entries.push_back ({277, SHORT, 1, uint32_t (channels)});
+        entries.push_back ({278, LONG,  1, uint32_t (stripRows)});
+        entries.push_back ({279, LONG,  uint32_t (nStrips), array (byteCounts, 4)});
+        entries.push_back ({284, SHORT, 1, 1});
+
+        // The alpha channel is not premultiplied
+        if (channels == 4)
+            entries.push_back ({338, SHORT, 1, 2});
+
+        // Integer or floating point samples
+        entries.push_back ({339, SHORT, uint32_t (channels), 
+                            array (std::vector<uint32_t> (channels, image.format == PixelFormat::Float32 ? 3 : 1), 2)});
+
+        std::vector<unsigned char> out;
+        put16 (out, entries.size());
+
+        for (const Entry &entry : entries)
+        {
+            put16 (out, entry.tag);
+            put16 (out, entry.type);
+            put32 (out, entry.count);
+            put32 (out, entry.value);
+        }
+
+        // No other directories
+        put32 (out, 0);
+
+        fwrite (out.data(), 1, out.size(), fp);
+        fwrite (extra.data(), 1, extra.size(), fp);
+    }
+
+    // True to compress the strips
+    bool packBits;
+};
+
+inline std::unique_ptr<Encoder> Encoder::create (FileFormat format, int level)
+{
+    switch (format)
+    {
+        case FileFormat::QOI:  return std::unique_ptr<Encoder> (new QoiEncoder ());
+        case FileFormat::PPM:  return std::unique_ptr<Encoder> (new NetpbmEncoder (false));
+        case FileFormat::PAM:  return std::unique_ptr<Encoder> (new NetpbmEncoder (true));
+        case FileFormat::BMP:  return std::unique_ptr<Encoder> (new BmpEncoder ());
+
+        // Without compression the TIFF files are written as they are
+        case FileFormat::TIFF: return std::unique_ptr<Encoder> (new TiffEncoder (level > 0));
+
+        default:               return std::unique_ptr<Encoder> (new PngFileEncoder (level));
+    }
+}
+
+inline void Image::write (const std::string &filename, int level, FileFormat fileFormat) const
+{
+    if (fileFormat == FileFormat::Auto)
+        fileFormat = Encoder::formatOf (filename);
+
+    FILE *fp = openOutput (filename);
+
+    Trace::Span span ("encode", "width,height", width, height);
+    Encoder::create (fileFormat, level)->write (*this, fp);
+
+    fclose (fp);
+}
+
+// Reads a PNG file in a RGB8 image
+inline Image readPng (const std::string &filename)
+{
+    FILE *fp = fopen (filename.c_str(), "rb");
+
+    if (!fp)
+        throw std::runtime_error ("Cannot open " + filename);
+
+    png_struct *png_ptr  = png_create_read_struct (PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_info   *info_ptr = png_create_info_struct (png_ptr);
+
+    // libpng reports the errors jumping here
+    if (setjmp (png_jmpbuf (png_ptr)))
+    {
+        png_destroy_read_struct (&png_ptr, &info_ptr, NULL);
+        fclose (fp);
+        throw std::runtime_error ("Cannot read " + filename);
+    }
+
+    png_init_io (png_ptr, fp);
+    png_read_info (png_ptr, info_ptr);
+
+    // Converts any PNG to 8 bit RGB
+    png_set_expand (png_ptr);
+    png_set_strip_16 (png_ptr);
+    png_set_strip_alpha (png_ptr);
+    png_set_gray_to_rgb (png_ptr);
+    png_read_update_info (png_ptr, info_ptr);
+
+    Image image (png_get_image_width (png_ptr, info_ptr), png_get_image_height (png_ptr, info_ptr));
+
+    std::vector<png_byte *> list = image.rows ();
+    png_read_image (png_ptr, list.data());
+    png_read_end (png_ptr, NULL);
+
+    png_destroy_read_struct (&png_ptr, &info_ptr, NULL);
+    fclose (fp);
+
+    return image;
+}
+
+#endif
@@ -0,0 +1,357 @@
+/*
+    Fractal Image Generator
+
+    Author: Alberto Boldrini
+
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef JSON_HPP
+#define JSON_HPP
+
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+
+// A value read from a JSON document, enough for the jobs of the batch worker
+// and the results of the benchmarks
+struct Json
+{
+    enum class Type {Null, Bool, Number, String, Array, Object};
+
+    Type type = Type::Null;
+    bool boolean = false;
+    double number = 0;
+    std::string string;
+    std::vector<Json> array;
+    std::map<std::string, Json> object;
+
+    // Deepest nesting of arrays and objects, the parser recurses on each level
+    static constexpr int maxDepth = 256;
+
+    // Parses a whole document, throws on the syntax errors
+    static Json parse (const std::string &text)
+    {
+        size_t at = 0;
+        Json value = parseValue (text, at);
+
+        skipSpaces (text, at);
+
+        if (at != text.size ())
+            throw std::runtime_error ("Unexpected characters after the JSON value");
+
+        return value;
+    }
+
+    // Returns a member of an object, or a null value
+    const Json &operator[] (const std::string &name) const
+    {
+        static const Json null;
+
+        auto found = object.find (name);
+        return found != object.end () ? found->second : null;
+    }
+
+    bool isNull () const
+    {
+        return type == Type::Null;
+    }
+
+    // Returns the value of a member, or a default when it is missing
+    double numberOr (const std::string &name, double otherwise) const
+    {
+        const Json &value = (*this)[name];
+
+        if (value.isNull ())
+            return otherwise;
+
+        if (value.type != Type::Number)
+            throw std::runtime_error ("\"" + name + "\" must be a number");
+
+        return value.number;
+    }
+
+    std::string stringOr (const std::string &name, const std::string &otherwise) const
+    {
+        const Json &value = (*this)[name];
+
+        if (value.isNull ())
+            return otherwise;
+
+        if (value.type != Type::String)
+            throw std::runtime_error ("\"" + name + "\" must be a string");
+
+        return value.string;
+    }
+
+    // Writes a string with the escapes of JSON
+    static std::string quote (const std::string &text)
+    {
+        std::string quoted = "\"";
+
+        for (unsigned char c : text)
+        {
+            if (c == '"' || c == '\\')
+                quoted += std::string ("\\") + char (c);
+
+            else if (c < 0x20)
+            {
+                char escape[8];
+                snprintf (escape, sizeof (escape), "\\u%04x", c);
+                quoted += escape;
+            }
+
+            else
+                quoted += c;
+        }
+
+        return quoted + "\"";
+    }
+
+    // Writes a value, only the numbers and the strings are written as they were read
+    std::string dump () const
+    {
+        std::ostringstream out;
+
+        switch (type)
+        {
+            case Type::Null:   out << "null"; break;
+            case Type::Bool:   out << (boolean ? "true" : "false"); break;
+            case Type::Number: out.precision (17); out << number; break;
+            case Type::String: out << quote (string); break;
+
+            case Type::Array:
+                out << "[";
+
+                for (size_t i = 0; i < array.size (); i++)
+                    out << (i ? "," : "") << array[i].dump ();
+
+                out << "]";
+                break;
+
+            case Type::Object:
+                out << "{";
+
+                for (auto member = object.begin (); member != object.end (); ++member)
+                    out << (member != object.begin () ? "," : "") << quote (member->first) << ":" << member->second.dump ();
+
+                out << "}";
+                break;
+        }
+
+        return out.str ();
+    }
+
+private:
+
+    static void skipSpaces (const std::string &text, size_t &at)
+    {
+        while (at < text.size () && isspace ((unsigned char) text[at]))
+            at++;
+    }
+
+    static void expect (const std::string &text, size_t &at, const char *word)
+    {
+        size_t length = strlen (word);
+
+        if (text.compare (at, length, word) != 0)
+            throw std::runtime_error ("Invalid JSON at character " + std::to_string (at));
+
+        at += length;
+    }
+
+    static Json parseValue (const std::string &text, size_t &at, int depth = 0)
+    {
+        if (depth > maxDepth)
+            throw std::runtime_error ("JSON nested too deeply at character " + std::to_string (at));
+
+        skipSpaces (text, at);
+
+        if (at >= text.size ())
+            throw std::runtime_error ("Unexpected end of the JSON value");
+
+        Json value;
+        char c = text[at];
+
+        if (c == '{')
+        {
+            value.type = Type::Object;
+            at++;
+            skipSpaces (text, at);
+
+            if (at < text.size () && text[at] == '}')
+            {
+                at++;
+                return value;
+            }
+
+            while (true)
+            {
+                skipSpaces (text, at);
+                Json name = parseValue (text, at, depth + 1);
+
+                if (name.type != Type::String)
+                    throw std::runtime_error ("The names of the members must be strings");
+
+                skipSpaces (text, at);
+                expect (text, at, ":");
+                value.object[name.string] = parseValue (text, at, depth + 1);
+                skipSpaces (text, at);
+
+                if (at < text.size () && text[at] == ',')
+                    at++;
+
+                else
+                {
+                    expect (text, at, "}");
+                    return value;
+                }
+            }
+        }
+
+        if (c == '[')
+        {
+            value.type = Type::Array;
+            at++;
+            skipSpaces (text, at);
+
+            if (at < text.size () && text[at] == ']')
+            {
+                at++;
+                return value;
+            }
+
+            while (true)
+            {
+                value.array.push_back (parseValue (text, at, depth + 1));
+                skipSpaces (text, at);
+
+                if (at < text.size () && text[at] == ',')
+                    at++;
+
+                else
+                {
+                    expect (text, at, "]");
+                    return value;
+                }
+            }
+        }
+
+        if (c == '"')
+        {
+            value.type = Type::String;
+            at++;
+
+            while (at < text.size () && text[at] != '"')
+            {
+                if (text[at] != '\\')
+                {
+                    value.string += text[at++];
+                    continue;
+                }
+
+                if (++at >= text.size ())
+                    break;
+
+                char escape = text[at++];
+
+                switch (escape)
+                {
+                    case 'b': value.string += '\b'; break;
+                    case 'f': value.string += '\f'; break;
+                    case 'n': value.string += '\n'; break;
+                    case 'r': value.string += '\r'; break;
+                    case 't': value.string += '\t'; break;
+
+                    case 'u':
+                    {
+                        if (at + 4 > text.size ())
+                            throw std::runtime_error ("Invalid JSON escape");
+
+                        unsigned code = std::stoul (text.substr (at, 4), nullptr, 16);
+                        at += 4;
+
+                        // Encodes the character in UTF-8, surrogates are kept as they are
+                        if (code < 0x80)
+                            value.string += char (code);
+
+                        else if (code < 0x800)
+                        {
+                            value.string += char (0xc0 | code >> 6);
+                            value.string += char (0x80 | (code & 0x3f));
+                        }
+
+                        else
+                        {
+                            value.string += char (0xe0 | code >> 12);
+                            value.string += char (0x80 | (code >> 6 & 0x3f));
+                            value.string += char (0x80 | (code & 0x3f));
+                        }
+
+                        break;
+                    }
+
+                    default: value.string += escape;
+                }
+            }
+
+            expect (text, at, "\"");
+            return value;
+        }
+
+        if (c == 't')
+        {
+            expect (text, at, "true");
+            value.type = Type::Bool;
+            value.boolean = true;
+            return value;
+        }
+
+        if (c == 'f')
+        {
+            expect (text, at, "false");
+            value.type = Type::Bool;
+            return value;
+        }
+
+        if (c == 'n')
+        {
+            expect (text, at, "null");
+            return value;
+        }
+
+        // Only numbers are left
+        const char *begin = text.c_str () + at;
+        char *end;
+
+        value.type = Type::Number;
+        value.number = strtod (begin, &end);
+
+        if (end == begin)
+            throw std::runtime_error ("Invalid JSON at character " + std::to_string (at));
+
+        at += end - begin;
+        return value;
+    }
+};
+
+#endif
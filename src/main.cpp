@@ -18,290 +18,523 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
-#include <cstdio>
-#include <complex>
-#include <iostream>
-#include <cmath>
-#include <thread>
-#include <vector>
-#include <atomic>
-#include <chrono>
-#include <algorithm>
-#include <png.h>
-
-// Changes the maximum alignment of members of structures.
-// No padding space are added to reach words sizes.
-#pragma pack(push, 1)
-
-// This structure represents a RGB color 8 bit depth
-struct Color
+#include "fractal.hpp"
+#include "field.hpp"
+#include "pyramid.hpp"
+#include "server.hpp"
+#include "animation.hpp"
+#include "batch.hpp"
+#include "ring.hpp"
+#include "heatmap.hpp"
+#include "estimate.hpp"
+
+
+// Runs the program, the errors are thrown
+static int run (int argc, char **argv)
 {
-    unsigned char red;
-    unsigned char green;
-    unsigned char blue;
-};
+    // Options of the command line
+    double resolution = 500;
+    std::string output = "img/out9.png";
+
+    // Streaming mode: the image is never kept in memory
+    bool stream = false;
+    int64_t bandHeight = 64;
+    int64_t maxBands = 0;
+    bool compressBands = false;
+
+    // Compression level of the PNG file
+    int level = 6;
+
+    // Format of the output, by default from the extension
+    FileFormat fileFormat = FileFormat::Auto;
+
+    // Memory of the image and of the big intermediate buffers: heap, thp, hugetlb or file:PATH
+    Storage storage;
+
+    // Pipelined mode: the image is encoded while it is computed
+    bool pipeline = false;
+    unsigned encodeThreads = 0;
+
+    // Directory and size in MB of the cache of the tiles
+    std::string cacheDirectory;
+    uint64_t cacheSize = 1024;
+
+    // Server mode: tiles are computed on request
+    int serverPort = 0;
+    uint64_t memoryCacheSize = 256;
+
+    // Animation mode: frames zooming towards a point are streamed
+    int64_t nFrames = 0;
+    double targetX = -0.743643887037151, targetY = 0.131825904205330;
+    double zoomFactor = 0.98;
+    int fps = 30;
+    VideoFormat videoFormat = VideoFormat::Y4M;
+
+    // Pyramid mode: tiles of all the zoom levels are written
+    std::string pyramid;
+    PyramidLayout pyramidLayout = PyramidLayout::DZI;
+    int64_t pyramidTile = 256;
+
+    // Field mode: the iterations are saved instead of the colors, to be colored later
+    std::string field;
+    bool fieldHalf = false;
+    bool fieldDistance = false;
+    bool fieldCompress = true;
+    std::string recolor;
+
+    // Batch mode: the jobs are read from the standard input ("-") or from a directory
+    std::string batch;
+    int64_t batchJobs = 0;
+
+    // The tiles computed first: those in the regions, in pixels, then from the focus point,
+    // given as a fraction of the dimensions of the image
+    double focusX = 0.5, focusY = 0.5;
+    std::vector<Tile> regions;
+
+    // Shared memory mode: the frames are published to a local viewer without encoding
+    std::string shm;
+    uint32_t shmSlots = 4;
+    std::string shmWatch;
+
+    // Where the timeline of the threads is written, empty to disable the tracing
+    std::string trace;
+
+    // Where the costs of the pixels and of the tiles are written, empty for nowhere
+    std::string heatmap;
+
+    // Reports the hardware counters of the render and of the encoding, optionally with a raw vector event
+    bool perf = false;
+    uint64_t perfVector = 0;
+
+    // Estimate mode: the time and the memory of the render are predicted, optionally
+    // with the cost of an iteration measured by a JSON report of the benchmarks
+    bool estimate = false;
+    std::string calibration;
+
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
 
-// Returns to default packing settings
-#pragma pack(pop)
+        // Options which take a value
+        bool hasValue = i + 1 < argc;
 
-// This structure represents a raster Image
-// which can be written to a png file 
-struct Image
-{
-    // Create an image with specified dimensions
-    Image (int width, int height)
-        : width  (width)
-        , height (height)
-    {
-        // Creates a list of rows
-        data = new Color* [height];
+        if (arg == "--resolution" && hasValue)
+            resolution = atof (argv[++i]);
 
-        // Creates the rows one by one
-        for (int i = 0; i < height; i++)
-            data[i] = new Color [width * 3];
-    }
+        else if (arg == "--output" && hasValue)
+            output = argv[++i];
 
-    ~Image ()
-    {
-        // Deletes rows one by one
-        for (int i = 0; i < height; i++)
-            delete[] data[i];
+        else if (arg == "--stream")
+            stream = true;
+
+        else if (arg == "--band-height" && hasValue)
+            bandHeight = std::max (atoll (argv[++i]), 1ll);
+
+        else if (arg == "--max-bands" && hasValue)
+            maxBands = atoll (argv[++i]);
+
+        else if (arg == "--compress-bands")
+            compressBands = true;
+
+        else if (arg == "--level" && hasValue)
+            level = std::min (std::max (atoi (argv[++i]), 0), 9);
+
+        else if (arg == "--format" && hasValue)
+            fileFormat = Encoder::formatNamed (argv[++i]);
+
+        else if (arg == "--storage" && hasValue)
+            storage = Storage::parse (argv[++i]);
+
+        else if (arg == "--pipeline")
+            pipeline = true;
+
+        else if (arg == "--encode-threads" && hasValue)
+            encodeThreads = atoi (argv[++i]);
+
+        else if (arg == "--cache" && hasValue)
+            cacheDirectory = argv[++i];
+
+        else if (arg == "--cache-size" && hasValue)
+            cacheSize = atoll (argv[++i]);
+
+        else if (arg == "--serve" && hasValue)
+            serverPort = atoi (argv[++i]);
+
+        else if (arg == "--memory-cache" && hasValue)
+            memoryCacheSize = atoll (argv[++i]);
+
+        else if (arg == "--animate" && hasValue)
+            nFrames = atoll (argv[++i]);
+
+        else if (arg == "--zoom-to" && i + 2 < argc)
+        {
+            targetX = atof (argv[++i]);
+            targetY = atof (argv[++i]);
+        }
+
+        else if (arg == "--focus" && i + 2 < argc)
+        {
+            focusX = atof (argv[++i]);
+            focusY = atof (argv[++i]);
+        }
+
+        else if (arg == "--region" && i + 4 < argc)
+        {
+            Tile region;
+            region.left   = atoll (argv[++i]);
+            region.top    = atoll (argv[++i]);
+            region.right  = atoll (argv[++i]);
+            region.bottom = atoll (argv[++i]);
+            regions.push_back (region);
+        }
+
+        else if (arg == "--zoom-factor" && hasValue)
+            zoomFactor = atof (argv[++i]);
+
+        else if (arg == "--fps" && hasValue)
+            fps = std::max (atoi (argv[++i]), 1);
+
+        else if (arg == "--video" && hasValue)
+            videoFormat = std::string (argv[++i]) == "rgb" ? VideoFormat::RGB : VideoFormat::Y4M;
+
+        else if (arg == "--pyramid" && hasValue)
+        {
+            // Names ending with .dzi are Deep Zoom images, the others directories of XYZ tiles
+            pyramid = argv[++i];
+            pyramidLayout = pyramid.size() > 4 && pyramid.substr (pyramid.size() - 4) == ".dzi" ? 
+                            PyramidLayout::DZI : PyramidLayout::XYZ;
+        }
+
+        else if (arg == "--pyramid-tile" && hasValue)
+            pyramidTile = std::max (atoll (argv[++i]), 2ll) / 2 * 2;
 
-        // Delete the list of rows
-        delete[] data;
+        else if (arg == "--field" && hasValue)
+            field = argv[++i];
+
+        else if (arg == "--field-type" && hasValue)
+            fieldHalf = std::string (argv[++i]) == "f16";
+
+        else if (arg == "--field-distance")
+            fieldDistance = true;
+
+        else if (arg == "--field-raw")
+            fieldCompress = false;
+
+        else if (arg == "--recolor" && hasValue)
+            recolor = argv[++i];
+
+        else if (arg == "--batch" && hasValue)
+            batch = argv[++i];
+
+        else if (arg == "--batch-jobs" && hasValue)
+            batchJobs = atoll (argv[++i]);
+
+        else if (arg == "--shm" && hasValue)
+            shm = argv[++i];
+
+        else if (arg == "--shm-slots" && hasValue)
+            shmSlots = atoi (argv[++i]);
+
+        else if (arg == "--shm-watch" && hasValue)
+            shmWatch = argv[++i];
+
+        else if (arg == "--trace" && hasValue)
+            trace = argv[++i];
+
+        else if (arg == "--heatmap" && hasValue)
+            heatmap = argv[++i];
+
+        else if (arg == "--perf")
+            perf = true;
+
+        else if (arg == "--estimate")
+            estimate = true;
+
+        else if (arg == "--calibration" && hasValue)
+        {
+            estimate = true;
+            calibration = argv[++i];
+        }
+
+        else if (arg == "--perf-vector" && hasValue)
+        {
+            perf = true;
+            perfVector = strtoull (argv[++i], nullptr, 0);
+        }
+
+        else
+        {
+            std::cerr << "Unknown option " << arg << std::endl;
+            return 1;
+        }
     }
 
-    // Writes the image to a PNG file
-    void write (const char *filename)
+    // The trace is written when the program ends
+    if (!trace.empty ())
     {
-        // Opens the output file for writing
-        FILE *fp = fopen (filename, "wb");
- 
-        // Creates PNG data structure
-        png_struct *png_ptr  = png_create_write_struct (PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-        png_info   *info_ptr = png_create_info_struct (png_ptr);
-
-        // The output stream for the PNG data
-        png_init_io (png_ptr, fp);
-
-        // Sets information about the image
-        png_set_IHDR (png_ptr, info_ptr, width, height,
-                      8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
-                      PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
-
-        // Writes the png data
-        png_write_info(png_ptr, info_ptr);
-        png_write_image(png_ptr, (png_byte **) data);
-        png_write_end(png_ptr, NULL);
-
-        // Removes structures
-        png_destroy_write_struct (&png_ptr, &info_ptr);
-
-        // Closes the output file
-        fclose(fp);
+        Trace::nameThread ("main");
+        Trace::global ().start (trace);
     }
 
-    // Image data
-    Color **data;
+    if (perf)
+        PerfCounters::global ().start (perfVector);
 
-    // Dimensions
-    int width;
-    int height;
-};
+    if (fileFormat == FileFormat::Auto)
+        fileFormat = Encoder::formatOf (output);
 
-// This structure represents an image of a fractal which
-// must be computed and written to a file.
-struct Mandlebrot
-{
-    // Specifices the resolution and the corners of the image in the complex plane
-    Mandlebrot (double resolution, double left, double top, double right, double bottom)
-
-        // Allocates the image data
-        : image (int (resolution * (right - left)), int (resolution * (top - bottom)))
-        
-        // Default color of the body of the fractal
-        , bodyColor {0,0,0}
-
-        // Corners of the image in the complex plane
-        , left (left)
-        , right (right)
-        , top (top)
-        , bottom (bottom)
-
-        // Parameters for the rendering
-        , maxIterations (100)
-        , stopNorm (400)
+    // Only PNG files can be streamed
+    if (stream && fileFormat != FileFormat::PNG)
     {
-        // Compute slope and intercept
-        mSmooth = 1 / log2 (0.5 * log2 (std::norm(step(1e5, 0))) / log2(1e5));
-        bSmooth = log2 (0.5 * log2 (stopNorm)) * mSmooth;
+        std::cerr << "Only PNG files can be streamed" << std::endl;
+        return 1;
     }
 
-    // The step function of the fractal
-    static std::complex<double> step (std::complex<double> z, std::complex<double> c)
+    // The point is a fraction of the image
+    if (!(focusX >= 0 && focusX <= 1 && focusY >= 0 && focusY <= 1))
     {
-        return z*z + c;
+        std::cerr << "The focus point must be between 0 and 1" << std::endl;
+        return 1;
     }
 
-    // Compute a pixel of the image
-    void computePixel (int x, int y)
-    {
-        // Computes the current position in the complex plane
-        std::complex<double> c (left + (right - left) * x / image.width, 
-                                top  + (bottom - top) * y / image.height); 
-
-        // The initial point of the sequence
-        std::complex<double> z = c;
+    TileOrder order = TileOrder::regions (regions, focusX, focusY);
 
-        // The number of iterations made
-        int iN = 0;
-
-        // Iterate until the complex number exits or when many iterations have been made
-        while (std::norm(z) < stopNorm && iN++ < maxIterations)
-            z = step (z,c);
-        
-        // Fetches the output color        
-        Color &color = image.data[y][x];
-
-        if (iN >= maxIterations)
-            color = bodyColor;
+    Mandlebrot fractal (resolution, -2.7, +1.25, +1.7, -1.25, PixelFormat::RGB8,
+                        stream || serverPort || nFrames || !pyramid.empty() || !field.empty() || !recolor.empty() || !batch.empty() || !shm.empty() || estimate ? Storage {StorageKind::None} : storage);
+    //Mandlebrot fractal (1000, -1.5, +1.5, +1.5, -1.5);
 
-        else
-        {
+    // The modes without an image still allocate their buffers there
+    fractal.storage = storage;
 
-            // Computes the number of iterations smoothed using 
-            // the last value computed of the sequences 
-            double fN = iN + bSmooth - mSmooth * log2 (0.5 * log2 (std::norm (z)));
+    // Messages can't be mixed with the image
+    if (output == "-" || output.compare (0, 3, "fd:") == 0 || !batch.empty ())
+        fractal.log = &std::cerr;
 
-            // Selects the color used to paint the pixel 
-            double nC = (1 - exp (-0.05 * fN)) * (colorList.size() - 1);
+    // Adds colors to the fractal   
+    fractal.colorList.push_back (Color{  0,   0,   40 });
+    fractal.colorList.push_back (Color{  0,  50,  100 });
+    fractal.colorList.push_back (Color{  0,  200,  0 });
+    fractal.colorList.push_back (Color{ 255, 255, 100 });
+    fractal.colorList.push_back (Color{ 255, 255, 255 });
 
-            // Selects the index of the first color to use from the list
-            unsigned iC = unsigned (nC);
+    // Predicts the render without doing it
+    if (estimate)
+    {
+        unsigned threads = std::max (std::thread::hardware_concurrency (), 1u);
+        IterationCost cost = calibration.empty () ? IterationCost () : IterationCost::fromReport (calibration);
 
-            // Computes fractional part of the color to mix the first with the second
-            double fC = nC - iC;
+        RenderEstimate e = RenderEstimate::of (fractal, fractal.image.format, threads, cost);
 
-            // Selects the two colors to interpolate
-            Color& color1 = colorList[iC];
-            Color& color2 = colorList[iC+1];
+        std::cout << "Probe: " << e.samples << " pixels in " << e.probeSeconds << " seconds" << std::endl
+                  << "Iterations: " << e.iterations << " (" << e.iterationsLow << " - " << e.iterationsHigh << ")" << std::endl
+                  << "Time with " << threads << " threads: " << e.seconds << " seconds (" << e.secondsLow << " - " << e.secondsHigh << ")" << std::endl
+                  << "Peak memory: " << (e.memory / (1 << 20)) << " MB (" << (e.memoryLow / (1 << 20)) << " - " << (e.memoryHigh / (1 << 20)) << ")" << std::endl;
+        return 0;
+    }
 
-            // Converts the (linear) fractional part with a smooth function
-            double mix = 0.5 * (1 + cos (M_PI * fC));  
 
-            // Writes the color
-            color.red   = (unsigned char) (color1.red   * mix + color2.red   * (1-mix));
-            color.green = (unsigned char) (color1.green * mix + color2.green * (1-mix));
-            color.blue  = (unsigned char) (color1.blue  * mix + color2.blue  * (1-mix));
-        }
-    }
+    // Computed tiles are reused between runs
+    std::unique_ptr<TileCache> cache;
 
-    // Computes an area of the image
-    void computeArea (int leftArea, int topArea, int rightArea, int bottomArea)
+    if (!cacheDirectory.empty ())
     {
-        for (int y = topArea; y < bottomArea; y++)
-            for (int x = leftArea; x < rightArea; x++)
-                computePixel (x, y);                
+        cache.reset (new TileCache (cacheDirectory, cacheSize << 20));
+        fractal.cache = cache.get ();
     }
 
-    // Computes the image using a single core
-    void computeSingleCore ()
+    // Serves the tiles until the program is stopped
+    if (serverPort)
     {
-        // Computes the whole image
-        computeArea (0, 0, image.width, image.height);
+        TileServer (fractal, serverPort, memoryCacheSize << 20).run ();
+        return 0;
     }
 
-    // Computes the image using all available cores
-    void computeMultiCore ()
+    // Prints the events of a ring of another process until it ends
+    if (!shmWatch.empty ())
     {
-        // Gets the numbers of available cores
-        unsigned nThreads = std::thread::hardware_concurrency ();
+        SharedRing ring (shmWatch);
+        uint64_t n = ring.header->published;
 
-        // A list of thread
-        std::vector<std::thread> threads (nThreads);
+        std::cout << "Ring " << ring.header->width << "x" << ring.header->height << ", " 
+                  << ring.header->nSlots << " slots" << std::endl;
+
+        while (!ring.header->closed || n < ring.header->published)
+        {
+            uint64_t published = ring.wait (n, 1000);
+
+            for (; n < published; n++)
+            {
+                SharedRing::Event e;
+
+                if (!ring.read (n, e))
+                    std::cout << "Event " << n << " lost" << std::endl;
+
+                else if (e.kind == SharedRing::frameReady)
+                    std::cout << "Frame " << e.frame << " ready in slot " << e.slot << (ring.valid (e.frame) ? "" : ", overwritten") << std::endl;
+
+                else
+                    std::cout << "Frame " << e.frame << " tile " << e.left << "," << e.top << " - " << e.right << "," << e.bottom << std::endl;
+            }
+        }
+
+        return 0;
+    }
 
-        // The number of blocks taken and processed
-        std::atomic<int> nextBlock = 0;
-        std::atomic<int> doneBlock = 0;
+    // Publishes the frames in shared memory
+    if (!shm.empty ())
+    {
+        SharedRing ring (shm, fractal.width, fractal.height, PixelFormat::RGB8, shmSlots);
 
-        for (unsigned i = 0; i < nThreads; ++i) 
+        if (nFrames > 0)
         {
-            threads[i] = std::thread([&]
+            Animation animation (fractal, targetX, targetY, nFrames, zoomFactor);
+
+            for (int64_t f = 0; f < nFrames; f++)
             {
-                for (int currentBlock = nextBlock++; currentBlock < 100; currentBlock = nextBlock++)
-                {
-                    // Computes the block of the image
-                    computeArea ((currentBlock+0) * image.width / 100, 0, 
-                                 (currentBlock+1) * image.width / 100, image.height); 
-
-                    // Prints the current progress
-                    std::cout << "\rProcessing... " << ++doneBlock << "%" << std::flush;
-                }
-            });
+                Mandlebrot view = animation.view (f);
+                ring.render (view, f, order);
+
+                *fractal.log << "\rFrame " << f + 1 << " of " << nFrames << std::flush;
+            }
+
+            *fractal.log << "\n";
         }
 
-        // Waits all thereads
-        for (std::thread& th : threads)
-            th.join();
+        else
+            ring.render (fractal, 0, order);
 
-        std::cout << "\n";
+        return 0;
     }
 
-    // Image data and informations
-    Image image;
+    // Streams the frames of the animation
+    if (nFrames > 0)
+    {
+        Animation (fractal, targetX, targetY, nFrames, zoomFactor, fps, videoFormat).write (output);
+        return 0;
+    }
 
-    // List of colors in the outside of the fractal
-    std::vector<Color> colorList;
+    // Renders the jobs until the end of the input
+    if (!batch.empty ())
+    {
+        BatchWorker worker (fractal, batchJobs);
 
-    // Color in the inside of the fractal
-    Color bodyColor;
+        if (batch == "-")
+            worker.run (std::cin);
 
-    // The corners of the image in the complex plane
-    double left, right;
-    double top, bottom;
+        else
+            worker.runSpool (batch);
 
-    // Max iterations to consider the point inside the fractal
-    int maxIterations;
+        return 0;
+    }
 
-    // Radius to consider the point definitly outside the fractal
-    double stopNorm;
-    
-    // Precomputed coefficients
-    double mSmooth, bSmooth;
-};
+    // Colors the iterations saved in a field file
+    if (!recolor.empty ())
+    {
+        auto start = std::chrono::steady_clock::now ();
 
+        IterationField (recolor).color (fractal).write (output, level, fileFormat);
 
+        *fractal.log << "Field colored in " << std::chrono::duration <double> (std::chrono::steady_clock::now () - start).count() << " seconds" << std::endl;
+        return 0;
+    }
 
-int main (int argc, char **argv)
-{
-    Mandlebrot fractal (500, -2.7, +1.25, +1.7, -1.25);
-    //Mandlebrot fractal (1000, -1.5, +1.5, +1.5, -1.5);
+    // The costs are recorded only by the renders of the whole image with the pool
+    std::unique_ptr<Heatmap> costs;
 
-    // Adds colors to the fractal   
-    fractal.colorList.push_back (Color{  0,   0,   40 });
-    fractal.colorList.push_back (Color{  0,  50,  100 });
-    fractal.colorList.push_back (Color{  0,  200,  0 });
-    fractal.colorList.push_back (Color{ 255, 255, 100 });
-    fractal.colorList.push_back (Color{ 255, 255, 255 });
+    if (!heatmap.empty ())
+    {
+        if (!field.empty () || !pyramid.empty () || stream || pipeline)
+        {
+            std::cerr << "The heatmap is only available for the images computed in memory" << std::endl;
+            return 1;
+        }
 
+        costs.reset (new Heatmap (fractal));
+    }
+
+    // The work of the render is the difference of the counters
+    Counters::Values before = Counters::total ();
+    PerfCounters::Values perfBefore = PerfCounters::global ().total ();
 
     auto start = std::chrono::steady_clock::now ();
 
-    // Computes the image
-    fractal.computeMultiCore ();
+    // Saves the iterations of every pixel
+    if (!field.empty ())
+        IterationField::write (fractal, field, fractal.tileSize, fieldHalf, fieldDistance, fieldCompress);
+
+    // Computes the tiles of all the levels
+    else if (!pyramid.empty ())
+        Pyramid (fractal, pyramid, pyramidLayout, pyramidTile, level).build ();
+
+    // Computes the image, streaming it directly to the file
+    else if (stream)
+        fractal.computeStream (output.c_str(), bandHeight, maxBands, compressBands, level);
+
+    // Computes and writes the image at the same time
+    else if (pipeline)
+        fractal.computePipelined (output, fileFormat, level, encodeThreads);
+
+    else
+        fractal.computeMultiCore (order);
 
     auto end = std::chrono::steady_clock::now();
 
+    Counters::Values work = Counters::total () - before;
+    PerfCounters::Values perfRender = PerfCounters::global ().total () - perfBefore;
+
     // Computes the number of seconds taken
     double seconds = std::chrono::duration <double> (end - start).count();
 
     // How many pixels has this image?
-    double pixels = fractal.image.width * fractal.image.height;
+    double pixels = double (fractal.width) * fractal.height;
     
     // Writes a summary
-    std::cout << "Fractal produced in " << seconds << " seconds (" << (seconds * 1e9 / pixels) << " nsec/pixel)" << std::endl;
+    *fractal.log << (pipeline ? "Fractal produced and written in " : "Fractal produced in ") << seconds << " seconds (" << (seconds * 1e9 / pixels) << " nsec/pixel)" << std::endl;
+
+    // Views with many pixels inside the fractal cost more for each pixel
+    *fractal.log << "Iterations: " << work.iterations << " (" << (work.iterations / seconds / 1e6) << " M/s, " 
+                 << (work.iterations ? seconds * 1e9 / work.iterations : 0) << " nsec/iteration), pixels: " 
+                 << work.escaped << " escaped, " << work.interior << " interior, " << work.cached << " cached" << std::endl;
+
+    *fractal.log << "Peak memory: " << (Counters::peakMemory () >> 20) << " MB" << std::endl;
+
+    if (perf)
+        PerfCounters::global ().report (*fractal.log, pipeline ? "the render and the encoding" : "the render", perfRender);
+
+    if (cache)
+        *fractal.log << "Cache: " << cache->hits << " hits, " << cache->misses << " misses" << std::endl;
+
+    // Produces the image file
+    if (!stream && !pipeline && pyramid.empty () && field.empty ())
+    {
+        start = std::chrono::steady_clock::now ();
+        perfBefore = PerfCounters::global ().total ();
+
+        fractal.image.write (output, level, fileFormat);
+
+        end = std::chrono::steady_clock::now();
+
+        *fractal.log << "Image written in " << std::chrono::duration <double> (end - start).count() << " seconds" << std::endl;
+
+        if (perf)
+            PerfCounters::global ().report (*fractal.log, "the encoding", PerfCounters::global ().total () - perfBefore);
+    }
+
+    if (costs)
+        costs->write (heatmap, level);
 
-    // Produces the PNG file
-    fractal.image.write ("img/out9.png");
     return 0;
-}
\ No newline at end of file
+}
+
+int main (int argc, char **argv)
+{
+    // Bad options, files which can't be written and failed renders end with a message
+    try
+    {
+        return run (argc, argv);
+    }
+    catch (const std::exception &error)
+    {
+        std::cerr << "Error: " << error.what () << std::endl;
+        return 1;
+    }
+}
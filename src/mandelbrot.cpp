@@ -0,0 +1,503 @@
+/*
+    Fractal Image Generator
+
+    Author: Alberto Boldrini
+
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "mandelbrot.hpp"
+#include "fractal.hpp"
+#include "estimate.hpp"
+
+
+namespace mandelbrot
+{
+
+// The threads and the cache of a renderer
+struct Renderer::State
+{
+    State (unsigned threads, const std::string &cacheDirectory, uint64_t cacheBytes)
+        : pool (threads ? threads : std::thread::hardware_concurrency ())
+    {
+        if (!cacheDirectory.empty ())
+            cache.reset (new TileCache (cacheDirectory, cacheBytes));
+    }
+
+    // Creates the fractal of a request, without its image
+    Mandlebrot fractal (const RenderRequest &request)
+    {
+        if (request.width <= 0 || request.height <= 0)
+            throw std::runtime_error ("Invalid dimensions of the image");
+
+        if (!(request.right > request.left) || !(request.top > request.bottom))
+            throw std::runtime_error ("Empty view");
+
+        if (request.palette.size () == 1)
+            throw std::runtime_error ("The palette needs at least two colors");
+
+        if (int (request.format) < 0 || int (request.format) > int (Format::Float32))
+            throw std::runtime_error ("Unknown pixel format");
+
+        Mandlebrot fractal (1, request.left, request.top, request.right, request.bottom, 
+                            PixelFormat (request.format), Storage {StorageKind::None});
+
+        fractal.width  = request.width;
+        fractal.height = request.height;
+        fractal.image  = Image ();
+
+        fractal.maxIterations = request.maxIterations;
+        fractal.tileSize      = std::max (request.tileSize, int64_t (1));
+        fractal.cache         = cache.get ();
+        fractal.storage       = Storage::parse (request.storage);
+        fractal.log           = nullptr;
+
+        // The smoothing depends on the norm where the iterations stop
+        fractal.stopNorm = request.stopNorm;
+        fractal.bSmooth  = log2 (0.5 * log2 (fractal.stopNorm)) * fractal.mSmooth;
+
+        fractal.bodyColor = Color {request.interior.red, request.interior.green, request.interior.blue};
+
+        for (const Rgb &color : request.palette)
+            fractal.colorList.push_back (Color {color.red, color.green, color.blue});
+
+        // The colors of the program
+        if (fractal.colorList.empty ())
+            fractal.colorList = {Color {  0,   0,  40}, Color {  0,  50, 100}, Color {  0, 200,   0},
+                                 Color {255, 255, 100}, Color {255, 255, 255}};
+
+        return fractal;
+    }
+
+    // The order of the tiles of a request
+    static TileOrder order (const RenderRequest &request)
+    {
+        if (!(request.focusX >= 0 && request.focusX <= 1 && request.focusY >= 0 && request.focusY <= 1))
+            throw std::runtime_error ("The focus point must be between 0 and 1");
+
+        std::vector<Tile> regions;
+
+        for (const Rect &region : request.regions)
+        {
+            if (!(region.right > region.left && region.bottom > region.top))
+                throw std::runtime_error ("Empty region");
+
+            regions.push_back (Tile {region.left, region.top, region.right, region.bottom});
+        }
+
+        return TileOrder::regions (regions, request.focusX, request.focusY);
+    }
+
+    ThreadPool pool;
+    std::unique_ptr<TileCache> cache;
+};
+
+// The end of a render, shared by the handles and the threads
+struct RenderHandle::State
+{
+    State ()
+        : done (false)
+        , future (promise.get_future ().share ())
+    {
+    }
+
+    // Called once, by the thread which completes the render
+    void finish (std::exception_ptr e)
+    {
+        std::vector<std::function<void (std::exception_ptr)>> waiting;
+        {
+            std::lock_guard<std::mutex> lock (mutex);
+
+            done = true;
+            error = e;
+            waiting.swap (callbacks);
+        }
+
+        if (e)
+            promise.set_exception (e);
+        else
+            promise.set_value ();
+
+        for (auto &callback : waiting)
+            callback (e);
+    }
+
+    std::mutex mutex;
+    bool done;
+    std::exception_ptr error;
+
+    // Functions waiting the end
+    std::vector<std::function<void (std::exception_ptr)>> callbacks;
+
+    std::promise<void> promise;
+    std::shared_future<void> future;
+};
+
+void RenderHandle::wait () const
+{
+    state->future.get ();
+}
+
+bool RenderHandle::ready () const
+{
+    std::lock_guard<std::mutex> lock (state->mutex);
+    return state->done;
+}
+
+void RenderHandle::then (std::function<void (std::exception_ptr error)> callback) const
+{
+    {
+        std::lock_guard<std::mutex> lock (state->mutex);
+
+        if (!state->done)
+        {
+            state->callbacks.push_back (std::move (callback));
+            return;
+        }
+    }
+
+    callback (state->error);
+}
+
+std::shared_future<void> RenderHandle::future () const
+{
+    return state->future;
+}
+
+size_t bytesPerPixel (Format format)
+{
+    return ::bytesPerPixel (PixelFormat (format));
+}
+
+Renderer::Renderer (unsigned threads, const std::string &cacheDirectory, uint64_t cacheBytes)
+    : state (new State (threads, cacheDirectory, cacheBytes))
+{
+}
+
+Renderer::~Renderer ()
+{
+}
+
+RenderHandle Renderer::submit (const RenderRequest &request, void *pixels, size_t stride, TileCallback onTile,
+                               float *iterations, size_t iterationStride)
+{
+    // The fractal lives until the end of the render
+    std::shared_ptr<Mandlebrot> fractal (new Mandlebrot (state->fractal (request)));
+
+    if (!pixels || stride < size_t (request.width) * bytesPerPixel (request.format))
+        throw std::runtime_error ("The buffer is too small for the image");
+
+    if (iterations && iterationStride < size_t (request.width))
+        throw std::runtime_error ("The buffer of the iterations is too small for the image");
+
+    // The pixels are written directly in the buffer
+    fractal->image = Image ((unsigned char *) pixels, stride, request.width, request.height, PixelFormat (request.format));
+    fractal->iterations = iterations;
+    fractal->iterationStride = iterationStride;
+
+    RenderHandle handle;
+    handle.state.reset (new RenderHandle::State);
+
+    std::shared_ptr<RenderHandle::State> end = handle.state;
+    size_t pixelBytes = bytesPerPixel (request.format);
+
+    Mandlebrot::TileCallback tileDone;
+
+    if (onTile)
+        tileDone = [fractal, onTile, pixelBytes] (const Tile &tile)
+        {
+            onTile (TileView {tile.left, tile.top, tile.right, tile.bottom, 
+                              fractal->image.row (tile.top) + tile.left * pixelBytes, fractal->image.stride});
+        };
+
+    fractal->computeAsync (State::order (request), state->pool, tileDone, [fractal, end] (std::exception_ptr error)
+    {
+        end->finish (error);
+    });
+
+    return handle;
+}
+
+void Renderer::render (const RenderRequest &request, void *pixels, size_t stride)
+{
+    submit (request, pixels, stride).wait ();
+}
+
+void Renderer::render (const RenderRequest &request, void *pixels, size_t stride, float *iterations, size_t iterationStride)
+{
+    if (!iterations)
+        throw std::runtime_error ("Null buffer of the iterations");
+
+    submit (request, pixels, stride, nullptr, iterations, iterationStride).wait ();
+}
+
+std::vector<unsigned char> Renderer::render (const RenderRequest &request)
+{
+    size_t stride = size_t (std::max (request.width, int64_t (0))) * bytesPerPixel (request.format);
+    std::vector<unsigned char> pixels (stride * std::max (request.height, int64_t (0)));
+
+    render (request, pixels.data (), stride);
+
+    return pixels;
+}
+
+void Renderer::renderFile (const RenderRequest &request, const std::string &filename, int level)
+{
+    Mandlebrot fractal = state->fractal (request);
+
+    fractal.image = Image (request.width, request.height, PixelFormat (request.format), fractal.storage);
+    fractal.computeMultiCore (State::order (request), state->pool);
+
+    // The encoders use the threads of the renderer
+    std::unique_ptr<Encoder> encoder = Encoder::create (Encoder::formatOf (filename), std::min (std::max (level, 0), 9));
+    encoder->pool = &state->pool;
+
+    FILE *fp = openOutput (filename);
+
+    encoder->write (fractal.image, fp);
+    fclose (fp);
+}
+
+Estimate Renderer::estimate (const RenderRequest &request, double nsPerIteration)
+{
+    Mandlebrot fractal = state->fractal (request);
+    RenderEstimate e = RenderEstimate::of (fractal, PixelFormat (request.format), state->pool.size (), 
+                                           IterationCost {nsPerIteration, nsPerIteration, nsPerIteration});
+
+    return Estimate {e.iterations, e.iterationsLow, e.iterationsHigh, e.seconds, e.secondsLow, e.secondsHigh,
+                     e.memory, e.memoryLow, e.memoryHigh};
+}
+
+unsigned Renderer::threads () const
+{
+    return state->pool.size ();
+}
+
+}
+
+
+// The C interface, the exceptions become error messages
+
+// The message of the last error of each thread
+static thread_local std::string lastError;
+
+// Runs a function storing the message of its exceptions
+template <typename Function>
+static int guarded (Function function)
+{
+    try
+    {
+        function ();
+        return 0;
+    }
+    catch (const std::exception &e)
+    {
+        lastError = e.what ();
+    }
+    catch (...)
+    {
+        lastError = "Unknown error";
+    }
+
+    return -1;
+}
+
+struct mandelbrot_job
+{
+    mandelbrot::RenderHandle handle;
+};
+
+// Converts a request of the C interface, reading only the members known by the caller
+static mandelbrot::RenderRequest requestOf (const mandelbrot_request *request)
+{
+    if (!request || request->size < offsetof (mandelbrot_request, tile_size) + sizeof (request->tile_size))
+        throw std::runtime_error ("The request was not initialized with mandelbrot_request_init");
+
+    mandelbrot::RenderRequest other;
+
+    other.left   = request->left;
+    other.top    = request->top;
+    other.right  = request->right;
+    other.bottom = request->bottom;
+    other.width  = request->width;
+    other.height = request->height;
+
+    other.maxIterations = request->max_iterations;
+    other.stopNorm      = request->stop_norm;
+
+    if (request->palette)
+        for (int32_t i = 0; i < request->palette_colors; i++)
+            other.palette.push_back (mandelbrot::Rgb {request->palette[3 * i], request->palette[3 * i + 1], 
+                                                      request->palette[3 * i + 2]});
+
+    other.interior = mandelbrot::Rgb {request->interior[0], request->interior[1], request->interior[2]};
+    other.format   = mandelbrot::Format (request->format);
+    other.tileSize = request->tile_size;
+
+    // Members of newer versions of the header
+    if (request->size >= offsetof (mandelbrot_request, storage) + sizeof (request->storage) && request->storage)
+        other.storage = request->storage;
+
+    if (request->size >= offsetof (mandelbrot_request, region_count) + sizeof (request->region_count))
+    {
+        other.focusX = request->focus_x;
+        other.focusY = request->focus_y;
+
+        if (request->regions)
+            for (int32_t i = 0; i < request->region_count; i++)
+                other.regions.push_back (mandelbrot::Rect {request->regions[4 * i], request->regions[4 * i + 1],
+                                                           request->regions[4 * i + 2], request->regions[4 * i + 3]});
+    }
+
+    return other;
+}
+
+struct mandelbrot_renderer
+{
+    mandelbrot::Renderer renderer;
+};
+
+// Returns the C++ renderer
+static mandelbrot::Renderer &rendererOf (mandelbrot_renderer *renderer)
+{
+    if (!renderer)
+        throw std::runtime_error ("Null renderer");
+
+    return renderer->renderer;
+}
+
+void mandelbrot_request_init (mandelbrot_request *request)
+{
+    mandelbrot::RenderRequest defaults;
+
+    *request = mandelbrot_request {};
+
+    request->size   = sizeof (mandelbrot_request);
+    request->left   = defaults.left;
+    request->top    = defaults.top;
+    request->right  = defaults.right;
+    request->bottom = defaults.bottom;
+    request->width  = defaults.width;
+    request->height = defaults.height;
+
+    request->max_iterations = defaults.maxIterations;
+    request->stop_norm      = defaults.stopNorm;
+    request->format         = MANDELBROT_RGB8;
+    request->tile_size      = defaults.tileSize;
+    request->focus_x        = defaults.focusX;
+    request->focus_y        = defaults.focusY;
+}
+
+mandelbrot_renderer *mandelbrot_renderer_create (unsigned threads, const char *cache_directory, uint64_t cache_bytes)
+{
+    mandelbrot_renderer *renderer = nullptr;
+
+    guarded ([&] { renderer = new mandelbrot_renderer {mandelbrot::Renderer (threads, cache_directory ? cache_directory : "", cache_bytes)}; });
+
+    return renderer;
+}
+
+void mandelbrot_renderer_destroy (mandelbrot_renderer *renderer)
+{
+    delete renderer;
+}
+
+int mandelbrot_render (mandelbrot_renderer *renderer, const mandelbrot_request *request, void *pixels, size_t stride)
+{
+    return guarded ([&] { rendererOf (renderer).render (requestOf (request), pixels, stride); });
+}
+
+int mandelbrot_render_iterations (mandelbrot_renderer *renderer, const mandelbrot_request *request, void *pixels, 
+                                  size_t stride, float *iterations, size_t iteration_stride)
+{
+    return guarded ([&] { rendererOf (renderer).render (requestOf (request), pixels, stride, iterations, iteration_stride); });
+}
+
+mandelbrot_job *mandelbrot_render_async (mandelbrot_renderer *renderer, const mandelbrot_request *request, void *pixels, 
+                                         size_t stride, mandelbrot_tile_callback on_tile, void *user)
+{
+    mandelbrot_job *job = nullptr;
+
+    guarded ([&]
+    {
+        mandelbrot::TileCallback onTile;
+
+        if (on_tile)
+            onTile = [on_tile, user] (const mandelbrot::TileView &tile)
+            {
+                on_tile (user, tile.left, tile.top, tile.right, tile.bottom, tile.pixels, tile.stride);
+            };
+
+        job = new mandelbrot_job {rendererOf (renderer).submit (requestOf (request), pixels, stride, onTile)};
+    });
+
+    return job;
+}
+
+int mandelbrot_job_wait (mandelbrot_job *job)
+{
+    return guarded ([&]
+    {
+        if (!job)
+            throw std::runtime_error ("Null job");
+
+        job->handle.wait ();
+    });
+}
+
+int mandelbrot_job_ready (mandelbrot_job *job)
+{
+    return job && job->handle.ready () ? 1 : 0;
+}
+
+void mandelbrot_job_destroy (mandelbrot_job *job)
+{
+    if (!job)
+        return;
+
+    // The threads still write in the memory of the caller
+    job->handle.future ().wait ();
+    delete job;
+}
+
+int mandelbrot_render_file (mandelbrot_renderer *renderer, const mandelbrot_request *request, const char *filename, int level)
+{
+    return guarded ([&] { rendererOf (renderer).renderFile (requestOf (request), filename ? filename : "", level); });
+}
+
+int mandelbrot_estimate_render (mandelbrot_renderer *renderer, const mandelbrot_request *request,
+                                double ns_per_iteration, mandelbrot_estimate *estimate)
+{
+    return guarded ([&]
+    {
+        if (!estimate)
+            throw std::runtime_error ("Null estimate");
+
+        mandelbrot::Estimate e = rendererOf (renderer).estimate (requestOf (request), ns_per_iteration);
+
+        *estimate = mandelbrot_estimate {e.iterations, e.iterationsLow, e.iterationsHigh, e.seconds, e.secondsLow, e.secondsHigh,
+                                         e.memory, e.memoryLow, e.memoryHigh};
+    });
+}
+
+size_t mandelbrot_bytes_per_pixel (int32_t format)
+{
+    return format >= MANDELBROT_RGB8 && format <= MANDELBROT_FLOAT32 ? bytesPerPixel (PixelFormat (format)) : 0;
+}
+
+const char *mandelbrot_last_error (void)
+{
+    return lastError.c_str ();
+}
@@ -0,0 +1,219 @@
+/*
+    Fractal Image Generator
+
+    Author: Alberto Boldrini
+
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PERF_HPP
+#define PERF_HPP
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+
+// This structure reads the performance counters of the processor with perf_event_open.
+// Each thread opens its own counters with its first task, and the counts of all the
+// threads are summed when the totals are read: the difference of the totals before and
+// after a phase tells where its time went. The counters which the kernel doesn't allow,
+// or the processor doesn't have, are reported as not available.
+struct PerfCounters
+{
+    enum Event {taskClock, cycles, instructions, l1Misses, llcMisses, branchMisses, vector, nEvents};
+
+    // The counts of the events, scaled when the kernel had to multiplex them
+    struct Values
+    {
+        double counts[nEvents] = {};
+        bool available[nEvents] = {};
+
+        Values operator- (const Values &other) const
+        {
+            Values values = *this;
+
+            for (int e = 0; e < nEvents; e++)
+                values.counts[e] -= other.counts[e];
+
+            return values;
+        }
+
+        double instructionsPerCycle () const
+        {
+            return available[cycles] && available[instructions] && counts[cycles] > 0 ? counts[instructions] / counts[cycles] : 0;
+        }
+    };
+
+    static const char *name (int event)
+    {
+        static const char *names[nEvents] = {"task-clock-ns", "cycles", "instructions", "l1d-read-misses", 
+                                             "llc-misses", "branch-misses", "vector"};
+        return names[event];
+    }
+
+    // The counters of a thread
+    struct Thread
+    {
+        int fds[nEvents];
+
+        ~Thread ()
+        {
+            for (int fd : fds)
+                if (fd >= 0)
+                    close (fd);
+        }
+    };
+
+    static PerfCounters &global ()
+    {
+        static PerfCounters counters;
+        return counters;
+    }
+
+    // Starts counting on the calling thread and on the threads which run tasks from now.
+    // There is no portable event for the vector instructions: a raw event of the
+    // processor can be given, like 0x1fc7 for the retired AVX instructions of recent Intel cores.
+    void start (uint64_t vectorEvent = 0)
+    {
+        this->vectorEvent = vectorEvent;
+        enabled = true;
+        attach ();
+    }
+
+    static bool on ()
+    {
+        return global ().enabled.load (std::memory_order_relaxed);
+    }
+
+    // Opens the counters of the calling thread, once
+    static void attach ()
+    {
+        static thread_local bool attached = false;
+
+        if (attached || !on ())
+            return;
+
+        attached = true;
+        global ().open ();
+    }
+
+    void open ()
+    {
+        std::unique_ptr<Thread> thread (new Thread);
+
+        for (int e = 0; e < nEvents; e++)
+        {
+            perf_event_attr attr;
+            memset (&attr, 0, sizeof (attr));
+
+            attr.size = sizeof (attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+
+            switch (e)
+            {
+                case taskClock:    attr.type = PERF_TYPE_SOFTWARE; attr.config = PERF_COUNT_SW_TASK_CLOCK; break;
+                case cycles:       attr.config = PERF_COUNT_HW_CPU_CYCLES;       break;
+                case instructions: attr.config = PERF_COUNT_HW_INSTRUCTIONS;     break;
+                case llcMisses:    attr.config = PERF_COUNT_HW_CACHE_MISSES;     break;
+                case branchMisses: attr.config = PERF_COUNT_HW_BRANCH_MISSES;    break;
+                case vector:       attr.type = PERF_TYPE_RAW; attr.config = vectorEvent; break;
+
+                case l1Misses:
+                    attr.type = PERF_TYPE_HW_CACHE;
+                    attr.config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+                    break;
+            }
+
+            thread->fds[e] = e == vector && !vectorEvent ? -1 : syscall (SYS_perf_event_open, &attr, 0, -1, -1, 0);
+
+            std::lock_guard<std::mutex> lock (mutex);
+
+            // Keeps the first reason of a failure for the report
+            if (thread->fds[e] < 0 && error.empty () && !(e == vector && !vectorEvent))
+                error = std::string (name (e)) + ": " + strerror (errno);
+        }
+
+        std::lock_guard<std::mutex> lock (mutex);
+        threads.push_back (std::move (thread));
+    }
+
+    // The sum of the counters of all the threads, also of the ended ones
+    Values total ()
+    {
+        std::lock_guard<std::mutex> lock (mutex);
+        Values values;
+
+        for (const auto &thread : threads)
+            for (int e = 0; e < nEvents; e++)
+            {
+                // The count and the times the counter was enabled and running
+                uint64_t data[3];
+
+                if (thread->fds[e] < 0 || read (thread->fds[e], data, sizeof (data)) != sizeof (data))
+                    continue;
+
+                values.available[e] = true;
+                values.counts[e] += data[2] ? double (data[0]) * data[1] / data[2] : 0;
+            }
+
+        return values;
+    }
+
+    // Writes the counts of a phase on a line
+    void report (std::ostream &out, const std::string &phase, const Values &values)
+    {
+        out << "Counters of " << phase << ":";
+
+        for (int e = 0; e < nEvents; e++)
+            if (values.available[e])
+                out << " " << name (e) << " " << uint64_t (values.counts[e]);
+
+        if (values.instructionsPerCycle () > 0)
+            out << ", IPC " << values.instructionsPerCycle ();
+
+        std::lock_guard<std::mutex> lock (mutex);
+
+        if (!error.empty ())
+            out << " (not all available, " << error << ")";
+
+        out << std::endl;
+    }
+
+    std::atomic<bool> enabled {false};
+    uint64_t vectorEvent = 0;
+
+    // The first error of perf_event_open
+    std::string error;
+
+    // The counters of all the threads, kept after their end
+    std::mutex mutex;
+    std::vector<std::unique_ptr<Thread>> threads;
+};
+
+#endif
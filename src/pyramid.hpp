@@ -0,0 +1,354 @@
+/*
+    Fractal Image Generator
+
+    Author: Alberto Boldrini
+
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PYRAMID_HPP
+#define PYRAMID_HPP
+
+#include "fractal.hpp"
+
+
+// The ways in which the tiles of a pyramid are stored
+enum class PyramidLayout
+{
+    DZI,        // Deep Zoom: name.dzi and name_files/level/column_row.png, down to a single pixel
+    XYZ         // Map tiles: z/x/y.png, from a single tile (z = 0) to the full resolution
+};
+
+// This structure builds a pyramid of tiles of a fractal in one pass. The tiles of the
+// full resolution level are computed by the thread pool in Z order; as soon as a tile is
+// ready it is reduced 2x2 in its parent, and the thread that completes a parent writes it
+// and reduces it in the next level, while the pixels are still in cache.
+// Tiles already present on disk are not computed again, so a broken build can be resumed.
+// Only the tiles with a missing descendant are written again.
+struct Pyramid
+{
+    // A tile of the pyramid
+    struct Key
+    {
+        int level;
+        int64_t x, y;
+
+        bool operator< (const Key &other) const
+        {
+            return std::tie (level, x, y) < std::tie (other.level, other.x, other.y);
+        }
+    };
+
+    // A tile waiting for its children
+    struct Node
+    {
+        // Sums of the colors of the children pixels and number of children pixels
+        // summed in each pixel, in one buffer allocated by the first child
+        Buffer memory;
+        uint32_t *sums = nullptr;
+        unsigned char *counts = nullptr;
+
+        // Children not yet reduced
+        std::atomic<int> pending {0};
+    };
+
+    // The fractal gives the geometry and the colors; its image is not used.
+    // The side of the tiles must be even.
+    Pyramid (Mandlebrot &fractal, const std::string &path, PyramidLayout layout = PyramidLayout::DZI,
+             int64_t tileSize = 256, int level = 6)
+        : fractal (fractal)
+        , path (path)
+        , layout (layout)
+        , tileSize (tileSize)
+        , level (level)
+    {
+        // Levels from the full resolution down to a single pixel
+        int64_t w = fractal.width;
+        int64_t h = fractal.height;
+
+        while (true)
+        {
+            levelWidth.insert (levelWidth.begin(), w);
+            levelHeight.insert (levelHeight.begin(), h);
+
+            if (w == 1 && h == 1)
+                break;
+
+            w = (w + 1) / 2;
+            h = (h + 1) / 2;
+        }
+
+        baseLevel = levelWidth.size() - 1;
+
+        // DZI keeps all the levels, XYZ starts from the first one in a single tile,
+        // which is the base level when the whole image fits in a tile
+        topLevel = 0;
+
+        if (layout == PyramidLayout::XYZ)
+            while (topLevel < baseLevel && levelWidth[topLevel + 1] <= tileSize && levelHeight[topLevel + 1] <= tileSize)
+                topLevel++;
+    }
+
+    // Number of tiles of a level
+    int64_t columns (int l) const { return (levelWidth[l]  + tileSize - 1) / tileSize; }
+    int64_t rows    (int l) const { return (levelHeight[l] + tileSize - 1) / tileSize; }
+
+    // The file of a tile
+    std::string tileName (const Key &key) const
+    {
+        if (layout == PyramidLayout::XYZ)
+            return path + "/" + std::to_string (key.level - topLevel) + "/" + 
+                   std::to_string (key.x) + "/" + std::to_string (key.y) + ".png";
+
+        // The tiles of name.dzi are in name_files
+        std::string base = path.substr (0, path.rfind (".dzi"));
+
+        return base + "_files/" + std::to_string (key.level) + "/" + 
+               std::to_string (key.x) + "_" + std::to_string (key.y) + ".png";
+    }
+
+    // Writes a tile atomically, a tile on disk is always complete
+    void writeTile (const Key &key, const Image &tile) const
+    {
+        std::string name = tileName (key);
+        std::string temporary = name + ".tmp";
+
+        std::filesystem::create_directories (std::filesystem::path (name).parent_path ());
+
+        PngWriter writer (temporary.c_str(), tile.width, tile.height, tile.format, level);
+        writer.writeRows (tile.data, tile.stride, tile.height);
+        writer.finish ();
+
+        std::filesystem::rename (temporary, name);
+    }
+
+    // Decides which tiles must be computed or read from the disk to complete a tile.
+    // Returns true when the tile and all its children are already on disk.
+    bool plan (const Key &key, std::vector<Key> &sources)
+    {
+        bool exists = std::filesystem::exists (tileName (key));
+
+        // Missing tiles of the full resolution are computed
+        if (key.level == baseLevel)
+        {
+            if (!exists)
+                sources.push_back (key);
+
+            return exists;
+        }
+
+        // Children which exist in the next level
+        std::vector<Key> children;
+
+        for (int64_t y = 2 * key.y; y < std::min (2 * key.y + 2, rows (key.level + 1)); y++)
+            for (int64_t x = 2 * key.x; x < std::min (2 * key.x + 2, columns (key.level + 1)); x++)
+                children.push_back (Key {key.level + 1, x, y});
+
+        std::vector<Key> complete;
+
+        for (const Key &child : children)
+            if (plan (child, sources))
+                complete.push_back (child);
+
+        if (exists && complete.size() == children.size())
+            return true;
+
+        // The tile is rebuilt: the complete children are read from the disk
+        sources.insert (sources.end(), complete.begin(), complete.end());
+
+        nodes[key].reset (new Node);
+        nodes[key]->pending = children.size();
+
+        return false;
+    }
+
+    // Reduces a complete tile in its parent, completing the parents recursively
+    void finish (const Key &key, const Image &tile)
+    {
+        if (key.level == topLevel)
+            return;
+
+        Key parentKey {key.level - 1, key.x / 2, key.y / 2};
+        Node *parent;
+        {
+            std::lock_guard<std::mutex> lock (mutex);
+            parent = nodes[parentKey].get ();
+
+            // The first child allocates the sums
+            if (!parent->sums)
+            {
+                size_t pixels = tileSize * tileSize;
+
+                parent->memory = Buffer (pixels * (3 * sizeof (uint32_t) + 1), fractal.storage.scratch ());
+                parent->memory.clear ();
+
+                parent->sums   = (uint32_t *) parent->memory.data;
+                parent->counts = parent->memory.data + pixels * 3 * sizeof (uint32_t);
+            }
+        }
+
+        // Position of the child in the parent
+        int64_t offsetX = (key.x & 1) * tileSize;
+        int64_t offsetY = (key.y & 1) * tileSize;
+
+        for (int64_t j = 0; j < tile.height; j++)
+            for (int64_t i = 0; i < tile.width; i++)
+            {
+                Color color = tile.getPixel (i, j);
+                int64_t p = ((offsetY + j) / 2) * tileSize + (offsetX + i) / 2;
+
+                parent->sums[3*p+0] += color.red;
+                parent->sums[3*p+1] += color.green;
+                parent->sums[3*p+2] += color.blue;
+                parent->counts[p]++;
+            }
+
+        // The last child completes the parent
+        if (--parent->pending > 0)
+            return;
+
+        int l = parentKey.level;
+        Image image (std::min (tileSize, levelWidth[l]  - parentKey.x * tileSize),
+                     std::min (tileSize, levelHeight[l] - parentKey.y * tileSize), PixelFormat::RGB8, fractal.storage.scratch ());
+
+        for (int64_t j = 0; j < image.height; j++)
+            for (int64_t i = 0; i < image.width; i++)
+            {
+                int64_t p = j * tileSize + i;
+                int n = parent->counts[p];
+
+                image.setPixel (i, j, Color {(unsigned char) ((parent->sums[3*p+0] + n/2) / n),
+                                             (unsigned char) ((parent->sums[3*p+1] + n/2) / n),
+                                             (unsigned char) ((parent->sums[3*p+2] + n/2) / n)});
+            }
+
+        {
+            std::lock_guard<std::mutex> lock (mutex);
+            nodes.erase (parentKey);
+        }
+
+        writeTile (parentKey, image);
+        finish (parentKey, image);
+    }
+
+    // Interleaves the bits of the coordinates, tiles close in Z order share their parents
+    static uint64_t morton (uint64_t x, uint64_t y)
+    {
+        uint64_t code = 0;
+
+        for (int bit = 0; bit < 32; bit++)
+            code |= ((x >> bit & 1) << (2 * bit)) | ((y >> bit & 1) << (2 * bit + 1));
+
+        return code;
+    }
+
+    // Computes and writes all the missing tiles
+    void build (ThreadPool &pool = ThreadPool::global ())
+    {
+        // The description of the image
+        if (layout == PyramidLayout::DZI)
+        {
+            std::filesystem::path file (path);
+
+            if (file.has_parent_path ())
+                std::filesystem::create_directories (file.parent_path ());
+
+            std::ofstream dzi (path);
+            dzi << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                << "<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\" Format=\"png\" Overlap=\"0\" TileSize=\"" << tileSize << "\">\n"
+                << "  <Size Width=\"" << fractal.width << "\" Height=\"" << fractal.height << "\"/>\n"
+                << "</Image>\n";
+        }
+
+        // The missing tiles to compute and the ones to read from the disk
+        std::vector<Key> sources;
+
+        for (int64_t y = 0; y < rows (topLevel); y++)
+            for (int64_t x = 0; x < columns (topLevel); x++)
+                plan (Key {topLevel, x, y}, sources);
+
+        // Progress of the computation
+        size_t doneSources = 0;
+
+        // All the tiles belong to the same request
+        TaskGroup tasks (pool);
+
+        for (const Key &key : sources)
+        {
+            // Tiles are computed in Z order of the full resolution level
+            int shift = baseLevel - key.level;
+            double order = morton (key.x << shift, key.y << shift) / double (morton (columns (baseLevel), rows (baseLevel)) + 1);
+
+            tasks.submit (1.0 - order, [&, key]
+            {
+                std::string name = tileName (key);
+
+                // Reads the tiles already written
+                if (std::filesystem::exists (name))
+                    finish (key, readPng (name));
+
+                else
+                {
+                    int64_t left = key.x * tileSize;
+                    int64_t top  = key.y * tileSize;
+
+                    Image tile (std::min (tileSize, fractal.width - left), std::min (tileSize, fractal.height - top),
+                                PixelFormat::RGB8, fractal.storage.scratch ());
+                    fractal.computeTile (Tile {left, top, left + tile.width, top + tile.height}, tile, 0, 0);
+
+                    writeTile (key, tile);
+                    finish (key, tile);
+                }
+
+                std::lock_guard<std::mutex> lock (mutex);
+
+                // Prints the current progress when the percentage changes
+                doneSources++;
+
+                if (fractal.log && doneSources * 100 / sources.size() != (doneSources - 1) * 100 / sources.size())
+                    *fractal.log << "\rProcessing... " << doneSources * 100 / sources.size() << "%" << std::flush;
+            });
+        }
+
+        // Waits all the tiles, throws the first error
+        tasks.wait ();
+
+        if (fractal.log)
+            *fractal.log << "\n";
+    }
+
+    // The fractal to compute
+    Mandlebrot &fractal;
+
+    // The .dzi file or the directory of the XYZ tiles
+    std::string path;
+    PyramidLayout layout;
+
+    // Side of the tiles and compression level of the PNG files
+    int64_t tileSize;
+    int level;
+
+    // Dimensions of each level, from a single pixel to the full resolution
+    std::vector<int64_t> levelWidth, levelHeight;
+
+    // The level at full resolution and the coarsest one written
+    int baseLevel, topLevel;
+
+    // The tiles waiting for their children
+    std::map<Key, std::unique_ptr<Node>> nodes;
+    std::mutex mutex;
+};
+
+#endif
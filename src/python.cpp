@@ -0,0 +1,426 @@
+/*
+    Fractal Image Generator
+
+    Author: Alberto Boldrini
+
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// The Python module of the engine: mandelbrot.render returns the colors and the smoothed
+// iterations of an image as NumPy arrays (memoryviews when NumPy is missing), which use
+// the memory where the engine has written them, without copies.
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include "mandelbrot.hpp"
+
+#include <cstdlib>
+#include <stdexcept>
+
+
+// A block of memory of the engine, exported with the buffer protocol
+struct ArrayObject
+{
+    PyObject_HEAD
+
+    // The memory, aligned to the cache lines
+    void *data;
+    Py_ssize_t size;
+
+    // Layout of the elements, as in the struct module
+    const char *format;
+    Py_ssize_t itemSize;
+
+    // Dimensions in elements and in bytes
+    int nDimensions;
+    Py_ssize_t shape[3];
+    Py_ssize_t strides[3];
+};
+
+static void arrayDealloc (PyObject *self)
+{
+    // The instances of heap types hold a reference to their type
+    PyTypeObject *type = Py_TYPE (self);
+
+    free (((ArrayObject *) self)->data);
+    type->tp_free (self);
+
+    Py_DECREF (type);
+}
+
+static int arrayGetBuffer (PyObject *self, Py_buffer *view, int flags)
+{
+    ArrayObject *array = (ArrayObject *) self;
+
+    view->obj        = self;
+    view->buf        = array->data;
+    view->len        = array->size;
+    view->readonly   = 0;
+    view->itemsize   = array->itemSize;
+    view->format     = flags & PyBUF_FORMAT ? (char *) array->format : nullptr;
+    view->ndim       = array->nDimensions;
+    view->shape      = flags & PyBUF_ND ? array->shape : nullptr;
+    view->strides    = flags & PyBUF_STRIDES ? array->strides : nullptr;
+    view->suboffsets = nullptr;
+    view->internal   = nullptr;
+
+    Py_INCREF (self);
+    return 0;
+}
+
+static PyType_Slot arraySlots[] = 
+{
+    {Py_tp_dealloc,    (void *) arrayDealloc},
+    {Py_bf_getbuffer,  (void *) arrayGetBuffer},
+    {Py_tp_doc,        (void *) "Memory written by the engine, exported with the buffer protocol"},
+    {0, nullptr}
+};
+
+static PyType_Spec arraySpec = 
+{
+    "mandelbrot.Array", sizeof (ArrayObject), 0, Py_TPFLAGS_DEFAULT, arraySlots
+};
+
+static PyObject *arrayType = nullptr;
+
+// Creates an array with C layout
+static ArrayObject *newArray (const char *format, Py_ssize_t itemSize, int nDimensions, const Py_ssize_t *shape)
+{
+    ArrayObject *array = PyObject_New (ArrayObject, (PyTypeObject *) arrayType);
+
+    if (!array)
+        return nullptr;
+
+    array->format      = format;
+    array->itemSize    = itemSize;
+    array->nDimensions = nDimensions;
+    array->size        = itemSize;
+
+    for (int i = nDimensions - 1; i >= 0; i--)
+    {
+        array->shape[i]   = shape[i];
+        array->strides[i] = array->size;
+        array->size      *= shape[i];
+    }
+
+    array->data = aligned_alloc (64, (array->size + 63) / 64 * 64);
+
+    if (!array->data)
+    {
+        Py_DECREF (array);
+        PyErr_NoMemory ();
+        return nullptr;
+    }
+
+    return array;
+}
+
+// Returns numpy.asarray (array), or a memoryview when NumPy is not installed.
+// The reference to the array is taken.
+static PyObject *exportArray (ArrayObject *array)
+{
+    PyObject *result = nullptr;
+    PyObject *numpy = PyImport_ImportModule ("numpy");
+
+    if (numpy)
+    {
+        result = PyObject_CallMethod (numpy, "asarray", "O", (PyObject *) array);
+        Py_DECREF (numpy);
+    }
+
+    else
+    {
+        PyErr_Clear ();
+        result = PyMemoryView_FromObject ((PyObject *) array);
+    }
+
+    Py_DECREF (array);
+    return result;
+}
+
+// Reads a color from a sequence of three integers
+static bool colorOf (PyObject *object, mandelbrot::Rgb &color)
+{
+    PyObject *sequence = PySequence_Fast (object, "A color must be a sequence (red, green, blue)");
+
+    if (!sequence)
+        return false;
+
+    bool valid = PySequence_Fast_GET_SIZE (sequence) == 3;
+    long rgb[3] = {0, 0, 0};
+
+    for (int i = 0; valid && i < 3; i++)
+    {
+        rgb[i] = PyLong_AsLong (PySequence_Fast_GET_ITEM (sequence, i));
+        valid = !PyErr_Occurred () && rgb[i] >= 0 && rgb[i] <= 255;
+    }
+
+    Py_DECREF (sequence);
+
+    if (!valid)
+    {
+        if (!PyErr_Occurred ())
+            PyErr_SetString (PyExc_ValueError, "A color must be three integers from 0 to 255");
+
+        return false;
+    }
+
+    color = mandelbrot::Rgb {(uint8_t) rgb[0], (uint8_t) rgb[1], (uint8_t) rgb[2]};
+    return true;
+}
+
+// Reads a region from a sequence of four integers
+static bool rectOf (PyObject *object, mandelbrot::Rect &rect)
+{
+    PyObject *sequence = PySequence_Fast (object, "A region must be a sequence (left, top, right, bottom)");
+
+    if (!sequence)
+        return false;
+
+    bool valid = PySequence_Fast_GET_SIZE (sequence) == 4;
+    long long values[4] = {0, 0, 0, 0};
+
+    for (int i = 0; valid && i < 4; i++)
+    {
+        values[i] = PyLong_AsLongLong (PySequence_Fast_GET_ITEM (sequence, i));
+        valid = !PyErr_Occurred ();
+    }
+
+    Py_DECREF (sequence);
+
+    if (!valid)
+    {
+        if (!PyErr_Occurred ())
+            PyErr_SetString (PyExc_ValueError, "A region must be four integers");
+
+        return false;
+    }
+
+    rect = mandelbrot::Rect {values[0], values[1], values[2], values[3]};
+    return true;
+}
+
+// The renderer of the module, created at the first render and never destroyed,
+// since its threads can't be stopped safely while the interpreter ends
+static mandelbrot::Renderer *renderer = nullptr;
+static unsigned rendererThreads = 0;
+
+static PyObject *render (PyObject *, PyObject *args, PyObject *kwargs)
+{
+    static const char *keywords[] = {"width", "height", "left", "top", "right", "bottom", "iterations",
+                                      "stop_norm", "palette", "interior", "tile_size", "focus", "regions", nullptr};
+
+    mandelbrot::RenderRequest request;
+    long long width = request.width, height = request.height, tileSize = request.tileSize;
+    int maxIterations = request.maxIterations;
+    PyObject *palette = Py_None, *interior = Py_None, *regions = Py_None;
+
+    if (!PyArg_ParseTupleAndKeywords (args, kwargs, "|LLddddidOOL(dd)O", (char **) keywords, &width, &height,
+                                      &request.left, &request.top, &request.right, &request.bottom,
+                                      &maxIterations, &request.stopNorm, &palette, &interior, &tileSize,
+                                      &request.focusX, &request.focusY, &regions))
+        return nullptr;
+
+    request.width = width;
+    request.height = height;
+    request.tileSize = tileSize;
+    request.maxIterations = maxIterations;
+
+    if (width <= 0 || height <= 0)
+    {
+        PyErr_SetString (PyExc_ValueError, "The dimensions must be positive");
+        return nullptr;
+    }
+
+    if (palette != Py_None)
+    {
+        PyObject *colors = PySequence_Fast (palette, "The palette must be a sequence of colors");
+
+        if (!colors)
+            return nullptr;
+
+        for (Py_ssize_t i = 0; i < PySequence_Fast_GET_SIZE (colors); i++)
+        {
+            mandelbrot::Rgb color;
+
+            if (!colorOf (PySequence_Fast_GET_ITEM (colors, i), color))
+            {
+                Py_DECREF (colors);
+                return nullptr;
+            }
+
+            request.palette.push_back (color);
+        }
+
+        Py_DECREF (colors);
+    }
+
+    if (interior != Py_None && !colorOf (interior, request.interior))
+        return nullptr;
+
+    if (regions != Py_None)
+    {
+        PyObject *rects = PySequence_Fast (regions, "The regions must be a sequence of rectangles");
+
+        if (!rects)
+            return nullptr;
+
+        for (Py_ssize_t i = 0; i < PySequence_Fast_GET_SIZE (rects); i++)
+        {
+            mandelbrot::Rect rect;
+
+            if (!rectOf (PySequence_Fast_GET_ITEM (rects, i), rect))
+            {
+                Py_DECREF (rects);
+                return nullptr;
+            }
+
+            request.regions.push_back (rect);
+        }
+
+        Py_DECREF (rects);
+    }
+
+    // The engine writes directly in the memory of the arrays
+    Py_ssize_t imageShape[3] = {height, width, 3};
+    Py_ssize_t fieldShape[2] = {height, width};
+
+    ArrayObject *image = newArray ("B", 1, 3, imageShape);
+    ArrayObject *field = image ? newArray ("f", 4, 2, fieldShape) : nullptr;
+
+    if (!field)
+    {
+        Py_XDECREF (image);
+        return nullptr;
+    }
+
+    std::string error;
+
+    // The renderer is created while holding the GIL, so only one thread can create it
+    try
+    {
+        if (!renderer)
+            renderer = new mandelbrot::Renderer (rendererThreads);
+    }
+    catch (const std::exception &e)
+    {
+        Py_DECREF (image);
+        Py_DECREF (field);
+        PyErr_SetString (PyExc_RuntimeError, e.what ());
+        return nullptr;
+    }
+
+    // Other Python threads run during the render
+    Py_BEGIN_ALLOW_THREADS
+
+    try
+    {
+        renderer->render (request, image->data, width * 3, (float *) field->data, width);
+    }
+    catch (const std::exception &e)
+    {
+        error = e.what ();
+    }
+
+    Py_END_ALLOW_THREADS
+
+    if (!error.empty ())
+    {
+        Py_DECREF (image);
+        Py_DECREF (field);
+        PyErr_SetString (PyExc_RuntimeError, error.c_str());
+        return nullptr;
+    }
+
+    PyObject *imageArray = exportArray (image);
+    PyObject *fieldArray = exportArray (field);
+
+    if (!imageArray || !fieldArray)
+    {
+        Py_XDECREF (imageArray);
+        Py_XDECREF (fieldArray);
+        return nullptr;
+    }
+
+    return Py_BuildValue ("(NN)", imageArray, fieldArray);
+}
+
+static PyObject *setThreads (PyObject *, PyObject *args)
+{
+    unsigned threads;
+
+    if (!PyArg_ParseTuple (args, "I", &threads))
+        return nullptr;
+
+    if (renderer)
+    {
+        PyErr_SetString (PyExc_RuntimeError, "The threads must be set before the first render");
+        return nullptr;
+    }
+
+    rendererThreads = threads;
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef methods[] = 
+{
+    {"render", (PyCFunction) (void (*) (void)) render, METH_VARARGS | METH_KEYWORDS,
+     "render(width=2200, height=1250, left=-2.7, top=1.25, right=1.7, bottom=-1.25, iterations=100,\n"
+     "       stop_norm=400, palette=None, interior=(0, 0, 0), tile_size=64, focus=(0.5, 0.5),\n"
+     "       regions=None)\n"
+     "--\n\n"
+     "Renders an image with the threads of the engine, without holding the GIL.\n"
+     "The tiles in the regions (left, top, right, bottom in pixels) are computed first,\n"
+     "then the others from the focus point, given as a fraction of the dimensions.\n"
+     "Returns the colors (height x width x 3 bytes) and the smoothed iterations\n"
+     "(height x width floats, infinity inside the fractal) as NumPy arrays sharing\n"
+     "the memory of the engine, or as memoryviews when NumPy is not installed."},
+
+    {"set_threads", setThreads, METH_VARARGS,
+     "set_threads(n)\n--\n\nSets the number of threads used by the renders, 0 for one per core.\n"
+     "It must be called before the first render."},
+
+    {nullptr, nullptr, 0, nullptr}
+};
+
+static PyModuleDef module = 
+{
+    PyModuleDef_HEAD_INIT, "mandelbrot", "Renders images of the Mandelbrot set", -1, methods
+};
+
+PyMODINIT_FUNC PyInit_mandelbrot (void)
+{
+    arrayType = PyType_FromSpec (&arraySpec);
+
+    if (!arrayType)
+        return nullptr;
+
+    PyObject *m = PyModule_Create (&module);
+
+    if (!m)
+        return nullptr;
+
+    Py_INCREF (arrayType);
+
+    if (PyModule_AddObject (m, "Array", arrayType) < 0)
+    {
+        Py_DECREF (arrayType);
+        Py_DECREF (m);
+        return nullptr;
+    }
+
+    return m;
+}
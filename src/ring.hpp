@@ -0,0 +1,363 @@
+/*
+    Fractal Image Generator
+
+    Author: Alberto Boldrini
+
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef RING_HPP
+#define RING_HPP
+
+#include "fractal.hpp"
+#include <climits>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+
+// This structure publishes the frames of a fractal, and their tiles as soon as they are
+// computed, in a POSIX shared memory object which other processes can map read only.
+// The object holds a header, a ring of events and a ring of frame slots. The frames are
+// computed directly in the slots, frame f in slot f % nSlots, and the events tell which
+// tile or frame is ready, so a viewer reads the pixels in place without copies or encoding.
+// The producer never waits: a slow consumer can see its frames overwritten, which it
+// detects checking the number of frame of the slot after reading the pixels.
+// The consumers sleep on a futex word incremented at each event. The object is left
+// in /dev/shm when the producer ends, so the last frames can still be read, and it is
+// replaced by the next producer with the same name.
+struct SharedRing
+{
+    // Maximum number of frame slots
+    static constexpr uint32_t maxSlots = 64;
+
+    // The kinds of the events
+    static constexpr uint32_t tileReady  = 1;
+    static constexpr uint32_t frameReady = 2;
+
+    // Something which is ready, 64 bytes
+    struct Event
+    {
+        // Number of the event plus one, zero while it is written
+        std::atomic<uint64_t> sequence;
+
+        // tileReady or frameReady
+        uint32_t kind;
+
+        // The slot holding the pixels
+        uint32_t slot;
+
+        // Number of the frame
+        uint64_t frame;
+
+        // The rectangle in the frame, right and bottom excluded
+        int64_t left, top;
+        int64_t right, bottom;
+
+        uint64_t reserved;
+    };
+
+    // The beginning of the shared object
+    struct Header
+    {
+        // Identifies the object, "MRING1"
+        char magic[8];
+
+        // Dimensions and layout of the frames: values of PixelFormat
+        int64_t width, height;
+        uint32_t format;
+        uint32_t nSlots;
+        uint64_t stride;
+
+        // Offsets from the beginning of the object
+        uint64_t eventsOffset;
+        uint64_t nEvents;
+        uint64_t slotsOffset;
+        uint64_t slotBytes;
+
+        // Number of events published
+        std::atomic<uint64_t> published;
+
+        // The futex word where the consumers sleep, incremented after each event
+        std::atomic<uint32_t> futex;
+
+        // Set when the producer ends
+        std::atomic<uint32_t> closed;
+
+        // The frame written in each slot, incremented by one
+        std::atomic<uint64_t> slotFrames[maxSlots];
+    };
+
+    static_assert (sizeof (Event) == 64, "Events must fill a cache line");
+    static_assert (std::atomic<uint64_t>::is_always_lock_free && std::atomic<uint32_t>::is_always_lock_free,
+                   "The shared atomics must be lock free");
+
+    // Creates the shared object, replacing an old one with the same name
+    SharedRing (const std::string &name, int64_t width, int64_t height, PixelFormat format = PixelFormat::RGB8,
+                uint32_t nSlots = 4, uint64_t nEvents = 4096)
+        : name (name)
+        , owner (true)
+    {
+        nSlots  = std::min (std::max (nSlots, 1u), maxSlots);
+        nEvents = std::max (nEvents, uint64_t (1));
+
+        uint64_t stride = (size_t (width) * bytesPerPixel (format) + Buffer::alignment - 1) / Buffer::alignment * Buffer::alignment;
+        uint64_t page = sysconf (_SC_PAGESIZE);
+
+        // The slots start on pages
+        uint64_t eventsOffset = (sizeof (Header) + 63) / 64 * 64;
+        uint64_t slotsOffset  = (eventsOffset + nEvents * sizeof (Event) + page - 1) / page * page;
+        uint64_t slotBytes    = (stride * height + page - 1) / page * page;
+
+        size = slotsOffset + nSlots * slotBytes;
+
+        shm_unlink (name.c_str());
+        int fd = shm_open (name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+
+        if (fd < 0)
+            throw std::runtime_error ("Cannot create the shared memory " + name);
+
+        if (ftruncate (fd, size) != 0)
+        {
+            close (fd);
+            shm_unlink (name.c_str());
+            throw std::runtime_error ("Cannot allocate the shared memory " + name);
+        }
+
+        map (fd, PROT_READ | PROT_WRITE);
+
+        // The object is filled with zeros, the magic is written last
+        header->width        = width;
+        header->height       = height;
+        header->format       = uint32_t (format);
+        header->nSlots       = nSlots;
+        header->stride       = stride;
+        header->eventsOffset = eventsOffset;
+        header->nEvents      = nEvents;
+        header->slotsOffset  = slotsOffset;
+        header->slotBytes    = slotBytes;
+
+        std::atomic_thread_fence (std::memory_order_release);
+        memcpy (header->magic, "MRING1", 7);
+    }
+
+    // Maps an object created by another process, read only
+    SharedRing (const std::string &name)
+        : name (name)
+        , owner (false)
+    {
+        int fd = shm_open (name.c_str(), O_RDONLY, 0);
+
+        if (fd < 0)
+            throw std::runtime_error ("Cannot open the shared memory " + name);
+
+        struct stat info;
+        fstat (fd, &info);
+        size = info.st_size;
+
+        if (size < sizeof (Header))
+        {
+            close (fd);
+            throw std::runtime_error (name + " is not a frame ring");
+        }
+
+        map (fd, PROT_READ);
+
+        if (memcmp (header->magic, "MRING1", 7) != 0 || header->slotsOffset + header->nSlots * header->slotBytes > size)
+        {
+            munmap (header, size);
+            throw std::runtime_error (name + " is not a frame ring");
+        }
+    }
+
+    SharedRing (const SharedRing &) = delete;
+    SharedRing &operator= (const SharedRing &) = delete;
+
+    // The producer marks the end and wakes the consumers
+    ~SharedRing ()
+    {
+        if (owner)
+        {
+            header->closed = 1;
+            header->futex++;
+            wake ();
+        }
+
+        munmap (header, size);
+    }
+
+    // Returns the event with the given number
+    Event &event (uint64_t n) const
+    {
+        return ((Event *) ((unsigned char *) header + header->eventsOffset))[n % header->nEvents];
+    }
+
+    // Returns the pixels of a slot
+    unsigned char *slot (uint32_t s) const
+    {
+        return (unsigned char *) header + header->slotsOffset + s * header->slotBytes;
+    }
+
+    // Publishes an event and wakes the consumers
+    void publish (uint32_t kind, uint64_t frame, const Tile &tile)
+    {
+        std::lock_guard<std::mutex> lock (mutex);
+
+        uint64_t n = header->published.load (std::memory_order_relaxed);
+        Event &e = event (n);
+
+        // The consumers see the event as invalid while it changes
+        e.sequence.store (0, std::memory_order_relaxed);
+        std::atomic_thread_fence (std::memory_order_release);
+
+        e.kind   = kind;
+        e.slot   = frame % header->nSlots;
+        e.frame  = frame;
+        e.left   = tile.left;
+        e.top    = tile.top;
+        e.right  = tile.right;
+        e.bottom = tile.bottom;
+
+        e.sequence.store (n + 1, std::memory_order_release);
+        header->published.store (n + 1, std::memory_order_release);
+        header->futex.fetch_add (1, std::memory_order_release);
+
+        wake ();
+    }
+
+    // Computes a frame of a fractal in its slot, publishing each tile and then the frame
+    void render (Mandlebrot &view, uint64_t frame, const TileOrder &order = TileOrder::centerOut (),
+                 ThreadPool &pool = ThreadPool::global ())
+    {
+        if (view.width != header->width || view.height != header->height)
+            throw std::runtime_error ("The frame doesn't have the dimensions of the ring");
+
+        uint32_t s = frame % header->nSlots;
+
+        // The consumers of the old frame in this slot can see it is gone
+        header->slotFrames[s].store (frame + 1, std::memory_order_release);
+
+        view.image = Image (slot (s), header->stride, header->width, header->height, PixelFormat (header->format));
+
+        std::mutex mutex;
+        std::condition_variable finished;
+        bool ended = false;
+        std::exception_ptr error;
+
+        view.computeAsync (order, pool, [this, frame] (const Tile &tile)
+        {
+            publish (tileReady, frame, tile);
+        },
+        [&] (std::exception_ptr e)
+        {
+            std::lock_guard<std::mutex> lock (mutex);
+
+            error = e;
+            ended = true;
+            finished.notify_one ();
+        });
+
+        std::unique_lock<std::mutex> lock (mutex);
+        finished.wait (lock, [&] { return ended; });
+
+        view.image = Image ();
+
+        if (error)
+            std::rethrow_exception (error);
+
+        publish (frameReady, frame, Tile {0, 0, header->width, header->height});
+    }
+
+    // Waits for events after the first n, for at most the given milliseconds.
+    // Returns the number of events published.
+    uint64_t wait (uint64_t n, int milliseconds) const
+    {
+        uint32_t word = header->futex.load (std::memory_order_acquire);
+        uint64_t published = header->published.load (std::memory_order_acquire);
+
+        if (published > n || header->closed)
+            return published;
+
+        // Sleeps only if nothing changed after reading the word
+        struct timespec timeout = {milliseconds / 1000, (milliseconds % 1000) * 1000000L};
+        syscall (SYS_futex, (uint32_t *) &header->futex, FUTEX_WAIT, word, &timeout, nullptr, 0);
+
+        return header->published.load (std::memory_order_acquire);
+    }
+
+    // Copies an event, returns false when it was already overwritten
+    bool read (uint64_t n, Event &out) const
+    {
+        Event &e = event (n);
+
+        if (e.sequence.load (std::memory_order_acquire) != n + 1)
+            return false;
+
+        out.kind   = e.kind;
+        out.slot   = e.slot;
+        out.frame  = e.frame;
+        out.left   = e.left;
+        out.top    = e.top;
+        out.right  = e.right;
+        out.bottom = e.bottom;
+
+        std::atomic_thread_fence (std::memory_order_acquire);
+        return e.sequence.load (std::memory_order_relaxed) == n + 1;
+    }
+
+    // True when the pixels of a frame are still in its slot
+    bool valid (uint64_t frame) const
+    {
+        return header->slotFrames[frame % header->nSlots].load (std::memory_order_acquire) == frame + 1;
+    }
+
+    // Wakes the processes waiting on the futex, which is shared between processes
+    void wake ()
+    {
+        syscall (SYS_futex, (uint32_t *) &header->futex, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+    }
+
+    // Maps the object and closes the descriptor
+    void map (int fd, int protection)
+    {
+        void *p = mmap (nullptr, size, protection, MAP_SHARED, fd, 0);
+        close (fd);
+
+        if (p == MAP_FAILED)
+        {
+            if (owner)
+                shm_unlink (name.c_str());
+
+            throw std::runtime_error ("Cannot map the shared memory " + name);
+        }
+
+        header = (Header *) p;
+    }
+
+    // Name of the shared object
+    std::string name;
+
+    // True for the process which created the object
+    bool owner;
+
+    // The mapping
+    Header *header;
+    uint64_t size;
+
+    // Serializes the events of the threads of the producer
+    std::mutex mutex;
+};
+
+#endif
@@ -0,0 +1,385 @@
+/*
+    Fractal Image Generator
+
+    Author: Alberto Boldrini
+
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SERVER_HPP
+#define SERVER_HPP
+
+#include "fractal.hpp"
+#include <future>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+
+// This structure serves the tiles of a fractal over HTTP, as a map of z/x/y tiles:
+// the tile 0/0/0 covers the whole fractal and each zoom level halves the side of the tiles.
+// Tiles are computed by the thread pool, the most recent requests first, and kept
+// in a memory cache of limited size. Concurrent requests of the same tile wait
+// for a single computation. The metrics are served in the Prometheus format.
+struct TileServer
+{
+    // An encoded tile, shared by the cache and the requests
+    using TileData = std::shared_ptr<const std::string>;
+
+    // The fractal gives the parameters and the colors of all the tiles
+    TileServer (const Mandlebrot &fractal, int port = 8080, uint64_t maxBytes = uint64_t (256) << 20,
+                int64_t tileSize = 256, ThreadPool &pool = ThreadPool::global ())
+        : fractal (fractal)
+        , port (port)
+        , maxBytes (maxBytes)
+        , tileSize (tileSize)
+        , pool (pool)
+        , totalBytes (0)
+    {
+        // The area of the tile 0/0/0, a square around the fractal
+        double side = std::max (fractal.right - fractal.left, fractal.top - fractal.bottom);
+
+        worldLeft = 0.5 * (fractal.left + fractal.right) - 0.5 * side;
+        worldTop  = 0.5 * (fractal.top + fractal.bottom) + 0.5 * side;
+        worldSide = side;
+    }
+
+    // Computes and encodes a tile
+    std::string render (int z, int64_t x, int64_t y)
+    {
+        double side = worldSide / std::ldexp (1.0, z);
+        double left = worldLeft + x * side;
+        double top  = worldTop  - y * side;
+
+        Mandlebrot view = fractal.view (tileSize, tileSize, left, top, left + side, top - side);
+
+        Image tile (tileSize, tileSize);
+        view.computeTile (Tile {0, 0, tileSize, tileSize}, tile, 0, 0);
+
+        // Encodes the PNG file in memory
+        char *data = nullptr;
+        size_t size = 0;
+
+        PngWriter writer (open_memstream (&data, &size), tile.width, tile.height, tile.format, 6);
+        writer.writeRows (tile.data, tile.stride, tile.height);
+        writer.finish ();
+
+        std::string png (data, size);
+        free (data);
+
+        return png;
+    }
+
+    // Returns a tile, from the memory cache, from a computation already running or from a new one
+    TileData get (int z, int64_t x, int64_t y)
+    {
+        std::string key = std::to_string (z) + "/" + std::to_string (x) + "/" + std::to_string (y);
+        std::shared_future<TileData> future;
+        {
+            std::lock_guard<std::mutex> lock (mutex);
+
+            // The tile is in memory
+            auto found = index.find (key);
+
+            if (found != index.end ())
+            {
+                hits++;
+                lru.splice (lru.end(), lru, found->second);
+                return found->second->second;
+            }
+
+            misses++;
+
+            // Another request is computing the same tile
+            auto running = inFlight.find (key);
+
+            if (running != inFlight.end ())
+            {
+                coalesced++;
+                future = running->second;
+            }
+
+            else
+            {
+                std::shared_ptr<std::promise<TileData>> promise (new std::promise<TileData>);
+                future = promise->get_future ().share ();
+                inFlight[key] = future;
+
+                // The newest requests are computed first
+                pool.submit (pool.newRequest (), 1.0, [this, promise, key, z, x, y]
+                {
+                    auto start = std::chrono::steady_clock::now ();
+                    TileData tile;
+
+                    try
+                    {
+                        tile.reset (new std::string (render (z, x, y)));
+                    }
+                    catch (...)
+                    {
+                        std::lock_guard<std::mutex> lock (mutex);
+                        inFlight.erase (key);
+                        promise->set_exception (std::current_exception ());
+                        return;
+                    }
+
+                    std::lock_guard<std::mutex> lock (mutex);
+
+                    rendered++;
+                    renderSeconds += std::chrono::duration <double> (std::chrono::steady_clock::now () - start).count();
+
+                    // Moves the tile to the cache
+                    inFlight.erase (key);
+                    insert (key, tile);
+
+                    promise->set_value (tile);
+                });
+            }
+        }
+
+        return future.get ();
+    }
+
+    // Adds a tile to the memory cache, the mutex must be locked
+    void insert (const std::string &key, const TileData &tile)
+    {
+        index[key] = lru.insert (lru.end(), {key, tile});
+        totalBytes += tile->size();
+
+        // Removes the least recently used tiles
+        while (totalBytes > maxBytes && !lru.empty ())
+        {
+            totalBytes -= lru.front().second->size();
+            index.erase (lru.front().first);
+            lru.pop_front ();
+        }
+    }
+
+    // The metrics in the Prometheus text format
+    std::string metrics ()
+    {
+        std::lock_guard<std::mutex> lock (mutex);
+        std::ostringstream out;
+
+        auto metric = [&] (const char *name, const char *type, const char *help, double value)
+        {
+            out << "# HELP mandelbrot_" << name << " " << help << "\n"
+                << "# TYPE mandelbrot_" << name << " " << type << "\n"
+                << "mandelbrot_" << name << " " << value << "\n";
+        };
+
+        metric ("requests_total",              "counter", "HTTP requests received.", requests);
+        metric ("tiles_rendered_total",        "counter", "Tiles computed and encoded.", rendered);
+        metric ("tile_render_seconds_total",   "counter", "Time spent computing and encoding tiles.", renderSeconds);
+        metric ("memory_cache_hits_total",     "counter", "Tiles served from the memory cache.", hits);
+        metric ("memory_cache_misses_total",   "counter", "Tiles not found in the memory cache.", misses);
+        metric ("coalesced_requests_total",    "counter", "Requests which waited for a tile already being computed.", coalesced);
+        metric ("memory_cache_hit_ratio",      "gauge",   "Fraction of the tiles served from the memory cache.", hits + misses ? double (hits) / (hits + misses) : 0);
+        metric ("memory_cache_bytes",          "gauge",   "Size of the tiles in the memory cache.", totalBytes);
+        metric ("memory_cache_tiles",          "gauge",   "Tiles in the memory cache.", lru.size());
+        metric ("tiles_in_flight",             "gauge",   "Tiles being computed.", inFlight.size());
+        metric ("queue_depth",                 "gauge",   "Tasks waiting for a thread of the pool.", pool.pending());
+        metric ("open_connections",            "gauge",   "Connections being handled.", connections);
+
+        if (fractal.cache)
+        {
+            metric ("disk_cache_hits_total",   "counter", "Lookups found in the disk cache.", fractal.cache->hits);
+            metric ("disk_cache_misses_total", "counter", "Lookups not found in the disk cache.", fractal.cache->misses);
+        }
+
+        return out.str();
+    }
+
+    // Sends a complete HTTP response
+    static void respond (int fd, int status, const char *reason, const char *type, const std::string &body)
+    {
+        std::ostringstream header;
+
+        header << "HTTP/1.1 " << status << " " << reason << "\r\n"
+               << "Content-Type: " << type << "\r\n"
+               << "Content-Length: " << body.size() << "\r\n"
+               << "Connection: close\r\n\r\n";
+
+        std::string response = header.str() + body;
+
+        for (size_t sent = 0; sent < response.size(); )
+        {
+            ssize_t n = send (fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+
+            if (n <= 0)
+                break;
+
+            sent += n;
+        }
+    }
+
+    // Reads a request and answers it
+    void handle (int fd)
+    {
+        // Reads the header of the request
+        std::string request;
+        char buffer[4096];
+
+        while (request.find ("\r\n\r\n") == std::string::npos && request.size() < 16384)
+        {
+            ssize_t n = recv (fd, buffer, sizeof (buffer), 0);
+
+            if (n <= 0)
+                break;
+
+            request.append (buffer, n);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock (mutex);
+            requests++;
+        }
+
+        // The method and the path
+        std::istringstream line (request.substr (0, request.find ("\r\n")));
+        std::string method, path;
+        line >> method >> path;
+
+        int z;
+        long long x, y;
+        char end;
+
+        if (method != "GET")
+            respond (fd, 405, "Method Not Allowed", "text/plain", "Only GET is supported\n");
+
+        else if (path == "/metrics")
+            respond (fd, 200, "OK", "text/plain; version=0.0.4", metrics ());
+
+        else if (sscanf (path.c_str(), "/%d/%lld/%lld.pn%c", &z, &x, &y, &end) == 4 && end == 'g')
+        {
+            // Doubles can't zoom further
+            if (z < 0 || z > 48 || x < 0 || y < 0 || x >= (1ll << z) || y >= (1ll << z))
+                respond (fd, 404, "Not Found", "text/plain", "No such tile\n");
+
+            else
+            {
+                try
+                {
+                    respond (fd, 200, "OK", "image/png", *get (z, x, y));
+                }
+                catch (const std::exception &error)
+                {
+                    respond (fd, 500, "Internal Server Error", "text/plain", std::string (error.what()) + "\n");
+                }
+            }
+        }
+
+        else
+            respond (fd, 404, "Not Found", "text/plain", "Tiles are at /z/x/y.png, metrics at /metrics\n");
+
+        close (fd);
+    }
+
+    // Accepts connections on localhost forever, each one is handled by its own thread.
+    // The handlers wait for the pool, so they have their own threads, at most maxConnections
+    void run ()
+    {
+        int server = socket (AF_INET, SOCK_STREAM, 0);
+
+        int yes = 1;
+        setsockopt (server, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof (yes));
+
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_port = htons (port);
+        address.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+        if (bind (server, (sockaddr *) &address, sizeof (address)) != 0 || listen (server, 128) != 0)
+        {
+            close (server);
+            throw std::runtime_error ("Cannot listen on port " + std::to_string (port));
+        }
+
+        if (fractal.log)
+            *fractal.log << "Serving tiles on http://127.0.0.1:" << port << "/z/x/y.png" << std::endl;
+
+        while (true)
+        {
+            int fd = accept (server, nullptr, nullptr);
+
+            if (fd < 0)
+                continue;
+
+            // A client which stops sending or reading doesn't keep its thread forever
+            timeval timeout = { receiveTimeout, 0 };
+            setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof (timeout));
+            setsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof (timeout));
+
+            // The next connections wait in the backlog of the socket
+            {
+                std::unique_lock<std::mutex> lock (mutex);
+                released.wait (lock, [this] { return connections < maxConnections; });
+                connections++;
+            }
+
+            std::thread ([this, fd]
+            {
+                handle (fd);
+
+                std::lock_guard<std::mutex> lock (mutex);
+                connections--;
+                released.notify_one ();
+            }).detach ();
+        }
+    }
+
+    // The parameters of the tiles
+    const Mandlebrot &fractal;
+
+    // The area of the complex plane of the tile 0/0/0
+    double worldLeft, worldTop, worldSide;
+
+    // Port on localhost
+    int port;
+
+    // Size limit of the memory cache and side of the tiles
+    uint64_t maxBytes;
+    int64_t tileSize;
+
+    // The threads which compute the tiles
+    ThreadPool &pool;
+
+    // Limits of the connections: handler threads and seconds without data
+    int maxConnections = 64;
+    int receiveTimeout = 10;
+    int connections = 0;
+    std::condition_variable released;
+
+    // The tiles in memory, from the least recently used, and their position in the list
+    std::list<std::pair<std::string, TileData>> lru;
+    std::map<std::string, std::list<std::pair<std::string, TileData>>::iterator> index;
+    uint64_t totalBytes;
+
+    // The tiles being computed
+    std::map<std::string, std::shared_future<TileData>> inFlight;
+
+    // Statistics
+    uint64_t requests = 0;
+    uint64_t rendered = 0;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t coalesced = 0;
+    double renderSeconds = 0;
+
+    std::mutex mutex;
+};
+
+#endif
@@ -0,0 +1,302 @@
+/*
+    Fractal Image Generator
+
+    Author: Alberto Boldrini
+
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef THREADPOOL_HPP
+#define THREADPOOL_HPP
+
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <queue>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <string>
+#include "trace.hpp"
+#include "perf.hpp"
+
+
+// This structure represents a set of threads which stay alive
+// and execute tasks submitted by one or more renders.
+// The tasks with the highest priority are always executed first,
+// so a new render can overtake the less important parts of an older one.
+struct ThreadPool
+{
+    // A piece of work waiting for a thread
+    struct Task
+    {
+        // Tasks with higher priority are executed first
+        double priority;
+
+        // Number of the request that submitted the task,
+        // with the same priority newer requests win
+        unsigned long request;
+
+        // The work to do
+        std::function<void()> function;
+
+        // Ordering used by the priority queue
+        bool operator< (const Task &other) const
+        {
+            if (priority != other.priority)
+                return priority < other.priority;
+
+            return request < other.request;
+        }
+    };
+
+    // Starts the threads of the pool
+    ThreadPool (unsigned nThreads = std::thread::hardware_concurrency ())
+        : stopping (false)
+        , nRequests (0)
+    {
+        // At least one thread is always needed
+        nThreads = std::max (nThreads, 1u);
+
+        // The threads are named by pool in the traces
+        static std::atomic<unsigned> nPools {0};
+        unsigned pool = ++nPools;
+
+        for (unsigned i = 0; i < nThreads; ++i)
+            threads.emplace_back ([this, pool, i] 
+            { 
+                Trace::nameThread ("pool " + std::to_string (pool) + " worker " + std::to_string (i));
+                work (); 
+            });
+    }
+
+    // Waits the end of the running tasks and stops the threads
+    ~ThreadPool ()
+    {
+        {
+            std::lock_guard<std::mutex> lock (mutex);
+            stopping = true;
+        }
+
+        condition.notify_all ();
+
+        for (std::thread& th : threads)
+            th.join();
+    }
+
+    // The pool shared by all the renders of the program
+    static ThreadPool &global ()
+    {
+        static ThreadPool pool;
+        return pool;
+    }
+
+    // Returns a new request number, requests created later
+    // win over the older ones when priorities are the same
+    unsigned long newRequest ()
+    {
+        std::lock_guard<std::mutex> lock (mutex);
+        return ++nRequests;
+    }
+
+    // Adds a task to the queue
+    void submit (unsigned long request, double priority, std::function<void()> function)
+    {
+        {
+            std::lock_guard<std::mutex> lock (mutex);
+            tasks.push (Task {priority, request, std::move (function)});
+        }
+
+        condition.notify_one ();
+    }
+
+    // Number of threads of the pool
+    unsigned size () const
+    {
+        return threads.size ();
+    }
+
+    // Number of tasks waiting for a thread
+    size_t pending ()
+    {
+        std::lock_guard<std::mutex> lock (mutex);
+        return tasks.size ();
+    }
+
+    // The loop executed by each thread
+    void work ()
+    {
+        // The request of the previous task, for the traces
+        unsigned long lastRequest = 0;
+
+        while (true)
+        {
+            std::unique_lock<std::mutex> lock (mutex);
+
+            // Waits for something to do, the time without tasks is traced
+            if (!stopping && tasks.empty() && Trace::on ())
+            {
+                Trace::Span idle ("idle");
+                condition.wait (lock, [this] { return stopping || !tasks.empty(); });
+            }
+
+            condition.wait (lock, [this] { return stopping || !tasks.empty(); });
+
+            if (tasks.empty())
+                return;
+
+            // Takes the most important task
+            unsigned long request = tasks.top().request;
+            std::function<void()> function = std::move (const_cast<Task&> (tasks.top()).function);
+            tasks.pop ();
+
+            lock.unlock ();
+
+            // Moving to the tasks of another request is marked
+            if (request != lastRequest && Trace::on ())
+            {
+                uint64_t now = Trace::now ();
+                Trace::global ().record ("switch request", now, now, "from,to", lastRequest, request);
+            }
+
+            lastRequest = request;
+
+            // The hardware counters are per thread
+            PerfCounters::attach ();
+
+            // The tasks report their errors to who waits them, see TaskGroup,
+            // a stray exception must not end the program
+            try
+            {
+                function ();
+            }
+            catch (...)
+            {
+            }
+        }
+    }
+
+    // Synchronization of the queue
+    std::mutex mutex;
+    std::condition_variable condition;
+
+    // Tasks waiting for a thread
+    std::priority_queue<Task> tasks;
+
+    // The threads of the pool
+    std::vector<std::thread> threads;
+
+    // True when the pool is being destroyed
+    bool stopping;
+
+    // Number of requests created
+    unsigned long nRequests;
+};
+
+// This structure submits tasks of the same request to a pool and lets the thread which
+// submitted them wait their results. The first exception thrown by a task is rethrown
+// to the waiting thread, after the end of all the tasks, as they usually use its variables.
+// The tasks publish their results under the mutex of the group, the waiting thread
+// is woken when each task ends.
+struct TaskGroup
+{
+    TaskGroup (ThreadPool &pool)
+        : pool (pool)
+        , request (pool.newRequest ())
+        , pending (0)
+    {
+    }
+
+    // Never leaves tasks running on destroyed variables
+    ~TaskGroup ()
+    {
+        std::unique_lock<std::mutex> lock (mutex);
+        condition.wait (lock, [this] { return pending == 0; });
+    }
+
+    TaskGroup (const TaskGroup &) = delete;
+    TaskGroup &operator= (const TaskGroup &) = delete;
+
+    void submit (double priority, std::function<void()> function)
+    {
+        {
+            std::lock_guard<std::mutex> lock (mutex);
+            pending++;
+        }
+
+        pool.submit (request, priority, [this, function]
+        {
+            std::exception_ptr failure;
+
+            try
+            {
+                function ();
+            }
+            catch (...)
+            {
+                failure = std::current_exception ();
+            }
+
+            std::lock_guard<std::mutex> lock (mutex);
+
+            if (failure && !error)
+                error = failure;
+
+            pending--;
+            condition.notify_all ();
+        });
+    }
+
+    // Waits until a condition on the results is true, checked under the mutex,
+    // or throws the error of a task
+    template <class Condition>
+    void waitUntil (Condition done)
+    {
+        std::unique_lock<std::mutex> lock (mutex);
+        condition.wait (lock, [&] { return error || done (); });
+
+        if (error)
+        {
+            condition.wait (lock, [this] { return pending == 0; });
+            std::rethrow_exception (error);
+        }
+    }
+
+    // Waits the end of all the tasks, throws the first error
+    void wait ()
+    {
+        std::unique_lock<std::mutex> lock (mutex);
+        condition.wait (lock, [this] { return pending == 0; });
+
+        if (error)
+            std::rethrow_exception (error);
+    }
+
+    ThreadPool &pool;
+
+    // All the tasks belong to the same request
+    unsigned long request;
+
+    // Synchronization of the results and of the end of the tasks
+    std::mutex mutex;
+    std::condition_variable condition;
+
+    // Tasks not yet ended and the first error
+    size_t pending;
+    std::exception_ptr error;
+};
+
+#endif
@@ -0,0 +1,238 @@
+/*
+    Fractal Image Generator
+
+    Author: Alberto Boldrini
+
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+
+// This structure records, when enabled, what each thread is doing: the spans of time
+// of the tiles, of the waits and of the encoding are kept in a ring for each thread,
+// without locks, and written at the end in the Chrome trace format, which can be
+// opened with Perfetto or chrome://tracing
+struct Trace
+{
+    // Something done by a thread, an instant when it ends where it starts
+    struct Event
+    {
+        // Static strings, the names of the arguments separated by commas
+        const char *name;
+        const char *argNames;
+
+        // Nanoseconds of the steady clock
+        uint64_t start;
+        uint64_t end;
+
+        int64_t args[4];
+    };
+
+    // The last events of a thread
+    struct Ring
+    {
+        std::string thread;
+        std::vector<Event> events;
+
+        // Number of events recorded, the older ones are overwritten
+        std::atomic<uint64_t> recorded {0};
+    };
+
+    // Number of events kept for each thread
+    static const size_t capacity = 1 << 16;
+
+    // The trace of the program
+    static Trace &global ()
+    {
+        static Trace trace;
+        return trace;
+    }
+
+    // Writes the trace when the program ends
+    ~Trace ()
+    {
+        if (!output.empty ())
+            save (output);
+    }
+
+    // Starts recording, the trace is written to the file when the program ends
+    void start (const std::string &filename = std::string ())
+    {
+        output = filename;
+        origin = now ();
+        enabled = true;
+    }
+
+    // True when the events are recorded, checked before measuring anything
+    static bool on ()
+    {
+        return global ().enabled.load (std::memory_order_relaxed);
+    }
+
+    static uint64_t now ()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds> (std::chrono::steady_clock::now ().time_since_epoch ()).count();
+    }
+
+    // Names the calling thread in the trace
+    static void nameThread (const std::string &name)
+    {
+        threadName () = name;
+    }
+
+    // Adds an event of the calling thread
+    void record (const char *name, uint64_t start, uint64_t end, const char *argNames = "", 
+                 int64_t a = 0, int64_t b = 0, int64_t c = 0, int64_t d = 0)
+    {
+        Ring &ring = threadRing ();
+        uint64_t n = ring.recorded.load (std::memory_order_relaxed);
+
+        ring.events[n % capacity] = Event {name, argNames, start, end, {a, b, c, d}};
+        ring.recorded.store (n + 1, std::memory_order_release);
+    }
+
+    // Records the time between its construction and its destruction
+    struct Span
+    {
+        Span (const char *name, const char *argNames = "", int64_t a = 0, int64_t b = 0, int64_t c = 0, int64_t d = 0)
+            : name (on () ? name : nullptr)
+            , argNames (argNames)
+            , args {a, b, c, d}
+            , start (this->name ? now () : 0)
+        {
+        }
+
+        ~Span ()
+        {
+            if (name)
+                global ().record (name, start, now (), argNames, args[0], args[1], args[2], args[3]);
+        }
+
+        const char *name;
+        const char *argNames;
+        int64_t args[4];
+        uint64_t start;
+    };
+
+    // Writes the events of all the threads as JSON
+    void write (std::ostream &out)
+    {
+        std::lock_guard<std::mutex> lock (mutex);
+        char line[512];
+
+        out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+
+        for (size_t t = 0; t < rings.size(); t++)
+        {
+            Ring &ring = *rings[t];
+            uint64_t recorded = ring.recorded.load (std::memory_order_acquire);
+
+            snprintf (line, sizeof (line), "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %zu, \"args\": {\"name\": \"%s\"}}", 
+                      t + 1, ring.thread.c_str());
+            out << (t ? ",\n" : "") << line;
+
+            for (uint64_t n = recorded > capacity ? recorded - capacity : 0; n < recorded; n++)
+            {
+                const Event &e = ring.events[n % capacity];
+
+                // Times in microseconds from the start
+                double ts = (int64_t (e.start) - int64_t (origin)) * 1e-3;
+
+                if (e.end > e.start)
+                    snprintf (line, sizeof (line), "{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %zu, \"ts\": %.3f, \"dur\": %.3f", 
+                              e.name, t + 1, ts, (e.end - e.start) * 1e-3);
+                else
+                    snprintf (line, sizeof (line), "{\"name\": \"%s\", \"ph\": \"i\", \"s\": \"t\", \"pid\": 1, \"tid\": %zu, \"ts\": %.3f", 
+                              e.name, t + 1, ts);
+
+                out << ",\n" << line << ", \"args\": {";
+
+                // The arguments are named by the list
+                std::string names = e.argNames;
+
+                for (int a = 0; a < 4 && !names.empty (); a++)
+                {
+                    size_t comma = names.find (',');
+
+                    out << (a ? ", \"" : "\"") << names.substr (0, comma) << "\": " << e.args[a];
+                    names = comma == std::string::npos ? std::string () : names.substr (comma + 1);
+                }
+
+                out << "}}";
+            }
+        }
+
+        out << "\n]}\n";
+    }
+
+    void save (const std::string &filename)
+    {
+        std::ofstream file (filename);
+        write (file);
+    }
+
+    // The name given to the calling thread
+    static std::string &threadName ()
+    {
+        static thread_local std::string name;
+        return name;
+    }
+
+    // The ring of the calling thread, created with its first event
+    Ring &threadRing ()
+    {
+        static thread_local Ring *ring = nullptr;
+
+        if (!ring)
+        {
+            std::unique_ptr<Ring> created (new Ring);
+
+            created->events.resize (capacity);
+
+            std::lock_guard<std::mutex> lock (mutex);
+
+            created->thread = threadName ().empty () ? "thread " + std::to_string (rings.size () + 1) : threadName ();
+            ring = created.get ();
+            rings.push_back (std::move (created));
+        }
+
+        return *ring;
+    }
+
+    std::atomic<bool> enabled {false};
+
+    // Where the trace is written at the end, empty for nowhere
+    std::string output;
+
+    // When the recording started
+    uint64_t origin = 0;
+
+    // The rings of the threads, which are kept after their end
+    std::mutex mutex;
+    std::vector<std::unique_ptr<Ring>> rings;
+};
+
+#endif
@@ -0,0 +1,356 @@
+/*
+    Fractal Image Generator
+
+    Author: Alberto Boldrini
+
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef VERIFY_HPP
+#define VERIFY_HPP
+
+#include "field.hpp"
+#include "pyramid.hpp"
+
+
+// This structure checks that the faster ways of computing an image give the pixels
+// of the reference: the scalar loop over computeSmooth and colorOf, on one thread.
+// Each way is compared on the smoothed iterations, when it produces them, and on
+// the colors, and fails when it differs more than its tolerance. The tiles are also
+// computed with pools of different sizes, which must give exactly the same image.
+// The reference images can be kept in a directory of golden files, to detect the
+// changes of the reference itself between two versions.
+struct Verifier
+{
+    // What a way of computing produces: the smoothed iterations (infinity inside
+    // the fractal), empty when not available, and the colors
+    struct Rendering
+    {
+        std::vector<float> field;
+        Image image;
+    };
+
+    // A way of computing an image and how far it may be from the reference
+    struct Variant
+    {
+        std::string name;
+
+        // Relative error of the smoothed iterations and difference of a color channel
+        double fieldTolerance;
+        int colorTolerance;
+
+        std::function<Rendering (Mandlebrot &fractal)> render;
+    };
+
+    // The differences between a rendering and the reference
+    struct Comparison
+    {
+        std::string variant;
+
+        // Errors of the smoothed iterations outside the fractal, when compared
+        bool hasField = false;
+        double maxError = 0;
+        double meanError = 0;
+
+        // Pixels inside the fractal for one and outside for the other
+        int64_t interiorMismatches = 0;
+
+        // Pixels of another color and largest difference of a channel
+        int64_t differingPixels = 0;
+        int maxChannelError = 0;
+
+        bool passed = true;
+    };
+
+    // The files are written in a temporary directory
+    Verifier (std::vector<unsigned> threadCounts)
+        : threadCounts (threadCounts)
+        , directory (std::filesystem::temp_directory_path () / ("mandelbrot-verify-" + std::to_string (getpid ())))
+    {
+        std::filesystem::create_directories (directory);
+    }
+
+    ~Verifier ()
+    {
+        std::error_code error;
+        std::filesystem::remove_all (directory, error);
+    }
+
+    // Computes the image with the reference path
+    static Rendering reference (Mandlebrot &fractal)
+    {
+        Rendering r {std::vector<float> (fractal.width * fractal.height), Image (fractal.width, fractal.height)};
+
+        for (int64_t y = 0; y < fractal.height; y++)
+            for (int64_t x = 0; x < fractal.width; x++)
+            {
+                double fN = fractal.computeSmooth (x, y);
+
+                r.field[y * fractal.width + x] = fN;
+                r.image.setPixel (x, y, fractal.colorOf (fN));
+            }
+
+        return r;
+    }
+
+    // A fractal with the same view and parameters, without image
+    static Mandlebrot copyOf (const Mandlebrot &fractal)
+    {
+        return fractal.view (fractal.width, fractal.height, fractal.left, fractal.top, fractal.right, fractal.bottom);
+    }
+
+    // Computes the image in memory with the pool, also storing the iterations when asked
+    static Rendering tiles (Mandlebrot &fractal, const TileOrder &order, ThreadPool &pool, bool field = true)
+    {
+        Rendering r {std::vector<float> (field ? fractal.width * fractal.height : 0), Image (fractal.width, fractal.height)};
+
+        Mandlebrot copy = copyOf (fractal);
+        copy.image = Image (r.image.data, r.image.stride, fractal.width, fractal.height, PixelFormat::RGB8);
+        copy.iterations = field ? r.field.data() : nullptr;
+        copy.iterationStride = fractal.width;
+        copy.computeMultiCore (order, pool);
+
+        return r;
+    }
+
+    // The ways of computing checked, the pools must live until they are used
+    std::vector<Variant> variants (std::vector<std::unique_ptr<ThreadPool>> &pools)
+    {
+        std::vector<Variant> list;
+
+        list.push_back ({"single", 0, 0, [] (Mandlebrot &fractal) 
+        {
+            Mandlebrot copy = copyOf (fractal);
+            copy.image = Image (fractal.width, fractal.height);
+            copy.computeSingleCore ();
+
+            return Rendering {{}, std::move (copy.image)};
+        }});
+
+        // The image can't depend on the number of threads
+        for (unsigned n : threadCounts)
+        {
+            pools.emplace_back (new ThreadPool (n));
+            ThreadPool *pool = pools.back ().get ();
+
+            list.push_back ({"tiles-" + std::to_string (n) + "-threads", 0, 0, [pool] (Mandlebrot &fractal)
+            {
+                return tiles (fractal, TileOrder::centerOut (), *pool);
+            }});
+        }
+
+        ThreadPool &pool = *pools.back ();
+
+        for (int64_t side : {16, 256})
+            list.push_back ({"tiles-" + std::to_string (side), 0, 0, [&pool, side] (Mandlebrot &fractal)
+            {
+                Mandlebrot copy = copyOf (fractal);
+                copy.tileSize = side;
+                return tiles (copy, TileOrder::focus (0, 0), pool);
+            }});
+
+        // The cache is filled by the first run, then the colors or the iterations are read from it,
+        // the colors of the stored iterations come from floats instead of doubles
+        std::string cacheDirectory = (directory / "cache").string ();
+
+        for (const char *name : {"cache-cold", "cache-colors", "cache-iterations"})
+            list.push_back ({name, 0, std::string (name) == "cache-iterations", [&pool, cacheDirectory, name] (Mandlebrot &fractal)
+            {
+                if (std::string (name) == "cache-cold")
+                    std::filesystem::remove_all (cacheDirectory);
+
+                TileCache cache (cacheDirectory);
+                Mandlebrot copy = copyOf (fractal);
+                copy.cache = &cache;
+
+                return tiles (copy, TileOrder::centerOut (), pool, std::string (name) != "cache-colors");
+            }});
+
+        // The rows written in order to a file
+        std::string png = (directory / "image.png").string ();
+
+        list.push_back ({"stream", 0, 0, [&pool, png] (Mandlebrot &fractal)
+        {
+            fractal.computeStream (png.c_str(), 64, 0, true, 1, pool);
+            return Rendering {{}, readPng (png)};
+        }});
+
+        list.push_back ({"pipelined", 0, 0, [&pool, png] (Mandlebrot &fractal)
+        {
+            Mandlebrot copy = copyOf (fractal);
+            copy.image = Image (fractal.width, fractal.height);
+            copy.computePipelined (png, FileFormat::PNG, 1, 1, pool);
+
+            return Rendering {{}, readPng (png)};
+        }});
+
+        // A pyramid whose tiles are larger than the image has only the image as its tile
+        std::string pyramidDirectory = (directory / "pyramid").string ();
+
+        list.push_back ({"pyramid-one-tile", 0, 0, [&pool, pyramidDirectory] (Mandlebrot &fractal)
+        {
+            int64_t side = (std::max (fractal.width, fractal.height) + 2) / 2 * 2;
+
+            std::filesystem::remove_all (pyramidDirectory);
+            Pyramid (fractal, pyramidDirectory, PyramidLayout::XYZ, side, 1).build (pool);
+
+            return Rendering {{}, readPng (pyramidDirectory + "/0/0/0.png")};
+        }});
+
+        // The fields saved and colored again, half floats keep 11 bits
+        std::string fieldFile = (directory / "image.mfield").string ();
+
+        for (bool half : {false, true})
+            list.push_back ({half ? "field-f16" : "field-f32", half ? 1e-3 : 0, 1, [&pool, fieldFile, half] (Mandlebrot &fractal)
+            {
+                IterationField::write (fractal, fieldFile, 64, half, false, true, pool);
+                IterationField field (fieldFile);
+
+                return Rendering {values (field), field.color (fractal, pool)};
+            }});
+
+        return list;
+    }
+
+    // Reads the smoothed iterations of a field
+    static std::vector<float> values (const IterationField &field)
+    {
+        const FieldHeader &header = *field.header;
+        std::vector<float> values (header.width * header.height);
+        std::vector<unsigned char> tile;
+
+        uint64_t side = header.tileSize;
+
+        for (uint64_t ty = 0; ty < header.tilesY; ty++)
+            for (uint64_t tx = 0; tx < header.tilesX; tx++)
+            {
+                field.readTile (tx, ty, tile);
+                const unsigned char *mask = tile.data() + IterationField::planeBytes (header);
+
+                for (uint64_t j = 0; j < side && ty * side + j < header.height; j++)
+                    for (uint64_t i = 0; i < side && tx * side + i < header.width; i++)
+                    {
+                        uint64_t p = j * side + i;
+                        bool inside = mask[p / 8] >> (p % 8) & 1;
+
+                        values[(ty * side + j) * header.width + tx * side + i] = 
+                            inside ? std::numeric_limits<float>::infinity () : field.value (tile.data(), p);
+                    }
+            }
+
+        return values;
+    }
+
+    // Compares a rendering with the reference
+    static Comparison compare (const Variant &variant, const Rendering &r, const Rendering &reference)
+    {
+        Comparison c;
+        c.variant = variant.name;
+
+        if (!r.field.empty ())
+        {
+            c.hasField = true;
+            int64_t outside = 0;
+
+            for (size_t p = 0; p < r.field.size(); p++)
+            {
+                float a = r.field[p], b = reference.field[p];
+
+                if (std::isinf (a) != std::isinf (b))
+                    c.interiorMismatches++;
+
+                else if (!std::isinf (b))
+                {
+                    double error = std::abs (a - b) / std::max (1.0f, std::abs (b));
+
+                    c.maxError = std::max (c.maxError, error);
+                    c.meanError += error;
+                    outside++;
+                }
+            }
+
+            c.meanError /= std::max<int64_t> (outside, 1);
+        }
+
+        if (r.image.width != reference.image.width || r.image.height != reference.image.height)
+        {
+            c.passed = false;
+            return c;
+        }
+
+        for (int64_t y = 0; y < r.image.height; y++)
+        {
+            const unsigned char *a = r.image.data + y * r.image.stride;
+            const unsigned char *b = reference.image.data + y * reference.image.stride;
+
+            for (int64_t x = 0; x < r.image.width; x++)
+            {
+                int difference = 0;
+
+                for (int k = 0; k < 3; k++)
+                    difference = std::max (difference, std::abs (a[3 * x + k] - b[3 * x + k]));
+
+                c.differingPixels += difference > 0;
+                c.maxChannelError = std::max (c.maxChannelError, difference);
+            }
+        }
+
+        c.passed = c.interiorMismatches == 0 && c.maxError <= variant.fieldTolerance && c.maxChannelError <= variant.colorTolerance;
+        return c;
+    }
+
+    // Checks all the ways of computing the fractal of a scene
+    std::vector<Comparison> run (const std::string &scene, Mandlebrot &fractal, 
+                                 const std::function<void (const std::string &)> &progress = nullptr)
+    {
+        Rendering golden = reference (fractal);
+
+        std::vector<std::unique_ptr<ThreadPool>> pools;
+        std::vector<Comparison> comparisons;
+
+        // The reference must match the golden file, which is created when missing
+        if (!goldenDirectory.empty ())
+        {
+            std::filesystem::create_directories (goldenDirectory);
+            std::string file = goldenDirectory + "/" + scene + "-" + std::to_string (fractal.width) + "x" + std::to_string (fractal.height) + ".png";
+
+            if (std::filesystem::exists (file))
+                comparisons.push_back (compare (Variant {"golden-file", 0, 0, nullptr}, Rendering {{}, readPng (file)}, golden));
+            else
+                golden.image.write (file, 9, FileFormat::PNG);
+        }
+
+        for (const Variant &variant : variants (pools))
+        {
+            if (progress)
+                progress (variant.name);
+
+            comparisons.push_back (compare (variant, variant.render (fractal), golden));
+        }
+
+        return comparisons;
+    }
+
+    // Numbers of threads of the pools computing the tiles
+    std::vector<unsigned> threadCounts;
+
+    // Where the files are written
+    std::filesystem::path directory;
+
+    // Where the reference images are kept, empty for nowhere
+    std::string goldenDirectory;
+};
+
+#endif